@@ -0,0 +1,323 @@
+/*
+ * binPollBench - compare polling mpptChgD with the text and binary TCP protocols
+ *
+ * Sends the same READ request to a running daemon with one request outstanding, first
+ * as a text command and then as a binary frame (mpptChgBin.h) on a connection switched
+ * with FORMAT=BINARY.  Reports requests/sec, bytes on the wire and client CPU time per
+ * request for each.  With -P the daemon's CPU time per request is also reported (read
+ * from /proc so the daemon must be on the same computer).  Also serves as an example of
+ * a binary protocol client.
+ *
+ * Usage: binPollBench [-p port] [-n requests] [-r reg,reg,...] [-P daemon pid]
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "mpptChgBin.h"
+
+
+typedef struct {
+	double sec;
+	double cpuSec;
+	double daemonSec;
+	long bytesOut;
+	long bytesIn;
+} result_t;
+
+int daemonPid = 0;
+
+
+double Now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + (ts.tv_nsec / 1e9);
+}
+
+
+double CpuSec()
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + (ru.ru_utime.tv_usec / 1e6) + ru.ru_stime.tv_sec + (ru.ru_stime.tv_usec / 1e6);
+}
+
+
+// User + system time of the daemon from /proc/<pid>/stat (fields 14 and 15)
+double DaemonSec()
+{
+	unsigned long utime, stime;
+	char buf[1024];
+	char* cp;
+	FILE* fp;
+	int i;
+
+	if (daemonPid == 0) {
+		return 0;
+	}
+	sprintf(buf, "/proc/%d/stat", daemonPid);
+	if ((fp = fopen(buf, "r")) == NULL) {
+		return 0;
+	}
+	cp = fgets(buf, sizeof(buf), fp);
+	fclose(fp);
+	if ((cp == NULL) || ((cp = strrchr(buf, ')')) == NULL)) {
+		return 0;
+	}
+	for (i=0; i<11; i++) {
+		if ((cp = strchr(cp + 1, ' ')) == NULL) {
+			return 0;
+		}
+	}
+	if (sscanf(cp, " %lu %lu", &utime, &stime) != 2) {
+		return 0;
+	}
+	return (double) (utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+
+int Connect(int port)
+{
+	struct sockaddr_in addr;
+	int fd, on = 1;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+		return -1;
+	}
+	(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+// Read a text response line (ended by "\n\r").  Returns its length or -1.
+int ReadLine(int fd, char* buf, int size)
+{
+	int len = 0;
+	int n;
+
+	while ((len < 2) || (buf[len-2] != '\n') || (buf[len-1] != '\r')) {
+		if ((len == size) || ((n = read(fd, &buf[len], size - len)) <= 0)) {
+			return -1;
+		}
+		len += n;
+	}
+	return len;
+}
+
+
+// Read one frame.  Returns its length or -1.
+int ReadFrame(int fd, uint8_t* buf)
+{
+	int len = 0;
+	int n, want = 2;
+
+	while (len < want) {
+		if ((n = read(fd, &buf[len], want - len)) <= 0) {
+			return -1;
+		}
+		len += n;
+		if (len == 2) {
+			want = 2 + MpptBinGet16(buf);
+			if ((want < MPPT_BIN_HDR_LEN) || (want > MPPT_BIN_MAX_LEN)) {
+				return -1;
+			}
+		}
+	}
+	return len;
+}
+
+
+bool RunText(int port, const char* regs, long n, result_t* r)
+{
+	char req[256];
+	char rsp[1024];
+	double start, cpu, dsec;
+	int fd, reqLen;
+	int len = 2;
+	long i;
+
+	if ((fd = Connect(port)) == -1) {
+		return false;
+	}
+	reqLen = sprintf(req, "READ=%s\n", regs);
+
+	start = Now();
+	cpu = CpuSec();
+	dsec = DaemonSec();
+	r->bytesOut = 0;
+	r->bytesIn = 0;
+	for (i=0; i<n; i++) {
+		if ((write(fd, req, reqLen) != reqLen) || ((len = ReadLine(fd, rsp, sizeof(rsp))) < 0)) {
+			close(fd);
+			return false;
+		}
+		r->bytesOut += reqLen;
+		r->bytesIn += len;
+	}
+	r->sec = Now() - start;
+	r->cpuSec = CpuSec() - cpu;
+	r->daemonSec = DaemonSec() - dsec;
+
+	printf("text   : %.*s\n", len - 2, rsp);
+	close(fd);
+	return true;
+}
+
+
+bool RunBinary(int port, const char* regs, long n, result_t* r)
+{
+	uint8_t req[MPPT_BIN_MAX_LEN];
+	uint8_t rsp[MPPT_BIN_MAX_LEN];
+	char regS[256];
+	char nameBuf[MPPT_BIN_MAX_LEN];
+	char* names[32];
+	double start, cpu, dsec;
+	uint32_t mask = 0;
+	uint32_t signedMask;
+	uint16_t v;
+	int fd, reqLen, len, numRegs, i, j;
+	char* cp;
+	long k;
+
+	if ((fd = Connect(port)) == -1) {
+		return false;
+	}
+	if ((write(fd, "FORMAT=BINARY\n", 14) != 14) || (ReadLine(fd, (char*) rsp, sizeof(rsp)) < 0)) {
+		close(fd);
+		return false;
+	}
+
+	// Get the register indices
+	reqLen = MpptBinPutHdr(req, 0, MPPT_BIN_OP_NAMES, 0, 0);
+	if ((write(fd, req, reqLen) != reqLen) || ((len = ReadFrame(fd, rsp)) < (MPPT_BIN_HDR_LEN + 12))) {
+		close(fd);
+		return false;
+	}
+	numRegs = MpptBinGet32(&rsp[MPPT_BIN_HDR_LEN]);
+	signedMask = MpptBinGet32(&rsp[MPPT_BIN_HDR_LEN + 4]);
+	memcpy(nameBuf, &rsp[MPPT_BIN_HDR_LEN + 12], len - (MPPT_BIN_HDR_LEN + 12));
+	cp = nameBuf;
+	for (i=0; (i<numRegs) && (i<32); i++) {
+		names[i] = cp;
+		cp += strlen(cp) + 1;
+	}
+	strncpy(regS, regs, sizeof(regS) - 1);
+	regS[sizeof(regS) - 1] = 0;
+	for (cp = strtok(regS, ","); cp != NULL; cp = strtok(NULL, ",")) {
+		for (j=0; (j<i) && (strcmp(cp, names[j]) != 0); j++) {}
+		if (j == i) {
+			printf("Unknown register %s\n", cp);
+			close(fd);
+			return false;
+		}
+		mask |= 1UL << j;
+	}
+
+	reqLen = MpptBinPutHdr(req, 4, MPPT_BIN_OP_READ, 0, 0);
+	MpptBinPut32(&req[MPPT_BIN_HDR_LEN], mask);
+
+	start = Now();
+	cpu = CpuSec();
+	dsec = DaemonSec();
+	r->bytesOut = 0;
+	r->bytesIn = 0;
+	for (k=0; k<n; k++) {
+		MpptBinPut32(&req[4], k);
+		if ((write(fd, req, reqLen) != reqLen) || ((len = ReadFrame(fd, rsp)) < 0) ||
+		    (MpptBinGet32(&rsp[4]) != (uint32_t) k) || (rsp[3] & MPPT_BIN_FLAG_ERROR)) {
+			close(fd);
+			return false;
+		}
+		r->bytesOut += reqLen;
+		r->bytesIn += len;
+	}
+	r->sec = Now() - start;
+	r->cpuSec = CpuSec() - cpu;
+	r->daemonSec = DaemonSec() - dsec;
+
+	printf("binary : T=%llu", (unsigned long long) MpptBinGet64(&rsp[MPPT_BIN_HDR_LEN + 4]));
+	for (i=0, j=0; i<numRegs; i++) {
+		if (mask & (1UL << i)) {
+			v = MpptBinGet16(&rsp[MPPT_BIN_HDR_LEN + 12 + (2 * j++)]);
+			printf(",%s=%d", names[i], (signedMask & (1UL << i)) ? (int) (int16_t) v : (int) v);
+		}
+	}
+	printf("\n");
+	close(fd);
+	return true;
+}
+
+
+void PrintResult(const char* name, long n, result_t* r)
+{
+	printf("%-7s: %9.0f req/sec  %5.1f bytes out  %5.1f bytes in  %6.2f client uSec",
+	       name, n / r->sec, (double) r->bytesOut / n, (double) r->bytesIn / n, 1e6 * r->cpuSec / n);
+	if (daemonPid != 0) {
+		printf("  %6.2f daemon uSec", 1e6 * r->daemonSec / n);
+	}
+	printf("  (per request)\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	result_t text, binary;
+	const char* regs = "VS,IS,VB,IB";
+	long n = 100000;
+	int port = 23000;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:n:r:P:h")) != -1) {
+		switch (opt) {
+			case 'p': port = atoi(optarg); break;
+			case 'n': n = atol(optarg); break;
+			case 'r': regs = optarg; break;
+			case 'P': daemonPid = atoi(optarg); break;
+			default:
+				printf("Usage: binPollBench [-p port] [-n requests] [-r reg,reg,...] [-P daemon pid]\n");
+				return 1;
+		}
+	}
+
+	if (!RunText(port, regs, n, &text) || !RunBinary(port, regs, n, &binary)) {
+		printf("Request failed - is mpptChgD running with TCP_PORT=%d?\n", port);
+		return 1;
+	}
+	PrintResult("text", n, &text);
+	PrintResult("binary", n, &binary);
+	return 0;
+}
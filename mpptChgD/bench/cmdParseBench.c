@@ -0,0 +1,165 @@
+/*
+ * cmdParseBench - microbenchmark for the mpptChgD command parser
+ *
+ * Measures commands/sec for the original command path (ini_parse_string() with a
+ * linear strcmp register search) and the current path (CmdTokenize() with the
+ * perfect hash register lookup) using a typical mix of client commands.  No charger
+ * access is performed, only parsing and register lookup.
+ *
+ * Usage: cmdParseBench [iterations]
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cmdParse.h"
+#include "ini.h"
+
+
+#define MATCH(n) strcmp(name, n) == 0
+
+const char* cmdMix[] = {
+	"READ=STATUS",
+	"READ=VS",
+	"READ=IS",
+	"READ=VB",
+	"READ=IB",
+	"READ=IC",
+	"READ=IT",
+	"READ=ET",
+	"READ=WDPWROFF",
+	"BULKV=14700",
+	"WDCNT=60",
+	"  READ = TH  "
+};
+
+#define NUM_MIX (sizeof(cmdMix) / sizeof(cmdMix[0]))
+
+// Sink so the compiler can't discard the work
+volatile int sink;
+
+
+//
+// Original path
+//
+int LinearFindCmdIndex(char* regS)
+{
+	int i = 0;
+
+	while (i < NUM_CMDS) {
+		if (strcmp(regS, cmdList[i].cName) == 0) {
+			return i;
+		}
+		i++;
+	}
+
+	return -1;
+}
+
+
+int OldKeyHandler(void* user, const char* section, const char* name, const char* value)
+{
+	if (MATCH("READ")) {
+		sink += LinearFindCmdIndex((char *) value);
+	} else {
+		sink += LinearFindCmdIndex((char *) name) + atoi(value);
+	}
+	return 1;
+}
+
+
+//
+// Current path
+//
+void NewCommand(char* line)
+{
+	char* name;
+	char* value;
+
+	if (CmdTokenize(line, &name, &value)) {
+		if (MATCH("READ")) {
+			sink += FindCmdIndex(value);
+		} else {
+			sink += FindCmdIndex(name) + atoi(value);
+		}
+	}
+}
+
+
+double ElapsedSec(struct timespec* start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + ((end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+
+int main(int argc, char *argv[])
+{
+	char lineBuf[NUM_MIX][64];
+	int lineLen[NUM_MIX];
+	char cmdBuf[64];
+	struct timespec start;
+	double oldSec, newSec;
+	long iterations = 1000000;
+	long i, n;
+	int j;
+
+	if (argc > 1) {
+		iterations = atol(argv[1]);
+	}
+
+	if (!CmdHashCheck()) {
+		printf("Command hash table does not match command list\n");
+		return 1;
+	}
+
+	for (j=0; j<NUM_MIX; j++) {
+		strcpy(lineBuf[j], cmdMix[j]);
+		lineLen[j] = strlen(cmdMix[j]) + 1;
+	}
+	n = iterations * NUM_MIX;
+
+	// Both paths start from a copy of the line since the daemon parses the connection's
+	// command buffer (ini_parse_string() makes its own copy internally)
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<iterations; i++) {
+		for (j=0; j<NUM_MIX; j++) {
+			memcpy(cmdBuf, lineBuf[j], lineLen[j]);
+			(void) ini_parse_string(cmdBuf, OldKeyHandler, NULL);
+		}
+	}
+	oldSec = ElapsedSec(&start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<iterations; i++) {
+		for (j=0; j<NUM_MIX; j++) {
+			memcpy(cmdBuf, lineBuf[j], lineLen[j]);
+			NewCommand(cmdBuf);
+		}
+	}
+	newSec = ElapsedSec(&start);
+
+	printf("%ld commands per path\n", n);
+	printf("ini_parse_string + linear search : %12.0f commands/sec\n", n / oldSec);
+	printf("CmdTokenize + perfect hash       : %12.0f commands/sec\n", n / newSec);
+	printf("Speedup                          : %12.1fx\n", oldSec / newSec);
+
+	return 0;
+}
@@ -0,0 +1,605 @@
+/*
+ * loadTest - load test and latency benchmark for mpptChgD
+ *
+ * Starts mpptChgD against the simulated charger (CHARGER=SIM) and drives it with a
+ * set of clients for a fixed time:
+ *
+ *   - TCP clients each issue commands from a weighted command mix, one at a time,
+ *     sending the next command as soon as the response to the last one arrives.
+ *   - An optional pty client does the same through /dev/mpptChg.
+ *   - Subscription clients subscribe once and count the pushed updates.
+ *
+ * Reports throughput, response latency percentiles and the number of charger bus
+ * transactions per client request as JSON.  Bus transactions come from the daemon's
+ * /metrics counter so they include its own periodic tasks.  Subscription delay is from
+ * the update's timestamp to its arrival (mSec resolution).  Only one pty client is
+ * possible since the daemon has one pseudo-tty.
+ *
+ * Usage: loadTest [options]
+ *   -b <file>     Daemon executable (default ../mpptChgD)
+ *   -c <n>        TCP clients (default 4)
+ *   -y            Add a pty client
+ *   -s <n>        Subscription clients (default 0)
+ *   -S <spec>     Subscription (default VB,IB,STATUS@1000)
+ *   -m <mix>      Command mix - commands separated by ';', each optionally prefixed
+ *                 with a weight and '*' (default "4*READ=VB;2*READ=STATUS;READ=VS,IS,VB,IB;READALL")
+ *   -t <secs>     Test duration (default 10)
+ *   -l <uSec>     Simulated bus latency per transaction (default 100)
+ *   -k <kHz>      Simulated bus clock (default 50)
+ *   -p <port>     TCP port (default 23500, /metrics on port+1)
+ *   -x <line>     Additional daemon config line (may be repeated)
+ *   -o <file>     Write the JSON results to a file instead of stdout
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+
+#define MAX_MIX           32
+#define MAX_EXTRA         16
+#define MAX_LINE          1024
+#define MAX_EVENTS        64
+#define RESP_TIMEOUT_MS   2000
+#define START_TIMEOUT_MS  5000
+#define PTY_NAME          "/dev/mpptChg"
+
+// Client types
+#define CLIENT_TCP        0
+#define CLIENT_PTY        1
+#define CLIENT_SUB        2
+
+typedef struct {
+	uint32_t* v;
+	long n;
+	long size;
+} samples_t;
+
+typedef struct {
+	int type;
+	int fd;
+	int inLen;
+	char inBuf[MAX_LINE];
+	bool waiting;
+	uint64_t sentUs;
+	long requests;
+	long errors;
+	samples_t lat;
+} client_t;
+
+typedef struct {
+	char cmd[128];
+	int weight;
+} mixEntry_t;
+
+
+mixEntry_t mix[MAX_MIX];
+int numMix = 0;
+int mixTotal = 0;
+unsigned int seed = 1;
+
+
+uint64_t GetUsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+uint64_t GetUnixMsec()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return ((uint64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+
+void AddSample(samples_t* s, uint32_t v)
+{
+	if (s->n == s->size) {
+		s->size = (s->size == 0) ? 4096 : s->size * 2;
+		if ((s->v = (uint32_t*) realloc(s->v, s->size * sizeof(uint32_t))) == NULL) {
+			fprintf(stderr, "Out of memory\n");
+			exit(1);
+		}
+	}
+	s->v[s->n++] = v;
+}
+
+
+int CompareU32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*) a;
+	uint32_t y = *(const uint32_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+
+// Sorts the samples
+uint32_t Percentile(samples_t* s, double p)
+{
+	long i;
+
+	if (s->n == 0) {
+		return 0;
+	}
+	i = (long) ((p * s->n) / 100.0);
+	if (i >= s->n) {
+		i = s->n - 1;
+	}
+	return s->v[i];
+}
+
+
+void PrintLatency(FILE* fp, const char* name, samples_t* s)
+{
+	double sum = 0;
+	long i;
+
+	qsort(s->v, s->n, sizeof(uint32_t), CompareU32);
+	for (i=0; i<s->n; i++) {
+		sum += s->v[i];
+	}
+	fprintf(fp, "\"%s\": {\"count\": %ld, \"mean\": %.1f, \"p50\": %u, \"p99\": %u, \"p999\": %u, \"max\": %u}",
+	        name, s->n, (s->n > 0) ? sum / s->n : 0.0, Percentile(s, 50.0), Percentile(s, 99.0),
+	        Percentile(s, 99.9), (s->n > 0) ? s->v[s->n - 1] : 0);
+}
+
+
+bool ParseMix(char* arg)
+{
+	char* cmd;
+	char* star;
+	char* save;
+
+	for (cmd = strtok_r(arg, ";", &save); cmd != NULL; cmd = strtok_r(NULL, ";", &save)) {
+		if (numMix == MAX_MIX) {
+			return false;
+		}
+		mix[numMix].weight = 1;
+		if ((star = strchr(cmd, '*')) != NULL) {
+			mix[numMix].weight = atoi(cmd);
+			cmd = star + 1;
+		}
+		if ((mix[numMix].weight < 1) || (strlen(cmd) == 0) || (strlen(cmd) >= sizeof(mix[0].cmd) - 1)) {
+			return false;
+		}
+		strcpy(mix[numMix].cmd, cmd);
+		mixTotal += mix[numMix].weight;
+		numMix++;
+	}
+
+	return (numMix > 0);
+}
+
+
+const char* PickCommand()
+{
+	int i, r;
+
+	r = rand_r(&seed) % mixTotal;
+	for (i=0; i<numMix-1; i++) {
+		if (r < mix[i].weight) {
+			break;
+		}
+		r -= mix[i].weight;
+	}
+	return mix[i].cmd;
+}
+
+
+bool SendLine(int fd, const char* line)
+{
+	char buf[MAX_LINE];
+	int len, n;
+
+	len = snprintf(buf, sizeof(buf), "%s\n", line);
+	while (len > 0) {
+		if ((n = write(fd, buf, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		len -= n;
+	}
+	return true;
+}
+
+
+void SendRequest(client_t* c)
+{
+	c->sentUs = GetUsec();
+	c->waiting = SendLine(c->fd, PickCommand());
+}
+
+
+int ConnectTcp(int port)
+{
+	struct sockaddr_in addr;
+	int fd;
+
+	if ((fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*) &addr, sizeof(addr)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+int OpenPty()
+{
+	struct termios t;
+	int fd;
+
+	if ((fd = open(PTY_NAME, O_RDWR | O_NOCTTY | O_CLOEXEC)) == -1) {
+		return -1;
+	}
+	if (tcgetattr(fd, &t) == 0) {
+		cfmakeraw(&t);
+		(void) tcsetattr(fd, TCSANOW, &t);
+	}
+	return fd;
+}
+
+
+// Read the daemon's I2C transaction counter from /metrics
+long long ReadBusCount(int port)
+{
+	char buf[16384];
+	char* cp;
+	int fd, len, n;
+
+	if ((fd = ConnectTcp(port)) == -1) {
+		return -1;
+	}
+	(void) SendLine(fd, "GET /metrics HTTP/1.0\r\n\r");
+	len = 0;
+	while ((len < (int) sizeof(buf) - 1) && ((n = read(fd, &buf[len], sizeof(buf) - 1 - len)) > 0)) {
+		len += n;
+	}
+	close(fd);
+	buf[len] = 0;
+
+	if ((cp = strstr(buf, "\nmpptchgd_i2c_transactions_total ")) == NULL) {
+		return -1;
+	}
+	return atoll(cp + strlen("\nmpptchgd_i2c_transactions_total "));
+}
+
+
+// Handle one line received by a client
+void HandleLine(client_t* c, char* line, uint64_t now, bool measuring)
+{
+	uint64_t t;
+	char* cp;
+
+	if (c->type == CLIENT_SUB) {
+		if ((strncmp(line, "SUB=", 4) == 0) && ((cp = strstr(line, ",T=")) != NULL)) {
+			// Delivery delay is from the sample's timestamp to its arrival
+			t = strtoull(cp + 3, NULL, 10);
+			if (measuring) {
+				c->requests++;
+				AddSample(&c->lat, (uint32_t) ((GetUnixMsec() - t) * 1000));
+			}
+		}
+		return;
+	}
+
+	if (c->waiting) {
+		if (measuring) {
+			c->requests++;
+			AddSample(&c->lat, (uint32_t) (now - c->sentUs));
+		}
+		c->waiting = false;
+	}
+}
+
+
+void HandleInput(client_t* c, bool measuring)
+{
+	char* cp;
+	char* eol;
+	uint64_t now;
+	int n;
+
+	if ((n = read(c->fd, &c->inBuf[c->inLen], sizeof(c->inBuf) - 1 - c->inLen)) <= 0) {
+		if ((n == 0) || ((errno != EAGAIN) && (errno != EINTR))) {
+			fprintf(stderr, "Client connection lost\n");
+			exit(1);
+		}
+		return;
+	}
+	now = GetUsec();
+	c->inLen += n;
+	c->inBuf[c->inLen] = 0;
+
+	// Responses end with "\n\r"
+	cp = c->inBuf;
+	while ((eol = strchr(cp, '\n')) != NULL) {
+		*eol = 0;
+		while (*cp == '\r') {
+			cp++;
+		}
+		if (*cp != 0) {
+			HandleLine(c, cp, now, measuring);
+		}
+		cp = eol + 1;
+	}
+	c->inLen -= cp - c->inBuf;
+	memmove(c->inBuf, cp, c->inLen);
+	if (c->inLen == sizeof(c->inBuf) - 1) {
+		c->inLen = 0;
+	}
+}
+
+
+pid_t StartDaemon(const char* daemon, const char* cfgName)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) == 0) {
+		// Keep the daemon's output out of the results
+		if ((fd = open("/dev/null", O_WRONLY)) != -1) {
+			dup2(fd, STDOUT_FILENO);
+		}
+		execl(daemon, daemon, "-f", cfgName, (char*) NULL);
+		fprintf(stderr, "Could not run %s: %s\n", daemon, strerror(errno));
+		_exit(1);
+	}
+	return pid;
+}
+
+
+void Usage()
+{
+	printf("loadTest [-b daemon] [-c tcpClients] [-y] [-s subClients] [-S subscription] [-m mix]\n");
+	printf("         [-t secs] [-l latencyUs] [-k busKhz] [-p port] [-x configLine] [-o file]\n");
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char* daemon = "../mpptChgD";
+	const char* subSpec = "VB,IB,STATUS@1000";
+	const char* extra[MAX_EXTRA];
+	char defMix[] = "4*READ=VB;2*READ=STATUS;READ=VS,IS,VB,IB;READALL";
+	char* mixArg = defMix;
+	char* outName = NULL;
+	char cfgName[] = "/tmp/loadTestXXXXXX";
+	char subCmd[MAX_LINE];
+	struct epoll_event ev, events[MAX_EVENTS];
+	samples_t all;
+	client_t* clients;
+	client_t* c;
+	FILE* fp;
+	pid_t pid;
+	uint64_t start, end, now;
+	long long bus0, bus1;
+	long requests, errors;
+	int numTcp = 4;
+	int numSub = 0;
+	int numClients, numExtra = 0;
+	int secs = 10;
+	int latencyUs = 100;
+	int busKhz = 50;
+	int port = 23500;
+	int epfd, fd, i, n, opt;
+	bool usePty = false;
+	double elapsed;
+
+	while ((opt = getopt(argc, argv, "b:c:ys:S:m:t:l:k:p:x:o:h")) != -1) {
+		switch (opt) {
+			case 'b': daemon = optarg; break;
+			case 'c': numTcp = atoi(optarg); break;
+			case 'y': usePty = true; break;
+			case 's': numSub = atoi(optarg); break;
+			case 'S': subSpec = optarg; break;
+			case 'm': mixArg = optarg; break;
+			case 't': secs = atoi(optarg); break;
+			case 'l': latencyUs = atoi(optarg); break;
+			case 'k': busKhz = atoi(optarg); break;
+			case 'p': port = atoi(optarg); break;
+			case 'x':
+				if (numExtra < MAX_EXTRA) {
+					extra[numExtra++] = optarg;
+				}
+				break;
+			case 'o': outName = optarg; break;
+			default:
+				Usage();
+				return 1;
+		}
+	}
+	if (!ParseMix(mixArg)) {
+		fprintf(stderr, "Bad command mix\n");
+		return 1;
+	}
+	if ((numTcp < 0) || (numSub < 0) || (secs < 1)) {
+		Usage();
+		return 1;
+	}
+	numClients = numTcp + numSub + (usePty ? 1 : 0);
+	if (numClients == 0) {
+		Usage();
+		return 1;
+	}
+
+	// Daemon configuration
+	if ((fd = mkstemp(cfgName)) == -1) {
+		fprintf(stderr, "Could not create config file\n");
+		return 1;
+	}
+	fp = fdopen(fd, "w");
+	fprintf(fp, "CHARGER=SIM\nSIM_LATENCY_US=%d\nSIM_BUS_KHZ=%d\n", latencyUs, busKhz);
+	fprintf(fp, "TCP_PORT=%d\nTCP_MAX=%d\nHTTP_PORT=%d\n", port, numTcp + numSub + 1, port + 1);
+	for (i=0; i<numExtra; i++) {
+		fprintf(fp, "%s\n", extra[i]);
+	}
+	fclose(fp);
+
+	signal(SIGPIPE, SIG_IGN);
+	if ((pid = StartDaemon(daemon, cfgName)) == -1) {
+		unlink(cfgName);
+		return 1;
+	}
+
+	// Connect the clients once the daemon is accepting connections
+	clients = (client_t*) calloc(numClients, sizeof(client_t));
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+	start = GetUsec();
+	for (i=0; i<numClients; i++) {
+		c = &clients[i];
+		c->type = (i < numTcp) ? CLIENT_TCP : ((i < numTcp + numSub) ? CLIENT_SUB : CLIENT_PTY);
+		do {
+			c->fd = (c->type == CLIENT_PTY) ? OpenPty() : ConnectTcp(port);
+			if (c->fd == -1) {
+				if ((waitpid(pid, NULL, WNOHANG) == pid) || ((GetUsec() - start) > START_TIMEOUT_MS * 1000)) {
+					fprintf(stderr, "Could not connect to the daemon\n");
+					kill(pid, SIGTERM);
+					unlink(cfgName);
+					return 1;
+				}
+				usleep(50000);
+			}
+		} while (c->fd == -1);
+		ev.events = EPOLLIN;
+		ev.data.ptr = c;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+	}
+	unlink(cfgName);
+
+	snprintf(subCmd, sizeof(subCmd), "SUBSCRIBE=%s", subSpec);
+	for (i=0; i<numClients; i++) {
+		if (clients[i].type == CLIENT_SUB) {
+			(void) SendLine(clients[i].fd, subCmd);
+		}
+	}
+
+	// Run
+	bus0 = ReadBusCount(port + 1);
+	start = GetUsec();
+	end = start + ((uint64_t) secs * 1000000);
+	for (i=0; i<numClients; i++) {
+		if (clients[i].type != CLIENT_SUB) {
+			SendRequest(&clients[i]);
+		}
+	}
+	while ((now = GetUsec()) < end) {
+		n = epoll_wait(epfd, events, MAX_EVENTS, 100);
+		for (i=0; i<n; i++) {
+			HandleInput((client_t*) events[i].data.ptr, true);
+		}
+
+		// Keep the request clients busy.  A command with no response is an error.
+		now = GetUsec();
+		for (i=0; i<numClients; i++) {
+			c = &clients[i];
+			if (c->type == CLIENT_SUB) {
+				continue;
+			}
+			if (c->waiting && ((now - c->sentUs) > (RESP_TIMEOUT_MS * 1000))) {
+				c->errors++;
+				c->waiting = false;
+			}
+			if (!c->waiting && (now < end)) {
+				SendRequest(c);
+			}
+		}
+	}
+	elapsed = (GetUsec() - start) / 1e6;
+	bus1 = ReadBusCount(port + 1);
+
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+
+	// Results
+	fp = stdout;
+	if ((outName != NULL) && ((fp = fopen(outName, "w")) == NULL)) {
+		fprintf(stderr, "Could not open %s\n", outName);
+		return 1;
+	}
+	memset(&all, 0, sizeof(all));
+	requests = 0;
+	errors = 0;
+	for (i=0; i<numClients; i++) {
+		c = &clients[i];
+		if (c->type != CLIENT_SUB) {
+			requests += c->requests;
+			errors += c->errors;
+			for (n=0; n<c->lat.n; n++) {
+				AddSample(&all, c->lat.v[n]);
+			}
+		}
+	}
+
+	fprintf(fp, "{\n  \"config\": {\"tcp_clients\": %d, \"pty_clients\": %d, \"sub_clients\": %d, ",
+	        numTcp, usePty ? 1 : 0, numSub);
+	fprintf(fp, "\"subscription\": \"%s\", \"duration_s\": %d, \"sim_latency_us\": %d, \"sim_bus_khz\": %d, \"mix\": [",
+	        subSpec, secs, latencyUs, busKhz);
+	for (i=0; i<numMix; i++) {
+		fprintf(fp, "%s{\"cmd\": \"%s\", \"weight\": %d}", (i == 0) ? "" : ", ", mix[i].cmd, mix[i].weight);
+	}
+	fprintf(fp, "]},\n  \"elapsed_s\": %.3f,\n  \"requests\": %ld,\n  \"errors\": %ld,\n", elapsed, requests, errors);
+	fprintf(fp, "  \"throughput_rps\": %.1f,\n  ", requests / elapsed);
+	PrintLatency(fp, "latency_us", &all);
+	fprintf(fp, ",\n  \"bus_transactions\": %lld,\n  \"bus_per_request\": %.3f,\n",
+	        ((bus0 >= 0) && (bus1 >= 0)) ? bus1 - bus0 : -1LL,
+	        ((bus0 >= 0) && (bus1 >= 0) && (requests > 0)) ? (double) (bus1 - bus0) / requests : -1.0);
+	fprintf(fp, "  \"clients\": [\n");
+	for (i=0; i<numClients; i++) {
+		c = &clients[i];
+		fprintf(fp, "    {\"type\": \"%s\", \"%s\": %ld, \"errors\": %ld, ",
+		        (c->type == CLIENT_TCP) ? "tcp" : ((c->type == CLIENT_PTY) ? "pty" : "sub"),
+		        (c->type == CLIENT_SUB) ? "updates" : "requests", c->requests, c->errors);
+		PrintLatency(fp, (c->type == CLIENT_SUB) ? "delay_us" : "latency_us", &c->lat);
+		fprintf(fp, "}%s\n", (i < numClients - 1) ? "," : "");
+	}
+	fprintf(fp, "  ]\n}\n");
+
+	if (fp != stdout) {
+		fclose(fp);
+	}
+	return 0;
+}
@@ -0,0 +1,87 @@
+/*
+ * shmReadBench - read the mpptChgD shared memory telemetry segment
+ *
+ * Prints the current values published by a running daemon (configured with SHM=1)
+ * and then measures how many consistent samples per second can be copied with
+ * MpptShmRead().  Also serves as an example of the reader API in mpptChgShm.h.
+ *
+ * Usage: shmReadBench [iterations]
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "mpptChgShm.h"
+
+
+double ElapsedSec(struct timespec* start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + ((end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+
+int main(int argc, char *argv[])
+{
+	mpptShmSample_t sample;
+	struct timespec start;
+	mpptShm_t* shm;
+	long iterations = 10000000;
+	long i, failed;
+	double sec;
+	int j;
+
+	if (argc > 1) {
+		iterations = atol(argv[1]);
+	}
+
+	if ((shm = MpptShmOpen(MPPT_SHM_NAME)) == NULL) {
+		printf("Could not open %s - is mpptChgD running with SHM=1?\n", MPPT_SHM_NAME);
+		return 1;
+	}
+
+	if (!MpptShmRead(shm, &sample)) {
+		printf("Could not read a consistent sample\n");
+		MpptShmClose(shm);
+		return 1;
+	}
+	printf("Daemon pid %u, sample %llu at %llu\n", shm->pid,
+		   (unsigned long long) sample.sampleCount, (unsigned long long) sample.timeMs);
+	for (j=0; j<(int) shm->numRegs; j++) {
+		if (sample.validMask & (1 << j)) {
+			printf("  %-10s %6d  (%llu mSec old)\n", shm->names[j], sample.val[j],
+				   (unsigned long long) (sample.timeMs - sample.valTimeMs[j]));
+		}
+	}
+
+	failed = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i=0; i<iterations; i++) {
+		if (!MpptShmRead(shm, &sample)) {
+			failed++;
+		}
+	}
+	sec = ElapsedSec(&start);
+
+	printf("%ld reads, %ld failed\n", iterations, failed);
+	printf("MpptShmRead : %12.0f samples/sec\n", iterations / sec);
+
+	MpptShmClose(shm);
+	return 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * binLog.c - mpptChgD binary ring log file
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "binLog.h"
+
+
+static bool BinLogMap(binLog_t* log, int prot)
+{
+	log->base = (unsigned char*) mmap(NULL, log->size, prot, MAP_SHARED, log->fd, 0);
+	if (log->base == MAP_FAILED) {
+		log->base = NULL;
+		return false;
+	}
+	log->hdr = (binLogHdr_t*) log->base;
+	return true;
+}
+
+
+static bool BinLogMatches(binLogHdr_t* hdr, int numRegs, const char** names,
+                          uint32_t signedMask, uint32_t numRecs)
+{
+	int i;
+
+	if ((hdr->magic != BINLOG_MAGIC) || (hdr->version != BINLOG_VERSION) ||
+	    (hdr->hdrSize != BINLOG_HDR_SIZE) || (hdr->recSize != BINLOG_REC_SIZE(numRegs)) ||
+	    (hdr->numRecs != numRecs) || (hdr->numRegs != numRegs) ||
+	    (hdr->signedMask != signedMask)) {
+		return false;
+	}
+
+	for (i=0; i<numRegs; i++) {
+		if (strncmp(hdr->names[i], names[i], BINLOG_NAME_LEN) != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+bool BinLogOpen(binLog_t* log, const char* fileName, int numRegs, const char** names,
+                uint32_t signedMask, uint32_t flags, uint32_t numRecs, int syncEvery)
+{
+	binLogHdr_t hdr;
+	struct stat st;
+	char* oldName;
+	int i;
+
+	if ((numRegs <= 0) || (numRegs > BINLOG_MAX_REGS) || (numRecs == 0)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	log->size = BINLOG_HDR_SIZE + ((size_t) numRecs * BINLOG_REC_SIZE(numRegs));
+	log->syncEvery = syncEvery;
+	log->unsynced = 0;
+	log->base = NULL;
+
+	// Continue an existing log if it holds the same registers, otherwise move it aside
+	if ((log->fd = open(fileName, O_RDWR | O_CLOEXEC)) != -1) {
+		if ((pread(log->fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) &&
+		    BinLogMatches(&hdr, numRegs, names, signedMask, numRecs) &&
+		    (fstat(log->fd, &st) == 0) && (st.st_size == (off_t) log->size)) {
+			if (BinLogMap(log, PROT_READ | PROT_WRITE)) {
+				log->hdr->flags = flags;
+				log->head = log->hdr->head;
+				return true;
+			}
+			close(log->fd);
+			return false;
+		}
+		close(log->fd);
+
+		if ((oldName = (char*) malloc(strlen(fileName) + 5)) == NULL) {
+			return false;
+		}
+		sprintf(oldName, "%s.old", fileName);
+		i = rename(fileName, oldName);
+		free(oldName);
+		if (i == -1) {
+			return false;
+		}
+	}
+
+	// Create a new log with all of its space allocated up front
+	if ((log->fd = open(fileName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH)) == -1) {
+		return false;
+	}
+	if (((errno = posix_fallocate(log->fd, 0, log->size)) != 0) ||
+	    !BinLogMap(log, PROT_READ | PROT_WRITE)) {
+		close(log->fd);
+		unlink(fileName);
+		return false;
+	}
+
+	log->hdr->version = BINLOG_VERSION;
+	log->hdr->hdrSize = BINLOG_HDR_SIZE;
+	log->hdr->recSize = BINLOG_REC_SIZE(numRegs);
+	log->hdr->numRecs = numRecs;
+	log->hdr->numRegs = numRegs;
+	log->hdr->signedMask = signedMask;
+	log->hdr->flags = flags;
+	log->hdr->head = 0;
+	for (i=0; i<numRegs; i++) {
+		strncpy(log->hdr->names[i], names[i], BINLOG_NAME_LEN - 1);
+	}
+	log->hdr->magic = BINLOG_MAGIC;
+	log->head = 0;
+
+	return (msync(log->base, BINLOG_HDR_SIZE, MS_SYNC) == 0);
+}
+
+
+bool BinLogAppend(binLog_t* log, uint64_t tMs, const int* vals)
+{
+	unsigned char* rec;
+	uint32_t t;
+	uint16_t v;
+	int i;
+
+	rec = log->base + log->hdr->hdrSize +
+	      ((size_t) (log->head % log->hdr->numRecs) * log->hdr->recSize);
+	t = (uint32_t) (tMs / 1000);
+	v = (uint16_t) (tMs % 1000);
+	memcpy(rec, &t, sizeof(t));
+	memcpy(rec + sizeof(t), &v, sizeof(v));
+	for (i=0; i<(int) log->hdr->numRegs; i++) {
+		v = (uint16_t) vals[i];
+		memcpy(rec + 6 + (i * sizeof(v)), &v, sizeof(v));
+	}
+
+	// Only count the record once it is complete
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	log->hdr->head = ++log->head;
+
+	if ((log->syncEvery > 0) && (++log->unsynced >= log->syncEvery)) {
+		log->unsynced = 0;
+		return (msync(log->base, log->size, MS_SYNC) == 0);
+	}
+
+	return true;
+}
+
+
+bool BinLogOpenRead(binLog_t* log, const char* fileName)
+{
+	binLogHdr_t hdr;
+	struct stat st;
+
+	log->base = NULL;
+	log->syncEvery = 0;
+	log->unsynced = 0;
+	if ((log->fd = open(fileName, O_RDONLY | O_CLOEXEC)) == -1) {
+		return false;
+	}
+
+	if ((pread(log->fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) ||
+	    (hdr.magic != BINLOG_MAGIC) || ((hdr.version != BINLOG_VERSION) && (hdr.version != 1)) ||
+	    (hdr.numRegs == 0) || (hdr.numRegs > BINLOG_MAX_REGS) ||
+	    (hdr.recSize < ((hdr.version == 1) ? BINLOG_V1_REC_SIZE(hdr.numRegs) : BINLOG_REC_SIZE(hdr.numRegs))) ||
+	    (hdr.numRecs == 0)) {
+		close(log->fd);
+		errno = EINVAL;
+		return false;
+	}
+
+	log->size = hdr.hdrSize + ((size_t) hdr.numRecs * hdr.recSize);
+	if ((fstat(log->fd, &st) == -1) || (st.st_size < (off_t) log->size)) {
+		close(log->fd);
+		errno = EINVAL;
+		return false;
+	}
+
+	if (!BinLogMap(log, PROT_READ)) {
+		close(log->fd);
+		return false;
+	}
+
+	// Records written by the daemon after this point are not seen
+	log->head = log->hdr->head;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	return true;
+}
+
+
+uint32_t BinLogCount(binLog_t* log)
+{
+	return (log->head < log->hdr->numRecs) ? (uint32_t) log->head : log->hdr->numRecs;
+}
+
+
+void BinLogGet(binLog_t* log, uint32_t n, uint64_t* tMs, int* vals)
+{
+	unsigned char* rec;
+	uint64_t first;
+	uint32_t t;
+	uint16_t v;
+	int i, valOffset;
+
+	first = log->head - BinLogCount(log);
+	rec = log->base + log->hdr->hdrSize +
+	      ((size_t) ((first + n) % log->hdr->numRecs) * log->hdr->recSize);
+	memcpy(&t, rec, sizeof(t));
+	if (log->hdr->version == 1) {
+		v = 0;
+		valOffset = 4;
+	} else {
+		memcpy(&v, rec + sizeof(t), sizeof(v));
+		valOffset = 6;
+	}
+	*tMs = ((uint64_t) t * 1000) + v;
+	for (i=0; i<(int) log->hdr->numRegs; i++) {
+		memcpy(&v, rec + valOffset + (i * sizeof(v)), sizeof(v));
+		vals[i] = (log->hdr->signedMask & (1 << i)) ? (int) (int16_t) v : (int) v;
+	}
+}
+
+
+void BinLogClose(binLog_t* log)
+{
+	if (log->base != NULL) {
+		if (log->syncEvery > 0) {
+			(void) msync(log->base, log->size, MS_SYNC);
+		}
+		munmap(log->base, log->size);
+		log->base = NULL;
+	}
+	close(log->fd);
+}
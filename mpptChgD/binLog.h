@@ -0,0 +1,107 @@
+/*
+ * binLog.h - mpptChgD binary ring log file
+ *
+ * A fixed size file holding a ring of fixed size records.  The file starts with a
+ * header page describing the logged registers followed by the record slots.  Each
+ * record holds a timestamp (Unix time in seconds and mSec) and one 16-bit value for
+ * each logged register.  Version 1 records have no mSec and can still be read.  The file is preallocated when created so it never grows and is
+ * written through a shared memory mapping so appending a record is a memory copy.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __BINLOG_H__
+#define __BINLOG_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+
+//
+// Constants
+//
+#define BINLOG_MAGIC       0x4D50504C
+#define BINLOG_VERSION     2
+
+#define BINLOG_MAX_REGS    32
+#define BINLOG_NAME_LEN    12
+
+// The header occupies the first page so the records start page aligned
+#define BINLOG_HDR_SIZE    4096
+
+// Header flags
+#define BINLOG_FLAG_MSEC   0x00000001      // Written more than once per second
+
+
+//
+// File layout
+//
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t hdrSize;
+	uint32_t recSize;
+	uint32_t numRecs;                       // Ring capacity
+	uint32_t numRegs;                       // Values per record
+	uint32_t signedMask;                    // Bit n set if value n is signed
+	uint32_t flags;                         // BINLOG_FLAG_* of the latest writer
+	uint64_t head;                          // Number of records ever written
+	char names[BINLOG_MAX_REGS][BINLOG_NAME_LEN];
+} binLogHdr_t;
+
+// Records are a uint32_t timestamp (seconds) and uint16_t mSec followed by numRegs
+// 16-bit values, padded to a multiple of 4 bytes.  Version 1 records have no mSec.
+#define BINLOG_REC_SIZE(n)    ((6 + (2 * (n)) + 3) & ~3)
+#define BINLOG_V1_REC_SIZE(n) ((4 + (2 * (n)) + 3) & ~3)
+
+
+typedef struct {
+	int fd;
+	unsigned char* base;
+	size_t size;
+	binLogHdr_t* hdr;
+	uint64_t head;
+	int syncEvery;
+	int unsynced;
+} binLog_t;
+
+
+//
+// API - functions return false with errno set on failure
+//
+
+// Open a log for writing, creating it (preallocated to hold numRecs records) if it does
+// not exist.  An existing log with a different set of registers or size is renamed
+// with ".old" appended and a new one created.  The file is synced to disk after every
+// syncEvery records (0 leaves it to the kernel).  flags replace the header's flags.
+bool BinLogOpen(binLog_t* log, const char* fileName, int numRegs, const char** names,
+                uint32_t signedMask, uint32_t flags, uint32_t numRecs, int syncEvery);
+
+// Append a record containing the timestamp (Unix time in mSec) and numRegs values
+bool BinLogAppend(binLog_t* log, uint64_t tMs, const int* vals);
+
+// Open an existing log read-only
+bool BinLogOpenRead(binLog_t* log, const char* fileName);
+
+// Returns the number of records held by the log
+uint32_t BinLogCount(binLog_t* log);
+
+// Get record n (0 is the oldest record held).  tMs is Unix time in mSec.
+void BinLogGet(binLog_t* log, uint32_t n, uint64_t* tMs, int* vals);
+
+void BinLogClose(binLog_t* log);
+
+#endif /* __BINLOG_H__ */
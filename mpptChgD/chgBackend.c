@@ -0,0 +1,347 @@
+/*
+ * chgBackend.c - mpptChgD charger access backends and the I2C backend
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "chgBackend.h"
+#ifndef NO_WIRINGPI
+#include "wiringPi.h"
+#include "wiringPiI2C.h"
+#endif
+
+
+typedef struct {
+	int fd;
+	int addr;
+	int bus;
+	bool wiringPi;              // fd is from wiringPiI2CSetup
+} chgI2c_t;
+
+
+uint64_t ChgMsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+// Each transaction takes the fixed latency plus 9 bit times (8 data bits and ACK) for
+// the address byte, register byte, repeated-start address byte (reads) and data bytes
+void ChgBusDelay(chgBackend_t* b, int len)
+{
+	struct timespec ts;
+	uint64_t ns;
+
+	ns = (uint64_t) b->latencyUs * 1000;
+	if (b->busKhz > 0) {
+		ns += ((uint64_t) (len + 3) * 9 * 1000000) / b->busKhz;
+	}
+	if (ns > 0) {
+		ts.tv_sec = ns / 1000000000;
+		ts.tv_nsec = ns % 1000000000;
+		while ((nanosleep(&ts, &ts) == -1) && (errno == EINTR)) {}
+	}
+}
+
+
+static void ChgRecord(chgBackend_t* b, char dir, int regAddr, int len, const unsigned char* buf, bool success)
+{
+	int i;
+
+	fprintf(b->recFp, "%llu %c %d", (unsigned long long) (ChgMsec() - b->recStart), dir, regAddr);
+	if (success) {
+		fputc(' ', b->recFp);
+		for (i=0; i<len; i++) {
+			fprintf(b->recFp, "%02X", buf[i]);
+		}
+	} else {
+		fprintf(b->recFp, " %d ERR", len);
+	}
+	fputc('\n', b->recFp);
+}
+
+
+//
+// I2C backend
+//
+static bool ChgI2cRead(chgBackend_t* b, int regAddr, int len, unsigned char* buf)
+{
+	chgI2c_t* c = (chgI2c_t*) b->priv;
+	struct i2c_msg msgs[2];
+	struct i2c_rdwr_ioctl_data xfer;
+	unsigned char reg = (unsigned char) regAddr;
+#ifndef NO_WIRINGPI
+	int v;
+
+	if (c->wiringPi && (len <= 2)) {
+		if (len == 2) {
+			// wiringPi returns the first byte in the low half
+			if ((v = wiringPiI2CReadReg16(c->fd, regAddr)) == -1) {
+				return false;
+			}
+			buf[0] = v & 0xFF;
+			buf[1] = (v >> 8) & 0xFF;
+		} else {
+			if ((v = wiringPiI2CReadReg8(c->fd, regAddr)) == -1) {
+				return false;
+			}
+			buf[0] = v & 0xFF;
+		}
+		return true;
+	}
+#endif
+
+	// Combined register pointer write followed by a repeated-start read
+	msgs[0].addr = c->addr;
+	msgs[0].flags = 0;
+	msgs[0].len = 1;
+	msgs[0].buf = &reg;
+	msgs[1].addr = c->addr;
+	msgs[1].flags = I2C_M_RD;
+	msgs[1].len = len;
+	msgs[1].buf = buf;
+	xfer.msgs = msgs;
+	xfer.nmsgs = 2;
+
+	return (ioctl(c->fd, I2C_RDWR, &xfer) == 2);
+}
+
+
+static bool ChgI2cWrite(chgBackend_t* b, int regAddr, int len, const unsigned char* buf)
+{
+	chgI2c_t* c = (chgI2c_t*) b->priv;
+	struct i2c_msg msg;
+	struct i2c_rdwr_ioctl_data xfer;
+	unsigned char wBuf[CHG_MAX_XFER + 1];
+
+#ifndef NO_WIRINGPI
+	if (c->wiringPi) {
+		if (len == 2) {
+			return (wiringPiI2CWriteReg16(c->fd, regAddr, buf[0] | (buf[1] << 8)) != -1);
+		} else if (len == 1) {
+			return (wiringPiI2CWriteReg8(c->fd, regAddr, buf[0]) != -1);
+		}
+	}
+#endif
+
+	wBuf[0] = (unsigned char) regAddr;
+	memcpy(&wBuf[1], buf, len);
+	msg.addr = c->addr;
+	msg.flags = 0;
+	msg.len = len + 1;
+	msg.buf = wBuf;
+	xfer.msgs = &msg;
+	xfer.nmsgs = 1;
+
+	return (ioctl(c->fd, I2C_RDWR, &xfer) == 1);
+}
+
+
+// Open the bus device and select the charger
+static int ChgI2cOpenFd(chgI2c_t* c)
+{
+	char devName[32];
+	int fd;
+
+	if (!c->wiringPi) {
+		sprintf(devName, "/dev/i2c-%d", c->bus);
+		fd = open(devName, O_RDWR | O_CLOEXEC);
+		if ((fd != -1) && (ioctl(fd, I2C_SLAVE, c->addr) == -1)) {
+			close(fd);
+			fd = -1;
+		}
+	} else {
+#ifndef NO_WIRINGPI
+		fd = wiringPiI2CSetup(c->addr);
+#else
+		// Built without wiringPi so the bus must be specified
+		errno = ENODEV;
+		fd = -1;
+#endif
+	}
+
+	return fd;
+}
+
+
+static bool ChgI2cReopen(chgBackend_t* b)
+{
+	chgI2c_t* c = (chgI2c_t*) b->priv;
+
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+	c->fd = ChgI2cOpenFd(c);
+	return (c->fd != -1);
+}
+
+
+static void ChgI2cClose(chgBackend_t* b)
+{
+	chgI2c_t* c = (chgI2c_t*) b->priv;
+
+	if (c->fd != -1) {
+		close(c->fd);
+	}
+	free(c);
+}
+
+
+bool ChgI2cOpen(chgBackend_t* b, chgBackendParams_t* p)
+{
+	chgI2c_t* c;
+
+	if ((c = (chgI2c_t*) malloc(sizeof(chgI2c_t))) == NULL) {
+		return false;
+	}
+	c->addr = p->i2cAddr;
+	c->bus = p->i2cBus;
+	c->wiringPi = (p->i2cBus < 0);
+
+	if ((c->fd = ChgI2cOpenFd(c)) == -1) {
+		free(c);
+		return false;
+	}
+
+	b->read = ChgI2cRead;
+	b->write = ChgI2cWrite;
+	b->reopen = ChgI2cReopen;
+	b->close = ChgI2cClose;
+	b->priv = c;
+	return true;
+}
+
+
+//
+// API
+//
+chgBackend_t* ChgBackendOpen(chgBackendParams_t* p)
+{
+	chgBackend_t* b;
+	bool success;
+	int e;
+
+	if ((b = (chgBackend_t*) calloc(1, sizeof(chgBackend_t))) == NULL) {
+		return NULL;
+	}
+	b->latencyUs = p->latencyUs;
+	b->busKhz = p->busKhz;
+
+	switch (p->type) {
+		case CHG_BACKEND_I2C:
+			success = ChgI2cOpen(b, p);
+			break;
+		case CHG_BACKEND_SIM:
+			success = ChgSimOpen(b, p);
+			break;
+		case CHG_BACKEND_REPLAY:
+			success = ChgReplayOpen(b, p);
+			break;
+		default:
+			errno = EINVAL;
+			success = false;
+	}
+	if (!success) {
+		e = errno;
+		free(b);
+		errno = e;
+		return NULL;
+	}
+
+	if (p->recordFile != NULL) {
+		if ((b->recFp = fopen(p->recordFile, "we")) == NULL) {
+			e = errno;
+			b->close(b);
+			free(b);
+			errno = e;
+			return NULL;
+		}
+		setvbuf(b->recFp, NULL, _IOLBF, 0);
+		b->recStart = ChgMsec();
+	}
+
+	return b;
+}
+
+
+bool ChgRead(chgBackend_t* b, int regAddr, int len, unsigned char* buf)
+{
+	bool success;
+	int e;
+
+	if ((len < 1) || (len > CHG_MAX_XFER)) {
+		errno = EINVAL;
+		return false;
+	}
+	success = b->read(b, regAddr, len, buf);
+	if (b->recFp != NULL) {
+		e = errno;
+		ChgRecord(b, 'R', regAddr, len, buf, success);
+		errno = e;
+	}
+	return success;
+}
+
+
+bool ChgWrite(chgBackend_t* b, int regAddr, int len, const unsigned char* buf)
+{
+	bool success;
+	int e;
+
+	if ((len < 1) || (len > CHG_MAX_XFER)) {
+		errno = EINVAL;
+		return false;
+	}
+	success = b->write(b, regAddr, len, buf);
+	if (b->recFp != NULL) {
+		e = errno;
+		ChgRecord(b, 'W', regAddr, len, buf, success);
+		errno = e;
+	}
+	return success;
+}
+
+
+bool ChgBackendReopen(chgBackend_t* b)
+{
+	if (b->reopen == NULL) {
+		return true;
+	}
+	return b->reopen(b);
+}
+
+
+void ChgBackendClose(chgBackend_t* b)
+{
+	if (b != NULL) {
+		if (b->recFp != NULL) {
+			fclose(b->recFp);
+		}
+		b->close(b);
+		free(b);
+	}
+}
@@ -0,0 +1,110 @@
+/*
+ * chgBackend.h - mpptChgD charger access backends
+ *
+ * All charger access goes through a backend that performs register transactions in
+ * the charger's SMBus format: a read or write of len bytes starting at a register
+ * address with 16-bit values sent high byte first.  Backends are:
+ *
+ *   CHG_BACKEND_I2C    - The real charger through i2c-dev (or wiringPi)
+ *   CHG_BACKEND_SIM    - A simulated charger modelling the firmware's register map
+ *   CHG_BACKEND_REPLAY - Plays back a file recorded from another backend
+ *
+ * Any backend's transactions may be recorded to a file for later replay.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __CHGBACKEND_H__
+#define __CHGBACKEND_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+//
+// Constants
+//
+#define CHG_BACKEND_I2C     0
+#define CHG_BACKEND_SIM     1
+#define CHG_BACKEND_REPLAY  2
+
+// Charger register address space
+#define CHG_NUM_REGS        38
+
+// Maximum bytes in one transaction
+#define CHG_MAX_XFER        32
+
+
+typedef struct {
+	int type;
+	int i2cBus;                 // /dev/i2c-<N> or -1 for wiringPi's default bus
+	int i2cAddr;
+	const char* recordFile;     // Record transactions to this file (NULL for none)
+	const char* replayFile;     // CHG_BACKEND_REPLAY recording
+	int latencyUs;              // SIM/REPLAY: fixed time per transaction
+	int busKhz;                 // SIM/REPLAY: bus clock for the per-byte time (0 for none)
+	int simSpeed;               // SIM: simulated seconds per real second
+	int simFailRate;            // SIM: transactions per 1000 that fail
+	int simOutageStart;         // SIM: seconds after opening the charger stops responding
+	int simOutageSecs;          // SIM: for this long (0 for never)
+	int simResetSecs;           // SIM: seconds after opening the firmware restarts (0 for never)
+} chgBackendParams_t;
+
+typedef struct chgBackend_t {
+	bool (*read)(struct chgBackend_t* b, int regAddr, int len, unsigned char* buf);
+	bool (*write)(struct chgBackend_t* b, int regAddr, int len, const unsigned char* buf);
+	bool (*reopen)(struct chgBackend_t* b);     // NULL if there is nothing to reopen
+	void (*close)(struct chgBackend_t* b);
+	FILE* recFp;
+	uint64_t recStart;
+	int latencyUs;
+	int busKhz;
+	void* priv;
+} chgBackend_t;
+
+
+//
+// API - functions return false (or NULL) with errno set on failure
+//
+
+// Open the backend selected by the parameters
+chgBackend_t* ChgBackendOpen(chgBackendParams_t* p);
+
+// Register transactions
+bool ChgRead(chgBackend_t* b, int regAddr, int len, unsigned char* buf);
+bool ChgWrite(chgBackend_t* b, int regAddr, int len, const unsigned char* buf);
+
+// Reopen the interface to the charger after a link failure.  Backend state, including
+// a recording in progress, is kept.
+bool ChgBackendReopen(chgBackend_t* b);
+
+void ChgBackendClose(chgBackend_t* b);
+
+
+//
+// Backend implementations - used by ChgBackendOpen
+//
+bool ChgI2cOpen(chgBackend_t* b, chgBackendParams_t* p);
+bool ChgSimOpen(chgBackend_t* b, chgBackendParams_t* p);
+bool ChgReplayOpen(chgBackend_t* b, chgBackendParams_t* p);
+
+// Sleep for the simulated bus time of a transaction of len data bytes
+void ChgBusDelay(chgBackend_t* b, int len);
+
+// Monotonic time in mSec
+uint64_t ChgMsec();
+
+#endif /* __CHGBACKEND_H__ */
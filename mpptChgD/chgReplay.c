@@ -0,0 +1,246 @@
+/*
+ * chgReplay.c - mpptChgD record/replay charger backend
+ *
+ * Plays back a transaction recording made with CHARGER_RECORD.  Each line of a
+ * recording is one transaction:
+ *
+ *   <mSec> R <reg> <hex data>      Successful read
+ *   <mSec> W <reg> <hex data>      Successful write
+ *   <mSec> R|W <reg> <len> ERR     Failed transaction
+ *
+ * where mSec is the time since the recording started.  The recorded reads are applied
+ * to an image of the charger's registers as their time arrives and reads are served
+ * from the image, so the daemon sees the recorded values on the recorded timeline
+ * regardless of what or how often it reads.  A recorded failure makes the next read
+ * fail.  Writes update the image.  The recording loops when it reaches the end.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "chgBackend.h"
+
+
+#define REPLAY_IMAGE_SIZE     256
+#define REPLAY_LINE_LEN       128
+
+
+typedef struct {
+	uint64_t t;
+	bool isRead;
+	bool ok;
+	unsigned char reg;
+	unsigned char len;
+	unsigned char data[CHG_MAX_XFER];
+} replayEntry_t;
+
+typedef struct {
+	replayEntry_t* entries;
+	int numEntries;
+	int next;                   // Next entry to apply
+	uint64_t startMs;           // Time the current pass through the recording started
+	int pendingFail;            // Recorded failures not yet returned
+	unsigned char image[REPLAY_IMAGE_SIZE];
+	bool known[REPLAY_IMAGE_SIZE];
+} chgReplay_t;
+
+
+static bool ReplayParseLine(char* line, replayEntry_t* e)
+{
+	unsigned long long t;
+	char dir;
+	char data[2*CHG_MAX_XFER + 1];
+	char tail[8];
+	unsigned int b;
+	int reg, len, n, i;
+
+	n = sscanf(line, "%llu %c %d %64s %7s", &t, &dir, &reg, data, tail);
+	if ((n < 4) || ((dir != 'R') && (dir != 'W')) || (reg < 0) || (reg >= REPLAY_IMAGE_SIZE)) {
+		return false;
+	}
+	e->t = t;
+	e->isRead = (dir == 'R');
+	e->reg = reg;
+
+	if ((n == 5) && (strcmp(tail, "ERR") == 0)) {
+		len = atoi(data);
+		if ((len < 1) || (len > CHG_MAX_XFER)) {
+			return false;
+		}
+		e->ok = false;
+		e->len = len;
+		return true;
+	}
+
+	len = strlen(data);
+	if ((n != 4) || (len < 2) || (len > 2*CHG_MAX_XFER) || (len & 1)) {
+		return false;
+	}
+	for (i=0; i<len/2; i++) {
+		if (sscanf(&data[2*i], "%2x", &b) != 1) {
+			return false;
+		}
+		e->data[i] = b;
+	}
+	e->ok = true;
+	e->len = len / 2;
+	return true;
+}
+
+
+static void ReplaySetImage(chgReplay_t* r, int reg, int len, const unsigned char* data)
+{
+	int i;
+
+	for (i=0; i<len; i++) {
+		r->image[(reg + i) % REPLAY_IMAGE_SIZE] = data[i];
+		r->known[(reg + i) % REPLAY_IMAGE_SIZE] = true;
+	}
+}
+
+
+// Apply the recorded reads whose time has arrived.  A pass through the recording
+// ends 1 mSec after its last entry so startMs may move past now when it wraps.
+static void ReplayAdvance(chgReplay_t* r)
+{
+	replayEntry_t* e;
+	uint64_t now;
+
+	now = ChgMsec();
+	while (now >= (r->startMs + r->entries[r->next].t)) {
+		e = &r->entries[r->next];
+		if (e->isRead) {
+			if (e->ok) {
+				ReplaySetImage(r, e->reg, e->len, e->data);
+			} else {
+				r->pendingFail++;
+			}
+		}
+		if (++r->next == r->numEntries) {
+			r->startMs += r->entries[r->numEntries - 1].t + 1;
+			r->next = 0;
+		}
+	}
+}
+
+
+static bool ChgReplayRead(chgBackend_t* b, int regAddr, int len, unsigned char* buf)
+{
+	chgReplay_t* r = (chgReplay_t*) b->priv;
+	int i, n;
+
+	ChgBusDelay(b, len);
+	ReplayAdvance(r);
+
+	if (r->pendingFail > 0) {
+		r->pendingFail--;
+		errno = EIO;
+		return false;
+	}
+	for (i=0; i<len; i++) {
+		n = (regAddr + i) % REPLAY_IMAGE_SIZE;
+		if (!r->known[n]) {
+			// Never read in the recording so there is nothing to return
+			errno = ENODATA;
+			return false;
+		}
+		buf[i] = r->image[n];
+	}
+	return true;
+}
+
+
+static bool ChgReplayWrite(chgBackend_t* b, int regAddr, int len, const unsigned char* buf)
+{
+	chgReplay_t* r = (chgReplay_t*) b->priv;
+
+	ChgBusDelay(b, len);
+	ReplayAdvance(r);
+	ReplaySetImage(r, regAddr, len, buf);
+	return true;
+}
+
+
+static void ChgReplayClose(chgBackend_t* b)
+{
+	chgReplay_t* r = (chgReplay_t*) b->priv;
+
+	free(r->entries);
+	free(r);
+}
+
+
+bool ChgReplayOpen(chgBackend_t* b, chgBackendParams_t* p)
+{
+	chgReplay_t* r;
+	replayEntry_t* e;
+	FILE* fp;
+	char line[REPLAY_LINE_LEN];
+	int size, i, j;
+
+	if ((p->replayFile == NULL) || ((fp = fopen(p->replayFile, "re")) == NULL)) {
+		if (p->replayFile == NULL) {
+			errno = EINVAL;
+		}
+		return false;
+	}
+	if ((r = (chgReplay_t*) calloc(1, sizeof(chgReplay_t))) == NULL) {
+		fclose(fp);
+		return false;
+	}
+
+	size = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		if (r->numEntries == size) {
+			size = (size == 0) ? 1024 : size * 2;
+			if ((e = (replayEntry_t*) realloc(r->entries, size * sizeof(replayEntry_t))) == NULL) {
+				break;
+			}
+			r->entries = e;
+		}
+		if (ReplayParseLine(line, &r->entries[r->numEntries])) {
+			r->numEntries++;
+		}
+	}
+	fclose(fp);
+	if (r->numEntries == 0) {
+		free(r->entries);
+		free(r);
+		errno = ENODATA;
+		return false;
+	}
+
+	// Start with each register's first recorded value so the daemon's initial
+	// reads see the charger as it was when the recording started
+	for (i=0; i<r->numEntries; i++) {
+		e = &r->entries[i];
+		if (e->isRead && e->ok) {
+			for (j=0; j<e->len; j++) {
+				if (!r->known[(e->reg + j) % REPLAY_IMAGE_SIZE]) {
+					ReplaySetImage(r, e->reg + j, 1, &e->data[j]);
+				}
+			}
+		}
+	}
+	r->startMs = ChgMsec();
+
+	b->read = ChgReplayRead;
+	b->write = ChgReplayWrite;
+	b->close = ChgReplayClose;
+	b->priv = r;
+	return true;
+}
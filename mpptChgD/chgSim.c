@@ -0,0 +1,520 @@
+/*
+ * chgSim.c - mpptChgD simulated charger backend
+ *
+ * Models the charger firmware's SMBus register interface closely enough to run
+ * mpptChgD without hardware: byte-level register access with the firmware's auto-
+ * incrementing register pointer and write-on-low-byte behavior, read-to-clear
+ * watchdog STATUS bits, the WDEN magic byte, parameter clamping and the power control
+ * state machine with its watchdog.  A synthetic solar day drives the measured values
+ * and charge state.  Simulated time advances from the monotonic clock (optionally sped
+ * up) whenever the charger is accessed.  Each transaction takes a configurable bus
+ * time and a configurable fraction of them fail.  The charger can also be made to stop
+ * responding for a period or to restart its firmware to exercise the daemon's link
+ * and reset recovery.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include "chgBackend.h"
+
+
+//
+// Firmware constants (smbus.h, config.h, param.h, power.c)
+//
+#define SIM_ID                0x1020    // FW_ID 1, version 2.0
+
+// RO register indices
+#define SIM_INDEX_ID          0
+#define SIM_INDEX_STATUS      1
+#define SIM_INDEX_BUCK        2
+#define SIM_INDEX_VS          3
+#define SIM_INDEX_IS          4
+#define SIM_INDEX_VB          5
+#define SIM_INDEX_IB          6
+#define SIM_INDEX_IC          7
+#define SIM_INDEX_IT          8
+#define SIM_INDEX_ET          9
+#define SIM_INDEX_VM          10
+#define SIM_INDEX_TH          11
+#define SIM_NUM_RO            12
+
+// RW register addresses
+#define SIM_PARAM_START       24
+#define SIM_WD_START          32
+#define SIM_ADDR_WD_EN        33
+#define SIM_ADDR_WD_TO        35
+#define SIM_ADDR_WD_PWROFF    36
+
+// STATUS bits
+#define SIM_ST_SWD_DET        0x8000
+#define SIM_ST_PWD_TRIG       0x4000
+#define SIM_ST_BAD_BATT       0x2000
+#define SIM_ST_WD_RUN         0x0100
+#define SIM_ST_PWR_EN         0x0080
+#define SIM_ST_ALERT          0x0040
+#define SIM_ST_NIGHT          0x0008
+
+#define SIM_WD_EN_MAGIC       0xEA
+
+// Charge states
+#define SIM_CHG_NIGHT         0
+#define SIM_CHG_IDLE          1
+#define SIM_CHG_SCAN          3
+#define SIM_CHG_BULK          4
+#define SIM_CHG_ABS           5
+#define SIM_CHG_FLT           6
+
+// Parameter limits and defaults (lead-acid battery selected)
+#define SIM_BULK_MIN          14000
+#define SIM_BULK_MAX          15000
+#define SIM_BULK_DEF          14700
+#define SIM_FLOAT_MIN         13000
+#define SIM_FLOAT_MAX         14000
+#define SIM_FLOAT_DEF         13650
+#define SIM_PWROFF_MIN        11000
+#define SIM_PWROFF_DEF        11500
+#define SIM_PWRON_MIN         12000
+#define SIM_PWRON_MAX         15000
+#define SIM_PWRON_DEF         12500
+
+// Power control
+#define SIM_PWR_ON            0
+#define SIM_PWR_ALERT_LB      1
+#define SIM_PWR_OFF_LB        2
+#define SIM_PWR_WD_ALERT      3
+#define SIM_PWR_WD_OFF        4
+
+#define SIM_LOWPWR_TIMEOUT    60
+#define SIM_ALERT_TIMEOUT     60
+#define SIM_WD_PWROFF_DEF     10
+#define SIM_V_BAD_BATT        10500
+#define SIM_V_NIGHT_THRESH    3500
+
+//
+// Model constants
+//
+#define SIM_START_TOD         (10 * 3600)   // Simulation starts at 10:00
+#define SIM_PANEL_MW          35000         // Peak panel power
+#define SIM_PANEL_VOC         21500
+#define SIM_PANEL_VMP         17500
+#define SIM_BATT_MAH          7000
+#define SIM_LOAD_MA           300
+#define SIM_ABS_SECS          3600
+#define SIM_MAX_CATCHUP       (7 * 86400)   // Longest gap simulated second by second
+
+
+typedef struct {
+	uint16_t ro[SIM_NUM_RO];
+	uint16_t param[4];          // BULKV, FLOATV, PWROFFV, PWRONV
+	bool wdGlobalEnable;
+	bool wdCountWritten;
+	uint8_t wdCount;
+	uint16_t wdPwrOffTO;
+	bool wdTriggered;
+	int pwrState;
+	int pwrTimer;
+	int lowBattCount;
+	int chgState;
+	int absTimer;
+	double soc;                 // Battery state of charge 0-1
+	uint64_t startMs;
+	uint64_t simSecs;           // Simulated seconds since start
+	int speed;
+	int failRate;
+	uint64_t outageStartMs;     // Real time window where the charger doesn't respond
+	uint64_t outageEndMs;
+	uint64_t resetMs;           // Real time the firmware restarts (0 for never)
+	unsigned int seed;
+} chgSim_t;
+
+
+static void SimDisableWatchdog(chgSim_t* s)
+{
+	s->wdGlobalEnable = false;
+	s->wdCountWritten = false;
+	s->wdCount = 0;
+	s->wdPwrOffTO = SIM_WD_PWROFF_DEF;
+}
+
+
+static uint16_t SimClamp(uint16_t v, uint16_t min, uint16_t max)
+{
+	return (v < min) ? min : ((v > max) ? max : v);
+}
+
+
+// Power control state machine, run once per simulated second
+static void SimPower(chgSim_t* s, int vb)
+{
+	bool wdRunning = s->wdGlobalEnable && s->wdCountWritten;
+
+	switch (s->pwrState) {
+		case SIM_PWR_ON:
+			if (wdRunning && (s->wdCount > 0) && (--s->wdCount == 0)) {
+				s->wdTriggered = true;
+				s->pwrState = SIM_PWR_WD_ALERT;
+				s->pwrTimer = SIM_ALERT_TIMEOUT;
+			} else if (vb <= s->param[2]) {
+				if (++s->lowBattCount >= SIM_LOWPWR_TIMEOUT) {
+					s->pwrState = SIM_PWR_ALERT_LB;
+					s->pwrTimer = SIM_ALERT_TIMEOUT;
+				}
+			} else {
+				s->lowBattCount = 0;
+			}
+			break;
+		case SIM_PWR_ALERT_LB:
+			if (--s->pwrTimer <= 0) {
+				s->pwrState = SIM_PWR_OFF_LB;
+			}
+			break;
+		case SIM_PWR_OFF_LB:
+			if (vb >= s->param[3]) {
+				s->pwrState = SIM_PWR_ON;
+				s->lowBattCount = 0;
+				SimDisableWatchdog(s);
+			}
+			break;
+		case SIM_PWR_WD_ALERT:
+			if (--s->pwrTimer <= 0) {
+				s->pwrState = SIM_PWR_WD_OFF;
+				s->pwrTimer = s->wdPwrOffTO;
+			}
+			break;
+		case SIM_PWR_WD_OFF:
+			if (--s->pwrTimer <= 0) {
+				s->pwrState = SIM_PWR_ON;
+				SimDisableWatchdog(s);
+			}
+			break;
+	}
+}
+
+
+// Advance the charger model one simulated second
+static void SimTick(chgSim_t* s)
+{
+	double sun, pAvail, pUsed, ib, ic, load;
+	uint16_t status;
+	int tod, vs, vb, limit;
+	bool pwrEn;
+
+	// Irradiance follows a half sine from 06:00 to 18:00
+	tod = (int) ((SIM_START_TOD + s->simSecs) % 86400);
+	sun = ((tod > 21600) && (tod < 64800)) ? sin(M_PI * (tod - 21600) / 43200.0) : 0.0;
+	pAvail = SIM_PANEL_MW * sun;
+
+	pwrEn = !((s->pwrState == SIM_PWR_OFF_LB) || (s->pwrState == SIM_PWR_WD_OFF));
+	load = pwrEn ? SIM_LOAD_MA : 0.0;
+	vb = (int) (11900 + (1000 * s->soc));
+
+	// Charge state
+	vs = (sun > 0.0) ? (int) (SIM_PANEL_VOC * (0.2 + (0.8 * sqrt(sun)))) : 0;
+	if (vs < SIM_V_NIGHT_THRESH) {
+		s->chgState = SIM_CHG_NIGHT;
+	} else if (s->chgState == SIM_CHG_NIGHT) {
+		s->chgState = SIM_CHG_IDLE;
+	} else if ((s->chgState == SIM_CHG_IDLE) && (vs > (vb + 1000))) {
+		s->chgState = SIM_CHG_SCAN;
+	} else if (s->chgState == SIM_CHG_SCAN) {
+		s->chgState = (s->soc < 0.95) ? SIM_CHG_BULK : SIM_CHG_FLT;
+	} else if ((s->chgState >= SIM_CHG_BULK) && (vs <= vb)) {
+		s->chgState = SIM_CHG_IDLE;
+	}
+
+	// Charge current is limited by the panel and, once the battery reaches the
+	// regulation voltage, tapers to hold it there
+	ib = 0.0;
+	limit = (s->chgState == SIM_CHG_FLT) ? s->param[1] : s->param[0];
+	if (s->chgState >= SIM_CHG_BULK) {
+		ib = pAvail / (vb / 1000.0);
+		if (s->chgState == SIM_CHG_BULK) {
+			if ((vb + (int) (ib / 20)) >= limit) {
+				s->chgState = SIM_CHG_ABS;
+				s->absTimer = SIM_ABS_SECS;
+			}
+		} else {
+			if (ib > (load + (2000 * (1.0 - s->soc)) + 50)) {
+				ib = load + (2000 * (1.0 - s->soc)) + 50;
+			}
+			if ((s->chgState == SIM_CHG_ABS) && (--s->absTimer <= 0)) {
+				s->chgState = SIM_CHG_FLT;
+			}
+		}
+	}
+	ic = ib - load;
+	s->soc += ic / (SIM_BATT_MAH * 3600.0);
+	if (s->soc < 0.0) {
+		s->soc = 0.0;
+	} else if (s->soc > 1.0) {
+		s->soc = 1.0;
+	}
+	vb = (int) (11900 + (1000 * s->soc) + (ic / 20));
+	if ((s->chgState >= SIM_CHG_ABS) && (vb > limit)) {
+		vb = limit;
+	}
+	pUsed = ib * (vb / 1000.0);
+
+	SimPower(s, vb);
+	pwrEn = !((s->pwrState == SIM_PWR_OFF_LB) || (s->pwrState == SIM_PWR_WD_OFF));
+
+	if (s->chgState >= SIM_CHG_BULK) {
+		vs = SIM_PANEL_VMP - (int) (1000 * (1.0 - sun));
+	}
+	s->ro[SIM_INDEX_VS] = vs;
+	s->ro[SIM_INDEX_IS] = (vs > 0) ? (int) ((pUsed * 1.05) / (vs / 1000.0)) : 0;
+	s->ro[SIM_INDEX_VB] = vb;
+	s->ro[SIM_INDEX_IB] = (int) ib;
+	s->ro[SIM_INDEX_IC] = (uint16_t) (int16_t) ic;
+	s->ro[SIM_INDEX_IT] = (uint16_t) (int16_t) (250 + (150 * sun));
+	s->ro[SIM_INDEX_ET] = (uint16_t) (int16_t) (200 + (80 * sun));
+	s->ro[SIM_INDEX_VM] = (s->chgState >= SIM_CHG_BULK) ? vs : 0;
+	s->ro[SIM_INDEX_TH] = limit;
+	s->ro[SIM_INDEX_BUCK] = (s->chgState >= SIM_CHG_BULK) ? ((int) (60 + (180 * sun)) << 8) : 0;
+
+	// The watchdog detected bits are only cleared by reading STATUS
+	status = s->ro[SIM_INDEX_STATUS] & (SIM_ST_SWD_DET | SIM_ST_PWD_TRIG);
+	if (s->wdTriggered) {
+		status |= SIM_ST_PWD_TRIG;
+	}
+	if (vb < SIM_V_BAD_BATT) {
+		status |= SIM_ST_BAD_BATT;
+	}
+	if (s->wdGlobalEnable && s->wdCountWritten) {
+		status |= SIM_ST_WD_RUN;
+	}
+	if (pwrEn) {
+		status |= SIM_ST_PWR_EN;
+	}
+	if (s->pwrState != SIM_PWR_ON) {
+		status |= SIM_ST_ALERT;
+	}
+	if (s->chgState == SIM_CHG_NIGHT) {
+		status |= SIM_ST_NIGHT;
+	}
+	s->ro[SIM_INDEX_STATUS] = status | s->chgState;
+
+	s->simSecs++;
+}
+
+
+// Firmware restart - the parameters and watchdog return to their power-on defaults
+static void SimReset(chgSim_t* s)
+{
+	s->param[0] = SIM_BULK_DEF;
+	s->param[1] = SIM_FLOAT_DEF;
+	s->param[2] = SIM_PWROFF_DEF;
+	s->param[3] = SIM_PWRON_DEF;
+	SimDisableWatchdog(s);
+	s->wdTriggered = false;
+	s->ro[SIM_INDEX_STATUS] &= ~(SIM_ST_PWD_TRIG | SIM_ST_SWD_DET | SIM_ST_WD_RUN);
+}
+
+
+static void SimAdvance(chgSim_t* s)
+{
+	uint64_t target;
+
+	if ((s->resetMs != 0) && (ChgMsec() >= s->resetMs)) {
+		s->resetMs = 0;
+		SimReset(s);
+	}
+
+	target = ((ChgMsec() - s->startMs) * s->speed) / 1000;
+	if ((target - s->simSecs) > SIM_MAX_CATCHUP) {
+		s->simSecs = target - SIM_MAX_CATCHUP;
+	}
+	while (s->simSecs < target) {
+		SimTick(s);
+	}
+}
+
+
+// _SMB_ReadRegister
+static unsigned char SimReadByte(chgSim_t* s, unsigned char reg)
+{
+	bool highHalf = (reg & 0x01) == 0;
+	int index = reg >> 1;
+	uint16_t d16;
+
+	if (reg < SIM_PARAM_START) {
+		d16 = s->ro[index];
+		if (s->wdTriggered && highHalf && (index == SIM_INDEX_STATUS)) {
+			s->wdTriggered = false;
+			s->ro[SIM_INDEX_STATUS] &= ~(SIM_ST_PWD_TRIG | SIM_ST_SWD_DET);
+		}
+	} else if (reg < SIM_WD_START) {
+		d16 = s->param[index - (SIM_PARAM_START / 2)];
+	} else if (reg == SIM_ADDR_WD_EN) {
+		d16 = s->wdGlobalEnable ? 0x0001 : 0x0000;
+	} else if (reg == SIM_ADDR_WD_TO) {
+		d16 = s->wdCount;
+	} else if (index == (SIM_ADDR_WD_PWROFF / 2)) {
+		d16 = s->wdPwrOffTO;
+	} else {
+		d16 = 0;
+	}
+
+	if (highHalf) {
+		d16 = d16 >> 8;
+	}
+	return (d16 & 0xFF);
+}
+
+
+// _SMB_WriteRegister
+static void SimWriteRegister(chgSim_t* s, unsigned char reg, uint16_t d)
+{
+	int index = reg >> 1;
+
+	if ((reg >= SIM_PARAM_START) && (reg < SIM_WD_START)) {
+		switch (index - (SIM_PARAM_START / 2)) {
+			case 0:
+				s->param[0] = SimClamp(d, SIM_BULK_MIN, SIM_BULK_MAX);
+				break;
+			case 1:
+				s->param[1] = SimClamp(d, SIM_FLOAT_MIN, SIM_FLOAT_MAX);
+				break;
+			case 2:
+				s->param[2] = SimClamp(d, SIM_PWROFF_MIN, s->param[3]);
+				break;
+			case 3:
+				s->param[3] = SimClamp(d, SIM_PWRON_MIN, SIM_PWRON_MAX);
+				break;
+		}
+	} else if (reg == SIM_ADDR_WD_EN) {
+		if (s->wdGlobalEnable && (d != SIM_WD_EN_MAGIC)) {
+			SimDisableWatchdog(s);
+		}
+		s->wdGlobalEnable = (d == SIM_WD_EN_MAGIC);
+	} else if (reg == SIM_ADDR_WD_TO) {
+		s->wdCountWritten = ((d & 0xFF) != 0);
+		s->wdCount = d & 0xFF;
+	} else if (index == (SIM_ADDR_WD_PWROFF / 2)) {
+		s->wdPwrOffTO = (d == 0) ? SIM_WD_PWROFF_DEF : d;
+	}
+}
+
+
+static bool SimFail(chgSim_t* s)
+{
+	uint64_t t;
+
+	if (s->outageEndMs > s->outageStartMs) {
+		t = ChgMsec();
+		if ((t >= s->outageStartMs) && (t < s->outageEndMs)) {
+			// Not acknowledging its address
+			errno = ENXIO;
+			return true;
+		}
+	}
+	if ((s->failRate > 0) && ((int) (rand_r(&s->seed) % 1000) < s->failRate)) {
+		errno = EIO;
+		return true;
+	}
+	return false;
+}
+
+
+static bool ChgSimRead(chgBackend_t* b, int regAddr, int len, unsigned char* buf)
+{
+	chgSim_t* s = (chgSim_t*) b->priv;
+	unsigned char reg = (unsigned char) regAddr;
+	int i;
+
+	ChgBusDelay(b, len);
+	if (SimFail(s)) {
+		return false;
+	}
+	SimAdvance(s);
+
+	for (i=0; i<len; i++) {
+		buf[i] = SimReadByte(s, reg++);
+	}
+	return true;
+}
+
+
+static bool ChgSimWrite(chgBackend_t* b, int regAddr, int len, const unsigned char* buf)
+{
+	chgSim_t* s = (chgSim_t*) b->priv;
+	unsigned char reg = (unsigned char) regAddr;
+	uint16_t data = 0;
+	int i;
+
+	ChgBusDelay(b, len);
+	if (SimFail(s)) {
+		return false;
+	}
+	SimAdvance(s);
+
+	// Registers are written when their low (odd address) byte arrives
+	for (i=0; i<len; i++) {
+		data = (data << 8) | buf[i];
+		if (reg & 0x01) {
+			SimWriteRegister(s, reg, data);
+			data = 0;
+		}
+		reg++;
+	}
+	return true;
+}
+
+
+static void ChgSimClose(chgBackend_t* b)
+{
+	free(b->priv);
+}
+
+
+bool ChgSimOpen(chgBackend_t* b, chgBackendParams_t* p)
+{
+	chgSim_t* s;
+
+	if ((s = (chgSim_t*) calloc(1, sizeof(chgSim_t))) == NULL) {
+		return false;
+	}
+
+	s->ro[SIM_INDEX_ID] = SIM_ID;
+	SimReset(s);
+	s->pwrState = SIM_PWR_ON;
+	s->chgState = SIM_CHG_IDLE;
+	s->soc = 0.6;
+	s->speed = (p->simSpeed > 0) ? p->simSpeed : 1;
+	s->failRate = p->simFailRate;
+	s->seed = (unsigned int) ChgMsec();
+	s->startMs = ChgMsec();
+	if (p->simOutageSecs > 0) {
+		s->outageStartMs = s->startMs + ((uint64_t) p->simOutageStart * 1000);
+		s->outageEndMs = s->outageStartMs + ((uint64_t) p->simOutageSecs * 1000);
+	}
+	if (p->simResetSecs > 0) {
+		s->resetMs = s->startMs + ((uint64_t) p->simResetSecs * 1000);
+	}
+
+	// Run the first second so the measured registers are populated
+	SimTick(s);
+	s->simSecs = 0;
+
+	b->read = ChgSimRead;
+	b->write = ChgSimWrite;
+	b->close = ChgSimClose;
+	b->priv = s;
+	return true;
+}
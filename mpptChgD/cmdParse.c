@@ -0,0 +1,144 @@
+/*
+ * cmdParse.c - mpptChgD command list and command line tokenizer
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+#include "cmdParse.h"
+
+
+//
+// Command list
+//
+cmd_t cmdList[NUM_CMDS] = {
+	{"ID", false, true, false, 0, CACHE_FOREVER},
+	{"STATUS", false, true, false, 2, 250},
+	{"BUCK", false, true, false, 4, 250},
+	{"VS", false, true, false, 6, 250},
+	{"IS", false, true, false, 8, 250},
+	{"VB", false, true, false, 10, 250},
+	{"IB", false, true, false, 12, 250},
+	{"IC", false, true, true, 14, 250},
+	{"IT", false, true, true, 16, 1000},
+	{"ET", false, true, true, 18, 1000},
+	{"VM", false, true, false, 20, 250},
+	{"TH", false, true, false, 22, 1000},
+	{"BULKV", true, true, false, 24, CACHE_FOREVER},
+	{"FLOATV", true, true, false, 26, CACHE_FOREVER},
+	{"PWROFFV", true, true, false, 28, CACHE_FOREVER},
+	{"PWRONV", true, true, false, 30, CACHE_FOREVER},
+	{"WDEN", true, false, false, 33, CACHE_FOREVER},
+	{"WDCNT", true, false, false, 35, 1000},
+	{"WDPWROFF", true, true, false, 36, CACHE_FOREVER}
+};
+
+
+//
+// Perfect hash of the cmdList names
+//
+//   hash = (6 * length + 3 * first char + 5 * last char) & 31
+//
+// The multipliers were found by an offline search for a collision-free mapping of the
+// names above.  Each slot holds the cmdList index or -1.  Both must be regenerated
+// together if cmdList changes (CmdHashCheck() detects a stale table at startup).
+//
+#define CMD_HASH_SIZE 32
+#define CMD_HASH(len, first, last) (((6 * (len)) + (3 * (first)) + (5 * (last))) & (CMD_HASH_SIZE - 1))
+
+static const signed char cmdHashTable[CMD_HASH_SIZE] = {
+	-1, -1, 15, 16, 13, -1,  4, 17,
+	14, -1, -1,  8, -1,  3, -1, 10,
+	11,  6, 12, 18, -1,  2,  7, -1,
+	 5, -1, -1,  0,  1, -1, -1,  9
+};
+
+
+int FindCmdIndex(char* regS)
+{
+	int len;
+	int i;
+
+	len = strlen(regS);
+	if (len == 0) {
+		return -1;
+	}
+
+	i = cmdHashTable[CMD_HASH(len, (unsigned char) regS[0], (unsigned char) regS[len-1])];
+	if ((i != -1) && (strcmp(regS, cmdList[i].cName) == 0)) {
+		return i;
+	}
+
+	return -1;
+}
+
+
+bool CmdHashCheck()
+{
+	int i;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		if (FindCmdIndex((char *) cmdList[i].cName) != i) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+bool CmdTokenize(char* line, char** name, char** value)
+{
+	char* cp = line;
+	char* end;
+
+	// Skip leading whitespace and ignore blank and comment lines
+	while ((*cp == ' ') || (*cp == '\t')) cp++;
+	if ((*cp == 0) || (*cp == ';') || (*cp == '#')) {
+		return false;
+	}
+	*name = cp;
+
+	// Find the separator, remembering the end of the name
+	end = cp;
+	while ((*cp != '=') && (*cp != ':')) {
+		if (*cp == 0) {
+			// Keyword without a value
+			*end = 0;
+			*value = cp;
+			return true;
+		}
+		if ((*cp != ' ') && (*cp != '\t')) {
+			end = cp + 1;
+		}
+		cp++;
+	}
+	*end = 0;
+
+	// Value runs to the end of the line
+	cp++;
+	while ((*cp == ' ') || (*cp == '\t')) cp++;
+	*value = cp;
+	end = cp;
+	while (*cp != 0) {
+		if ((*cp != ' ') && (*cp != '\t')) {
+			end = cp + 1;
+		}
+		cp++;
+	}
+	*end = 0;
+
+	return true;
+}
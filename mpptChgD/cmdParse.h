@@ -0,0 +1,72 @@
+/*
+ * cmdParse.h - mpptChgD command list and command line tokenizer
+ *
+ * Holds the list of charger registers accessible through the daemon and a
+ * single-pass, in-place tokenizer for the "<NAME>=<VALUE>" command lines
+ * received from clients.  Register names are looked up using a perfect hash.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __CMDPARSE_H__
+#define __CMDPARSE_H__
+
+#include <stdbool.h>
+
+
+//
+// Constants
+//
+
+// Cache max-age value for registers that only change when written
+#define CACHE_FOREVER       -1
+
+
+//
+// Commands
+//
+#define NUM_CMDS 19
+
+// cacheAge is the default maximum age (mSec) of a cached value and matches how often
+// the charger updates the register: measurements every 250 mSec, temperatures and the
+// compensated charge threshold every second and parameters only when written.
+typedef struct {
+	const char* cName;
+	bool isWritable;
+	bool isWord;
+	bool isSigned;
+	int regAddr;
+	int cacheAge;
+} cmd_t;
+
+extern cmd_t cmdList[NUM_CMDS];
+
+
+//
+// API
+//
+
+// Returns the cmdList index for a register name or -1 if it isn't found
+int FindCmdIndex(char* regS);
+
+// Verify the perfect hash table matches cmdList (it must be regenerated if cmdList changes)
+bool CmdHashCheck();
+
+// Split a command line in place into name and value at the first '=' (or ':'), stripping
+// surrounding whitespace.  A line without a separator is a keyword with an empty value.
+// Returns false for blank lines and comments.  name and value point into line.
+bool CmdTokenize(char* line, char** name, char** value);
+
+#endif /* __CMDPARSE_H__ */
@@ -0,0 +1,129 @@
+/*
+ * gpioEvent.c - mpptChgD GPIO edge events from the Linux gpio character device
+ *
+ * Uses the v2 line request API (Linux 5.10 and later).
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#include "gpioEvent.h"
+
+
+bool GpioOpen(gpioLines_t* g, const char* chip, const char* consumer, int n, const int* offsets,
+              const bool* activeLow, int debounceUs)
+{
+	struct gpio_v2_line_request req;
+	struct gpio_v2_line_config_attribute* attr;
+	int chipFd, e, i;
+
+	g->fd = -1;
+	if ((n < 1) || (n > GPIO_MAX_LINES)) {
+		errno = EINVAL;
+		return false;
+	}
+
+	memset(&req, 0, sizeof(req));
+	strncpy(req.consumer, consumer, GPIO_MAX_NAME_SIZE - 1);
+	req.num_lines = n;
+	req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+	                   GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	for (i=0; i<n; i++) {
+		req.offsets[i] = offsets[i];
+		g->offsets[i] = offsets[i];
+
+		// Lines that differ from the default flags get their own attribute
+		if (activeLow[i]) {
+			attr = &req.config.attrs[req.config.num_attrs++];
+			attr->attr.id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+			attr->attr.flags = req.config.flags | GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+			attr->mask = 1ULL << i;
+		}
+	}
+	if (debounceUs > 0) {
+		attr = &req.config.attrs[req.config.num_attrs++];
+		attr->attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		attr->attr.debounce_period_us = debounceUs;
+		attr->mask = (1ULL << n) - 1;
+	}
+
+	if ((chipFd = open(chip, O_RDWR | O_CLOEXEC)) == -1) {
+		return false;
+	}
+	if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) == -1) {
+		e = errno;
+		close(chipFd);
+		errno = e;
+		return false;
+	}
+	close(chipFd);
+
+	// The event loop reads events until there are none left
+	if (fcntl(req.fd, F_SETFL, fcntl(req.fd, F_GETFL) | O_NONBLOCK) == -1) {
+		e = errno;
+		close(req.fd);
+		errno = e;
+		return false;
+	}
+	g->fd = req.fd;
+	g->n = n;
+	return true;
+}
+
+
+bool GpioReadEvent(gpioLines_t* g, int* line, bool* active, uint64_t* tNs)
+{
+	struct gpio_v2_line_event ev;
+	int i;
+
+	while (read(g->fd, &ev, sizeof(ev)) == sizeof(ev)) {
+		for (i=0; i<g->n; i++) {
+			if (ev.offset == (uint32_t) g->offsets[i]) {
+				*line = i;
+				*active = (ev.id == GPIO_V2_LINE_EVENT_RISING_EDGE);
+				*tNs = ev.timestamp_ns;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+
+int GpioGetValues(gpioLines_t* g)
+{
+	struct gpio_v2_line_values vals;
+
+	vals.mask = (1ULL << g->n) - 1;
+	vals.bits = 0;
+	if (ioctl(g->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &vals) == -1) {
+		return -1;
+	}
+	return (int) vals.bits;
+}
+
+
+void GpioClose(gpioLines_t* g)
+{
+	if (g->fd != -1) {
+		close(g->fd);
+		g->fd = -1;
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ * gpioEvent.h - mpptChgD GPIO edge events from the Linux gpio character device
+ *
+ * Requests a small set of lines from a gpiochip as inputs with edge detection on both
+ * edges.  The request file descriptor becomes readable when the kernel has queued an
+ * edge so it can be watched with epoll.  Lines are identified by their index in the
+ * request and report "active" using each line's polarity (active-low lines are active
+ * when low).
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __GPIOEVENT_H__
+#define __GPIOEVENT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// Constants
+//
+#define GPIO_MAX_LINES      2
+
+
+typedef struct {
+	int fd;
+	int n;
+	int offsets[GPIO_MAX_LINES];
+} gpioLines_t;
+
+
+//
+// API - functions return false with errno set on failure
+//
+
+// Request n lines (offsets on the chip) for edge events.  debounceUs of 0 leaves the
+// lines without debouncing.
+bool GpioOpen(gpioLines_t* g, const char* chip, const char* consumer, int n, const int* offsets,
+              const bool* activeLow, int debounceUs);
+
+// Read the next queued edge.  Returns false with errno EAGAIN when there are none.
+// tNs is the kernel's monotonic timestamp of the edge.
+bool GpioReadEvent(gpioLines_t* g, int* line, bool* active, uint64_t* tNs);
+
+// Returns the current state of the lines (bit i set when line i is active) or -1
+int GpioGetValues(gpioLines_t* g);
+
+void GpioClose(gpioLines_t* g);
+
+#endif /* __GPIOEVENT_H__ */
@@ -0,0 +1,181 @@
+/*
+ * history.c - mpptChgD in-memory register history
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "history.h"
+
+
+static const uint64_t histIntervalMs[HIST_NUM_RES] = {0, 60000, 3600000};
+
+
+static int HistDecode(history_t* h, int reg, int16_t v)
+{
+	return (h->signedMask & (1 << reg)) ? (int) v : (int) (uint16_t) v;
+}
+
+
+// Store the accumulated values as the next point in a ring
+static void HistStore(history_t* h, histRing_t* r, uint64_t t)
+{
+	int16_t* p;
+	int64_t avg;
+	int reg, slot;
+
+	slot = (int) (r->count % r->size);
+	r->t[slot] = t;
+	for (reg=0; reg<h->numRegs; reg++) {
+		if (r->intervalMs == 0) {
+			r->vals[(reg * r->size) + slot] = (int16_t) r->acc[reg].min;
+		} else {
+			p = &r->vals[((reg * r->size) + slot) * 3];
+			if (r->acc[reg].sum >= 0) {
+				avg = (r->acc[reg].sum + (r->accN / 2)) / r->accN;
+			} else {
+				avg = (r->acc[reg].sum - (r->accN / 2)) / r->accN;
+			}
+			p[0] = (int16_t) r->acc[reg].min;
+			p[1] = (int16_t) r->acc[reg].max;
+			p[2] = (int16_t) avg;
+		}
+	}
+	r->count++;
+}
+
+
+bool HistoryInit(history_t* h, int numRegs, uint32_t signedMask, const int* sizes)
+{
+	histRing_t* r;
+	int res;
+
+	memset(h, 0, sizeof(history_t));
+	if ((numRegs <= 0) || (numRegs > HIST_MAX_REGS)) {
+		return false;
+	}
+	h->numRegs = numRegs;
+	h->signedMask = signedMask;
+
+	for (res=0; res<HIST_NUM_RES; res++) {
+		r = &h->ring[res];
+		r->size = (sizes[res] > 0) ? sizes[res] : 1;
+		r->intervalMs = histIntervalMs[res];
+		r->t = (uint64_t*) malloc(r->size * sizeof(uint64_t));
+		r->vals = (int16_t*) malloc(r->size * numRegs * ((res == HIST_RAW) ? 1 : 3) * sizeof(int16_t));
+		if ((r->t == NULL) || (r->vals == NULL)) {
+			HistoryFree(h);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+void HistoryAdd(history_t* h, uint64_t t, const int* vals)
+{
+	histRing_t* r;
+	uint64_t interval;
+	int res, reg;
+
+	for (res=0; res<HIST_NUM_RES; res++) {
+		r = &h->ring[res];
+
+		// A sample in a new interval completes the previous one
+		if (r->intervalMs != 0) {
+			interval = t / r->intervalMs;
+			if ((r->accN > 0) && (interval != r->interval)) {
+				HistStore(h, r, r->interval * r->intervalMs);
+				r->accN = 0;
+			}
+			r->interval = interval;
+		}
+
+		for (reg=0; reg<h->numRegs; reg++) {
+			if (r->accN == 0) {
+				r->acc[reg].sum = vals[reg];
+				r->acc[reg].min = vals[reg];
+				r->acc[reg].max = vals[reg];
+			} else {
+				r->acc[reg].sum += vals[reg];
+				if (vals[reg] < r->acc[reg].min) {
+					r->acc[reg].min = vals[reg];
+				}
+				if (vals[reg] > r->acc[reg].max) {
+					r->acc[reg].max = vals[reg];
+				}
+			}
+		}
+		r->accN++;
+
+		if (r->intervalMs == 0) {
+			HistStore(h, r, t);
+			r->accN = 0;
+		}
+	}
+}
+
+
+int HistoryCount(history_t* h, int res, uint64_t since)
+{
+	histRing_t* r = &h->ring[res];
+	uint64_t held;
+	int n;
+
+	held = (r->count < (uint64_t) r->size) ? r->count : (uint64_t) r->size;
+	for (n=0; n<(int) held; n++) {
+		if (r->t[(r->count - 1 - n) % r->size] < since) {
+			break;
+		}
+	}
+
+	return n;
+}
+
+
+void HistoryGet(history_t* h, int res, int reg, int count, int n, uint64_t* t, histPoint_t* p)
+{
+	histRing_t* r = &h->ring[res];
+	int16_t* v;
+	int slot;
+
+	slot = (int) ((r->count - count + n) % r->size);
+	*t = r->t[slot];
+	if (r->intervalMs == 0) {
+		p->min = HistDecode(h, reg, r->vals[(reg * r->size) + slot]);
+		p->max = p->min;
+		p->avg = p->min;
+	} else {
+		v = &r->vals[((reg * r->size) + slot) * 3];
+		p->min = HistDecode(h, reg, v[0]);
+		p->max = HistDecode(h, reg, v[1]);
+		p->avg = HistDecode(h, reg, v[2]);
+	}
+}
+
+
+void HistoryFree(history_t* h)
+{
+	int res;
+
+	for (res=0; res<HIST_NUM_RES; res++) {
+		free(h->ring[res].t);
+		free(h->ring[res].vals);
+		h->ring[res].t = NULL;
+		h->ring[res].vals = NULL;
+	}
+}
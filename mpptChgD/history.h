@@ -0,0 +1,97 @@
+/*
+ * history.h - mpptChgD in-memory register history
+ *
+ * Fixed size rings of register values at three resolutions: raw samples, 1-minute
+ * rollups and 1-hour rollups.  Each rollup point holds the minimum, maximum and
+ * average of the samples in its interval.  Rollups are accumulated as samples are
+ * added and a point is stored when its interval is complete.  All registers are
+ * sampled together so each resolution shares one ring of timestamps.  Memory is
+ * allocated once when the history is created.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// Constants
+//
+#define HIST_MAX_REGS     32
+
+// Resolutions
+#define HIST_RAW          0
+#define HIST_MINUTE       1
+#define HIST_HOUR         2
+#define HIST_NUM_RES      3
+
+
+typedef struct {
+	int min;
+	int max;
+	int avg;
+} histPoint_t;
+
+typedef struct {
+	int64_t sum;
+	int min;
+	int max;
+} histAcc_t;
+
+typedef struct {
+	int size;                               // Ring capacity (points)
+	uint64_t intervalMs;                    // Rollup interval (0 for raw samples)
+	uint64_t count;                         // Points ever stored
+	uint64_t* t;                            // Point timestamps (Unix time in mSec)
+	int16_t* vals;                          // size values (raw) or size min/max/avg triples
+	                                        // (rollups) per register
+	uint64_t interval;                      // Interval being accumulated
+	int accN;                               // Samples accumulated in the interval
+	histAcc_t acc[HIST_MAX_REGS];
+} histRing_t;
+
+typedef struct {
+	int numRegs;
+	uint32_t signedMask;                    // Bit n set if register n is signed
+	histRing_t ring[HIST_NUM_RES];
+} history_t;
+
+
+//
+// API
+//
+
+// Allocate a history for numRegs registers holding sizes[res] points at each resolution.
+// Returns false if memory could not be allocated.
+bool HistoryInit(history_t* h, int numRegs, uint32_t signedMask, const int* sizes);
+
+// Add a sample of all registers taken at time t (Unix time in mSec)
+void HistoryAdd(history_t* h, uint64_t t, const int* vals);
+
+// Returns the number of points at a resolution with a timestamp at or after since.
+// Finding them only visits the points returned.
+int HistoryCount(history_t* h, int res, uint64_t since);
+
+// Get point n of the newest count points of register reg (0 is the oldest).  Raw
+// samples have the same min, max and avg.
+void HistoryGet(history_t* h, int res, int reg, int count, int n, uint64_t* t, histPoint_t* p);
+
+void HistoryFree(history_t* h);
+
+#endif /* __HISTORY_H__ */
@@ -0,0 +1,130 @@
+/*
+ * mpptChgBin.h - mpptChgD binary TCP protocol
+ *
+ * A TCP connection starts in the text protocol.  Sending "FORMAT=BINARY" (ended with a
+ * single CR or LF, or CR LF) switches it to binary frames once the daemon has answered
+ * "FORMAT=BINARY".  MPPT_BIN_OP_TEXT switches it back.
+ *
+ * Every frame starts with a header and multi-byte fields are little-endian:
+ *
+ *   uint16_t len       Bytes following this field (rest of the header and the payload)
+ *   uint8_t  op
+ *   uint8_t  flags     0 in requests
+ *   uint32_t seq       Chosen by the client and returned in the response
+ *
+ * Registers are identified by their index in the daemon's register list (the order
+ * of READALL and MPPT_BIN_OP_NAMES).  A register set is a bitmap with bit n set for
+ * register n.  Values are the 16-bit register contents: int16 for the signed registers
+ * and uint16 for the others.
+ *
+ *   MPPT_BIN_OP_READ   req: uint32 mask
+ *                      rsp: uint32 mask, uint64 time (Unix mSec the values were read),
+ *                           16-bit value of each register in mask in index order
+ *   MPPT_BIN_OP_WRITE  req: uint32 mask (one writable register), 16-bit value
+ *                      rsp: as READ, holding the written value
+ *   MPPT_BIN_OP_NAMES  req: nothing
+ *                      rsp: uint32 number of registers, uint32 signed mask, uint32
+ *                           writable mask then each register's name, NUL terminated
+ *   MPPT_BIN_OP_TEXT   req: nothing
+ *                      rsp: nothing, the following bytes are the text protocol
+ *
+ * A response has the request's op and seq.  A request that fails is answered with
+ * MPPT_BIN_FLAG_ERROR set and a uint16 MPPT_BIN_ERR_* code as the payload.  A frame
+ * with a length outside MPPT_BIN_HDR_LEN - MPPT_BIN_MAX_LEN closes the connection.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __MPPTCHGBIN_H__
+#define __MPPTCHGBIN_H__
+
+#include <stdint.h>
+
+
+//
+// Constants
+//
+#define MPPT_BIN_HDR_LEN    8
+#define MPPT_BIN_MAX_LEN    256             // Largest frame (including len)
+
+// Opcodes
+#define MPPT_BIN_OP_READ    1
+#define MPPT_BIN_OP_WRITE   2
+#define MPPT_BIN_OP_NAMES   3
+#define MPPT_BIN_OP_TEXT    4
+
+// Response flags
+#define MPPT_BIN_FLAG_STALE 0x01            // Cached values, the charger couldn't be read
+#define MPPT_BIN_FLAG_ERROR 0x80            // Payload is an error code
+
+// Error codes
+#define MPPT_BIN_ERR_OP     1               // Unknown opcode
+#define MPPT_BIN_ERR_ARG    2               // Bad register mask, value or payload length
+#define MPPT_BIN_ERR_IO     3               // The charger couldn't be accessed
+
+
+//
+// Field access
+//
+static inline uint16_t MpptBinGet16(const void* p)
+{
+	const uint8_t* b = (const uint8_t*) p;
+
+	return b[0] | (b[1] << 8);
+}
+
+static inline uint32_t MpptBinGet32(const void* p)
+{
+	return MpptBinGet16(p) | ((uint32_t) MpptBinGet16((const uint8_t*) p + 2) << 16);
+}
+
+static inline uint64_t MpptBinGet64(const void* p)
+{
+	return MpptBinGet32(p) | ((uint64_t) MpptBinGet32((const uint8_t*) p + 4) << 32);
+}
+
+static inline void MpptBinPut16(void* p, uint16_t v)
+{
+	uint8_t* b = (uint8_t*) p;
+
+	b[0] = v & 0xFF;
+	b[1] = v >> 8;
+}
+
+static inline void MpptBinPut32(void* p, uint32_t v)
+{
+	MpptBinPut16(p, v & 0xFFFF);
+	MpptBinPut16((uint8_t*) p + 2, v >> 16);
+}
+
+static inline void MpptBinPut64(void* p, uint64_t v)
+{
+	MpptBinPut32(p, v & 0xFFFFFFFF);
+	MpptBinPut32((uint8_t*) p + 4, v >> 32);
+}
+
+// Fill in a frame header for a payload of payloadLen bytes.  Returns the frame length.
+static inline int MpptBinPutHdr(void* p, int payloadLen, int op, int flags, uint32_t seq)
+{
+	uint8_t* b = (uint8_t*) p;
+
+	MpptBinPut16(b, MPPT_BIN_HDR_LEN - 2 + payloadLen);
+	b[2] = op;
+	b[3] = flags;
+	MpptBinPut32(&b[4], seq);
+	return MPPT_BIN_HDR_LEN + payloadLen;
+}
+
+#endif /* __MPPTCHGBIN_H__ */
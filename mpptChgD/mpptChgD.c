@@ -6,15 +6,25 @@
  *   1. Simple character-based access for applications to the charger through a
  *	  pseudo-tty called /dev/mpptChg 
  *   2. Optional functionality enabled by an external text configuration file
- *	  a. Automatic system shutdown on low-battery Alert
+ *	  a. Automatic system shutdown on low-battery Alert (polled or from the
+ *	     ALERT_N GPIO line)
  *	  b. TCP port interface supporting same commands as pseudo-tty
  *	  c. Logging of charger values to an external file at a user-specified rate
  *	  d. Configuration of charger parameters for non-default operation
  *	  e. Watchdog management
+ *	  f. Shared memory segment with the latest register values for local programs
+ *	  g. Unix domain socket interface supporting the same commands for local programs
+ *	  h. Monitoring and logging of additional chargers on other I2C buses or addresses
  *
- * Requires Gordon Henderson's wiringPi library to compile and for the I2C interface
- * to be enabled on the Raspberry Pi.  Also uses Ben Hoyt's inih.c library for
- * parsing commands and the config file (included).
+ * All charger access after startup is done by a dedicated I2C worker thread so the
+ * event loop servicing clients never waits on the bus.
+ *
+ * Charger access goes through a backend (chgBackend.h) selected by the config file:
+ * the real charger over I2C, a simulated charger or the replay of a recording.
+ *
+ * Requires Gordon Henderson's wiringPi library to compile (unless built with
+ * NO_WIRINGPI) and for the I2C interface to be enabled on the Raspberry Pi.  Also uses
+ * Ben Hoyt's inih.c library for parsing the config file (included).
  *
  * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
  *
@@ -34,27 +44,48 @@
  * See <http://www.gnu.org/licenses/>.
  *
  */
+#define _GNU_SOURCE
+#include <stdarg.h>
 #include <stdio.h>
-#define __USE_XOPEN_EXTENDED
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <ctype.h>
+#include <grp.h>
+#include <pwd.h>
+#include "binLog.h"
+#include "chgBackend.h"
+#include "cmdParse.h"
+#include "gpioEvent.h"
+#include "history.h"
+#include "mpptChgBin.h"
+#include "mpptChgShm.h"
+#include "stats.h"
+#include "textLog.h"
 #include "ini.h"
-#include "wiringPi.h"
-#include "wiringPiI2C.h"
 
 
 //
@@ -66,11 +97,81 @@
 
 #define MPPT_CHG_I2C_ADDR   0x12
 
-// MAX_CONNECTIONS includes the pty and socket connections
-#define MAX_CONNECTIONS     5
+// Chargers handled by one daemon - the primary (charger 0) set up by the global config
+// items and up to MAX_CHARGERS-1 more from [charger.N] sections
+#define MAX_CHARGERS        4
+
+// Default poll period (mSec) of an additional charger and the share of the I2C worker's
+// time (percent) above which polls are held back
+#define POLL_DEF_MS         1000
+#define POLL_DEF_BUDGET_PCT 50
+
+// Simulated charger bus timing defaults
+#define SIM_DEF_LATENCY_US  100
+#define SIM_DEF_BUS_KHZ     50
+
+// Burst read register ranges.  The charger auto-increments its register pointer
+// so each range can be read with a single combined write/repeated-start/read
+// transaction.  RO registers 0-23, RW registers 24-37.  Reading the STATUS high byte
+// clears its latched PWD_TRIG and SWD_DET bits so unless STATUS was asked for the RO
+// burst starts after it (registers 4-23).
+#define BURST_RO_START      0
+#define BURST_RO_LEN        24
+#define BURST_RO_NS_START   4
+#define BURST_RW_START      24
+#define BURST_RW_LEN        14
+
+// I2C_BURST modes
+#define BURST_NONE          0
+#define BURST_RO            1
+#define BURST_ALL           2
+
+// I2C fault recovery.  A failed transaction is retried (I2C_RETRIES times) with a delay
+// that doubles from I2C_RETRY_MS.  If it still fails the charger link is down until the
+// interface is reopened and the charger identifies itself again.  Reopens are tried at
+// intervals doubling from LINK_REOPEN_MIN_MS up to LINK_REOPEN_MAX_MS.  The daemon exits
+// if the link stays down for I2C_FAIL_SECS.
+#define I2C_DEF_RETRIES     3
+#define I2C_MAX_RETRIES     8
+#define I2C_RETRY_MS        2
+#define LINK_REOPEN_MIN_MS  500
+#define LINK_REOPEN_MAX_MS  8000
+#define LINK_DEF_FAIL_SECS  60
+
+// Classes of failed I2C transactions
+#define I2C_ERR_TRANSIENT   0       // Bus error or NACK - worth retrying
+#define I2C_ERR_LINK        1       // The interface has gone away - reopen it
+#define I2C_ERR_REQUEST     2       // The transaction can't be done - don't retry
+
+// Maximum number of events handled per epoll_wait() call
+#define MAX_EVENTS          16
+
+// Maximum number of commands processed from one connection before servicing
+// other connections.  Remaining pipelined commands are processed on the next
+// pass through the event loop.
+#define CMDS_PER_WAKE       8
+
+// Minimum subscription sample period (mSec) and subscriptions one connection may hold
+#define SUB_MIN_PERIOD_MS   100
+#define SUB_MAX_PER_CONN    16
+
+// Default watch evaluation period (mSec) and watches one connection may hold
+#define WATCH_DEF_PERIOD_MS 1000
+#define WATCH_MAX_PER_CONN  16
+
+// STATUS value occasionally seen on a bad read (bits 9-11 are never set by the charger)
+#define STATUS_GLITCH_VAL   0xFFFF
 
 #define MAX_STRING_LEN      512
-#define MAX_FIFO_LEN        2*MAX_STRING_LEN
+
+// Default per-connection output buffer size.  Reading commands from a connection
+// is paused while its output buffer is more than half full.
+#define OUTBUF_DEF_SIZE     8192
+#define OUTBUF_MIN_SIZE     1024
+
+// OUTBUF_POLICY values - what to do when a connection's output buffer overflows
+#define OUTBUF_DROP         0
+#define OUTBUF_CLOSE        1
 
 #define WD_INIT_SECS        180
 #define WD_UPDATE_SECS      60
@@ -79,45 +180,62 @@
 
 #define PARAM_CHECK_SECS    300
 
-#define STATUS_ALERT_MASK   0x0040
+// Default alert check period (mSec)
+#define ALERT_DEF_PERIOD_MS 1000
 
-#define MATCH(n) strcmp(name, n) == 0
+// Minimum period of a scheduled task (mSec) - the charger updates its measurements
+// every 250 mSec
+#define SCHED_MIN_PERIOD_MS 100
 
+// Maximum watchdog refresh period (mSec) leaving time for a late refresh before the
+// charger's watchdog (WD_INIT_SECS) expires
+#define WD_MAX_PERIOD_MS    ((WD_INIT_SECS / 2) * 1000)
 
-//
-// Commands
-//
-#define NUM_CMDS 19
+// LOG_FORMAT values
+#define LOGFMT_TEXT         0
+#define LOGFMT_BINARY       1
 
-typedef struct {
-	const char* cName;
-	bool isWritable;
-	bool isWord;
-	bool isSigned;
-	int regAddr;
-} cmd_t;
-
-cmd_t cmdList[NUM_CMDS] = {
-	{"ID", false, true, false, 0},
-	{"STATUS", false, true, false, 2},
-	{"BUCK", false, true, false, 4},
-	{"VS", false, true, false, 6},
-	{"IS", false, true, false, 8},
-	{"VB", false, true, false, 10},
-	{"IB", false, true, false, 12},
-	{"IC", false, true, true, 14},
-	{"IT", false, true, true, 16},
-	{"ET", false, true, true, 18},
-	{"VM", false, true, false, 20},
-	{"TH", false, true, false, 22},
-	{"BULKV", true, true, false, 24},
-	{"FLOATV", true, true, false, 26},
-	{"PWROFFV", true, true, false, 28},
-	{"PWRONV", true, true, false, 30},
-	{"WDEN", true, false, false, 33},
-	{"WDCNT", true, false, false, 35},
-	{"WDPWROFF", true, true, false, 36}
-};
+// Default number of records held by a binary log
+#define LOG_DEF_RECORDS     100000
+
+// Default maximum seconds between log entries in deadband mode
+#define LOG_DEF_MAX_INTERVAL 3600
+
+// Default history sample period (mSec) and number of points held at each resolution
+// (1 hour of samples, 1 day of 1-minute rollups and 30 days of 1-hour rollups)
+#define HIST_DEF_PERIOD_MS  1000
+#define HIST_DEF_RAW        3600
+#define HIST_DEF_MINUTES    1440
+#define HIST_DEF_HOURS      720
+
+// Upper bounds on the length of one formatted HISTORY point used to limit a response
+// to the space in the connection's output buffer
+#define HIST_RAW_PT_LEN     24
+#define HIST_ROLLUP_PT_LEN  40
+
+#define STATUS_ALERT_MASK   0x0040
+#define STATUS_WD_RUN_MASK  0x0100
+#define STATUS_CHG_ST_MASK  0x0007
+#define STATUS_SWD_DET_MASK 0x8000
+#define STATUS_PWD_TRIG_MASK 0x4000
+
+// HTTP metrics exporter limits
+#define HTTP_MAX_CONNS      8
+#define HTTP_IDLE_SECS      10
+#define HTTP_OUTBUF_SIZE    65536
+
+// Unix socket defaults.  Access to the socket is controlled by its file mode while
+// register writes need the peer's credentials (see UnixPeerMayWrite).
+#define UNIX_DEF_MAX        16
+#define UNIX_DEF_MODE       0666
+
+// STATS response buffer.  The body holds every task, job and register entry with room
+// left for the connections, and is cut short to fit a smaller output buffer.
+// STATS_TAIL_LEN is kept past the body for the punctuation that closes its sections.
+#define STATS_BUF_LEN       8192
+#define STATS_TAIL_LEN      64
+
+#define MATCH(n) strcmp(name, n) == 0
 
 
 //
@@ -129,50 +247,510 @@ cmd_t cmdList[NUM_CMDS] = {
 #define PARAM_PWROFF_I 2
 #define PARAM_PWRON_I  3
 
+// An additional charger ([charger.N] section).  The registers in pollMask are read every
+// pollMs and appended to logFileName if it is set.
+typedef struct {
+	bool enabled;
+	int chgType;
+	int i2cBus;
+	int i2cAddr;
+	int pollMs;
+	bool pollMask[NUM_CMDS];
+	char logFileName[MAX_STRING_LEN];
+} chargerConfig_t;
+
 typedef struct {
 	bool enAutoShutdown;
 	bool enParamOverride;
 	bool enLogging;
 	bool enWatchdog;
+	bool enShm;
+	bool enHistory;
+	int chgType;
+	char chgRecordFile[MAX_STRING_LEN];
+	char chgReplayFile[MAX_STRING_LEN];
+	int simLatencyUs;
+	int simBusKhz;
+	int simSpeed;
+	int simFailRate;
+	int simOutageStart;
+	int simOutageSecs;
+	int simResetSecs;
+	int i2cBus;
+	int i2cAddr;
+	int burstMode;
+	int i2cRetries;
+	int linkFailSecs;
+	char gpioChip[MAX_STRING_LEN];
+	int gpioAlert;
+	int gpioNight;
+	int gpioDebounceUs;
 	int tcpPort;
 	int tcpMaxConnections;
+	int tcpIdleSecs;
+	int httpPort;
+	char unixPath[MAX_STRING_LEN];
+	int unixMax;
+	int unixMode;
+	int unixWriteGid;
+	int outBufSize;
+	int outBufPolicy;
 	char logFileName[MAX_STRING_LEN];
-	int logDelay;
+	int logDelayMs;
+	int logFormat;
+	int logRecords;
+	int logSync;
+	textLogParams_t logParams;
 	bool logMask[NUM_CMDS];
+	bool enLogDeadband;
+	int logDeadband[NUM_CMDS];
+	int logMaxInterval;
 	int paramArray[NUM_PARAMS];
+	int cacheAge[NUM_CMDS];
+	int alertPeriodMs;
+	int paramPeriodMs;
+	int wdPeriodMs;
+	bool histMask[NUM_CMDS];
+	int histPeriodMs;
+	int histSizes[HIST_NUM_RES];
+	int pollBudgetPct;
+	chargerConfig_t chargers[MAX_CHARGERS];
 } config_t;
 
 config_t config;
 
 
 //
-// Command Fifos
+// Register snapshot
+//
+typedef struct {
+	struct timeval t;
+	uint64_t msec;
+	bool valid[NUM_CMDS];
+	int val[NUM_CMDS];
+} snapshot_t;
+
+
+//
+// Register cache - holds the last value read from the charger for each register.
+// Timestamps are mSec from the monotonic clock.  An expired value is kept (it can
+// still be served as stale) but the next read goes to the charger.
 //
 typedef struct {
 	bool valid;
+	bool expired;
+	int val;
+	uint64_t msec;
+} cacheEntry_t;
+
+
+typedef struct {
+	bool shadowed;
+	bool known;                 // val is what the charger holds
+	int val;
+	bool reqKnown;              // req was written and answered with val
+	int req;
+} shadow_t;
+
+
+//
+// Chargers - each has its own backend, register cache, shadow registers and link state.  devs[0] is the
+// primary charger which alone has the shutdown, parameter, watchdog, history, shared
+// memory and subscription features.  Additional chargers are polled by TASK_POLL into
+// their cache and optional text log.
+//
+// Charger link - once a transaction has failed its retries the link is down and
+// transactions fail immediately (ENOTCONN) except for periodic attempts to reopen the
+// interface and check the charger's ID.  The link is restored by the first transaction
+// to succeed after that.  The link fields are owned by whichever thread accesses the
+// charger (the I2C worker once it is running).  linkDownMs is when the current outage
+// started (0 if none) and is also read by the event loop which serves cached values
+// while it is set.  recoveries counts restored links for the event loop.
+//
+// burstMode starts as I2C_BURST and is reduced by the thread accessing the charger if
+// its adapter doesn't support burst reads.  burstModeSeen is the event loop's copy.
+//
+// shadow, chargerId (-1 until read) and wdRunning are the charger's shadow registers
+// described below.  resets counts the resets they detected.
+//
+// swdDetSeen and pwdTrigSeen count STATUS reads that found the latched SWD_DET and
+// PWD_TRIG bits set.  The read clears them so each one is a separate watchdog event.
+//
+typedef struct {
+	int id;
+	bool enabled;
+	chgBackendParams_t params;
+	chgBackend_t* backend;
+	cacheEntry_t cache[NUM_CMDS];
+	shadow_t shadow[NUM_CMDS];
+	int chargerId;
+	bool wdRunning;
+	unsigned long resets;
+	bool linkDown;
+	uint64_t linkDownMs;
+	uint64_t linkRetryMs;
+	int linkBackoffMs;
+	unsigned long recoveries;
+	unsigned long recoveriesSeen;
+	bool degraded;
+	int burstMode;
+	int burstModeSeen;
+	unsigned long swdDetSeen;
+	unsigned long pwdTrigSeen;
+	uint64_t pollDue;
+	bool logOpen;
+	char logHeader[MAX_STRING_LEN];
+	textLog_t log;
+} chgDev_t;
+
+chgDev_t devs[MAX_CHARGERS];
+
+// The charger the I2C worker's current job is for
+chgDev_t* i2cDev = &devs[0];
+
+
+//
+// Connections - every file descriptor monitored by the event loop has one of
+// these as its epoll data.  Client connections are allocated dynamically and TCP
+// connections are kept on a list ordered by last activity for idle timeouts.
+//
+#define CONN_PTY    0
+#define CONN_TCP    1
+#define CONN_LISTEN 2
+#define CONN_TIMER  3
+#define CONN_SIGNAL 4
+#define CONN_SAMPLER 5
+#define CONN_I2C    6
+#define CONN_HTTP_LISTEN 7
+#define CONN_HTTP   8
+#define CONN_GPIO   9
+#define CONN_UNIX_LISTEN 10
+#define CONN_UNIX   11
+
+// Response formats
+#define FMT_TEXT    0
+#define FMT_JSON    1
+#define FMT_BINARY  2
+
+typedef struct conn_t {
+	int type;
 	int fd;
-	int cmdFifoPushI;
-	int cmdFifoPopI;
-	int cmdBufI;
-	char cmdFifo[MAX_FIFO_LEN];
-	char cmdBuf[MAX_STRING_LEN];
-} cmdBuf_t;
+	uint32_t events;
+	bool showAge;
+	bool mayWrite;
+	int format;
+	uint64_t lastActive;
+	struct conn_t* prev;
+	struct conn_t* next;
+	bool pending;
+	struct conn_t* pendNext;
+	bool waitI2c;
+	bool closeWhenSent;
+	unsigned long commands;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	int inLen;
+	char inBuf[MAX_STRING_LEN];
+	int outHead;
+	int outLen;
+	int outSize;
+	char* outBuf;
+	unsigned long outDropped;
+} conn_t;
+
+typedef struct {
+	conn_t* head;
+	conn_t* tail;
+} connList_t;
 
 
 //
 // Other global variables
 //
-int i2cFd;
 int sockFd = -1;
-int linkFd;
-int logFd;
-int *remotefd;
+int linkFd = -1;
+textLog_t textLog;
+char logHeader[MAX_STRING_LEN];
+binLog_t binLog;
+bool logHaveLast = false;
+unsigned long logLastFiles;
+uint64_t logLastMsec;
+int logLastVals[NUM_CMDS];
+int epollFd = -1;
+int debug = 0;
 char *linkname = "/dev/mpptChg";
 int curSockConnects = 0;
-int curNumConnects = 0;
-cmdBuf_t cmdBufs[MAX_CONNECTIONS];
-int rspFifoPushI = 0;
-char rspFifo[MAX_FIFO_LEN];
+int httpFd = -1;
+connList_t httpConns = {NULL, NULL};
+int curHttpConnects = 0;
+int unixFd = -1;
+connList_t unixConns = {NULL, NULL};
+int curUnixConnects = 0;
+conn_t* linkConn = NULL;
+connList_t tcpConns = {NULL, NULL};
+connList_t deadConns = {NULL, NULL};
+conn_t* pendHead = NULL;
+conn_t** pendTailP = &pendHead;
+
+
+//
+// Charger ALERT_N and NIGHT outputs monitored as GPIO edge events.  An edge starts a
+// STATUS read to confirm it.  gpioRecheck is set by an edge that arrives while that read
+// is already outstanding.
+//
+gpioLines_t gpio = {-1, 0, {0}};
+conn_t gpioConn;
+bool gpioRecheck = false;
+const char* gpioLineNames[GPIO_MAX_LINES];
+
+
+//
+// STATUS register flags and charge states reported by the metrics exporter
+//
+typedef struct {
+	const char* name;
+	int mask;
+} statusFlag_t;
+
+const statusFlag_t statusFlags[] = {
+	{"hw_wd",    0x8000},
+	{"sw_wd",    0x4000},
+	{"bad_batt", 0x2000},
+	{"ext_miss", 0x1000},
+	{"wd_run",   0x0100},
+	{"pwr_en",   0x0080},
+	{"alert",    0x0040},
+	{"pctrl",    0x0020},
+	{"t_lim",    0x0010},
+	{"night",    0x0008}
+};
+#define NUM_STATUS_FLAGS (sizeof(statusFlags) / sizeof(statusFlag_t))
+
+const char* chargeStates[] = {"night", "idle", "vsrcv", "scan", "bulk", "absorb", "float"};
+#define NUM_CHARGE_STATES (sizeof(chargeStates) / sizeof(char*))
+
+
+//
+// Subscriptions - registers pushed to a connection at a fixed period.  All
+// subscriptions are served by one sampler timer that is armed for the earliest
+// due subscription.
+//
+typedef struct sub_t {
+	conn_t* conn;
+	int id;
+	int n;
+	int regList[NUM_CMDS];
+	int periodMs;
+	uint64_t nextDue;
+	struct sub_t* next;
+} sub_t;
+
+sub_t* subList = NULL;
+int nextSubId = 1;
+conn_t samplerConn;
+
+
+//
+// Watches - predicates on a register evaluated by the sampler.  An event is sent to
+// the connection when the predicate changes state.  Threshold watches have
+// hysteresis: a WATCH_BELOW watch becomes true when the value drops below the
+// threshold and false when it rises to the threshold plus the hysteresis.  WATCH_BITS
+// watches report every change in the masked bits of the register.
+//
+#define WATCH_BELOW 0
+#define WATCH_ABOVE 1
+#define WATCH_BITS  2
+
+typedef struct watch_t {
+	conn_t* conn;
+	int id;
+	int cmdIndex;
+	int type;
+	int threshold;
+	int hysteresis;
+	int mask;
+	int periodMs;
+	uint64_t nextDue;
+	bool known;
+	int state;
+	struct watch_t* next;
+} watch_t;
+
+watch_t* watchList = NULL;
+
+
+//
+// Scheduled tasks - periodic activities that each run at their own period.  One
+// timer is armed for the earliest due task.  A task's due time advances by its period
+// from the previous due time, not from when it ran, so the schedule does not drift.
+//
+#define TASK_IDLE     0
+#define TASK_ALERT    1
+#define TASK_PARAMS   2
+#define TASK_LOG      3
+#define TASK_LOGFILE  4
+#define TASK_WATCHDOG 5
+#define TASK_REFRESH  6
+#define TASK_HISTORY  7
+#define TASK_POLL     8
+#define NUM_TASKS     9
+
+typedef struct {
+	bool enabled;
+	int periodMs;
+	uint64_t nextDue;
+} schedTask_t;
+
+schedTask_t schedTasks[NUM_TASKS];
+conn_t schedConn;
+
+// Additional chargers are polled one at a time by TASK_POLL.  A poll is held back while
+// the I2C worker has been busy for more than config.pollBudgetPct of the time since the
+// previous poll started (pollMarkMs, when the worker's busy time was pollMarkBusyUs).
+uint64_t pollMarkMs = 0;
+uint64_t pollMarkBusyUs = 0;
+
+
+//
+// History - recorded registers are held in the order of cmdList.  histReg maps a
+// cmdList index to its history register (-1 if it isn't recorded).
+//
+history_t history;
+int histReg[NUM_CMDS];
+
+
+//
+// I2C worker - once the daemon is running a single thread owns the I2C interface.
+// Charger access is queued as jobs which the worker runs in priority order (safety
+// related first, client reads last).  Finished jobs are returned to the event loop
+// through an eventfd and their done function is called there so all other daemon
+// state is only touched by the event loop.  A client connection stops processing
+// commands while it has a job outstanding so its responses stay in order.
+//
+#define I2C_PRIO_SAFETY    0
+#define I2C_PRIO_TASK      1
+#define I2C_PRIO_SAMPLER   2
+#define I2C_PRIO_CLIENT    3
+#define I2C_NUM_PRIO       4
+
+// Periodic activities - only one job for each may be outstanding
+#define I2C_TASK_NONE      -1
+#define I2C_TASK_ALERT     0
+#define I2C_TASK_PARAMS    1
+#define I2C_TASK_LOG       2
+#define I2C_TASK_WATCHDOG  3
+#define I2C_TASK_SAMPLER   4
+#define I2C_TASK_REFRESH   5
+#define I2C_TASK_HISTORY   6
+#define I2C_TASK_POLL      7
+#define I2C_NUM_TASKS      8
+
+typedef struct i2cJob_t {
+	chgDev_t* dev;
+	int prio;
+	int task;
+	bool (*work)(struct i2cJob_t* job);   // Runs on the worker thread
+	void (*done)(struct i2cJob_t* job);   // Runs on the event loop
+	bool success;
+	int burstMode;
+	conn_t* conn;
+	bool mask[NUM_CMDS];
+	snapshot_t snap;
+	int regList[NUM_CMDS];
+	int n;
+	int cmdIndex;
+	int val;
+	uint32_t seq;
+	uint64_t msec;
+	struct timeval t;
+	struct i2cJob_t* next;
+} i2cJob_t;
+
+pthread_t i2cThread;
+pthread_mutex_t i2cLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t i2cCond = PTHREAD_COND_INITIALIZER;
+bool i2cRunning = false;
+bool i2cQuit = false;
+i2cJob_t* i2cQueue[I2C_NUM_PRIO];
+i2cJob_t** i2cQueueTailP[I2C_NUM_PRIO];
+i2cJob_t* i2cDone = NULL;
+i2cJob_t** i2cDoneTailP = &i2cDone;
+bool i2cTaskBusy[I2C_NUM_TASKS];
+conn_t i2cConn;
+
+
+//
+// Shadow registers - the daemon's copy of a charger's writable registers that only
+// change when written (the parameters, WDEN and WDPWROFF).  Writes go through the
+// shadow: nothing is written if the charger already holds the value (or has already
+// answered the same request with a clamped value) and a changed value is read back to
+// verify it.  Every read of a shadowed register is compared with its shadow.  A
+// difference, a change of ID or the watchdog no longer running while the daemon has it
+// enabled means the charger has reset (or been changed behind the daemon's back) so its
+// shadows are forgotten.  For the primary charger chgResetPending then asks the event
+// loop to reassert the parameters and watchdog.  Additional chargers have no configured
+// parameters or watchdog so their resets are only logged and counted.  Each charger's
+// shadows (in chgDev_t) are owned by whichever thread accesses the charger.
+//
+int idIndex;
+int statusIndex;
+bool chgResetPending = false;
+
+
+//
+// Daemon counters and latency histograms.  The I2C counters are updated by the I2C
+// worker thread.  Per-register I2C counts are by the first register of a transaction.
+// The last I2C job histogram is for client jobs.
+//
+typedef struct {
+	uint64_t i2cTransactions;
+	uint64_t i2cErrors;
+	uint64_t i2cRetries;
+	uint64_t i2cBusyUs;
+	uint64_t linkFailures;
+	uint64_t linkRecoveries;
+	uint64_t chargerResets;
+	uint64_t writesSkipped;
+	uint64_t regReads[NUM_CMDS];
+	uint64_t regReadErrors[NUM_CMDS];
+	uint64_t regWrites[NUM_CMDS];
+	uint64_t regWriteErrors[NUM_CMDS];
+	uint64_t cacheHits;
+	uint64_t cacheMisses;
+	uint64_t connections;
+	uint64_t commands;
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t httpRequests;
+	uint64_t gpioEvents[GPIO_MAX_LINES];
+	statsHist_t i2cTime;
+	statsHist_t i2cJobTime[I2C_NUM_TASKS + 1];
+	statsHist_t taskTime[NUM_TASKS];
+	statsHist_t loopTime;
+} counters_t;
+
+counters_t counters;
+time_t startTime;
+
+// Maps a register address to the cmdList index of the register holding it
+int regCmdIndex[CHG_NUM_REGS];
+
+const char* taskNames[NUM_TASKS] = {
+	"idle", "alert", "params", "log", "logfile", "watchdog", "refresh", "history", "poll"
+};
+
+const char* i2cJobNames[I2C_NUM_TASKS + 1] = {
+	"alert", "params", "log", "watchdog", "sampler", "refresh", "history", "poll", "client"
+};
+
+
+//
+// Shared memory telemetry segment (layout in mpptChgShm.h).  Updated from the cache
+// whenever values are read from the charger.
+//
+mpptShm_t* shm = NULL;
+
+
 extern char* ptsname(int fd);
 
 
@@ -185,53 +763,321 @@ void SetupDefaultConfigValues()
 	config.enParamOverride = false;
 	config.enLogging = false;
 	config.enWatchdog = false;
+	config.enShm = false;
+	config.enHistory = false;
+	config.chgType = CHG_BACKEND_I2C;
+	config.chgRecordFile[0] = 0;
+	config.chgReplayFile[0] = 0;
+	config.simLatencyUs = SIM_DEF_LATENCY_US;
+	config.simBusKhz = SIM_DEF_BUS_KHZ;
+	config.simSpeed = 1;
+	config.simFailRate = 0;
+	config.simOutageStart = 0;
+	config.simOutageSecs = 0;
+	config.simResetSecs = 0;
+	config.i2cBus = -1;
+	config.i2cAddr = MPPT_CHG_I2C_ADDR;
+	config.burstMode = BURST_RO;
+	config.i2cRetries = I2C_DEF_RETRIES;
+	config.linkFailSecs = LINK_DEF_FAIL_SECS;
+	strncpy(config.gpioChip, "/dev/gpiochip0", MAX_STRING_LEN);
+	config.gpioAlert = -1;
+	config.gpioNight = -1;
+	config.gpioDebounceUs = 0;
 	config.tcpPort = 0;
 	config.tcpMaxConnections = 1;
-	config.logDelay = 60;
+	config.tcpIdleSecs = 0;
+	config.httpPort = 0;
+	config.unixPath[0] = 0;
+	config.unixMax = UNIX_DEF_MAX;
+	config.unixMode = UNIX_DEF_MODE;
+	config.unixWriteGid = -1;
+	config.outBufSize = OUTBUF_DEF_SIZE;
+	config.outBufPolicy = OUTBUF_CLOSE;
+	config.logDelayMs = 60000;
+	config.logFormat = LOGFMT_TEXT;
+	config.logRecords = LOG_DEF_RECORDS;
+	config.logSync = 0;
+	config.logParams.batchRecs = 1;
+	config.logParams.flushSecs = 60;
+	config.logParams.fsyncSecs = 0;
+	config.logParams.maxSize = 0;
+	config.logParams.rotateSecs = 0;
+	config.logParams.keep = 5;
+	config.enLogDeadband = false;
+	config.logMaxInterval = LOG_DEF_MAX_INTERVAL;
+
+	config.alertPeriodMs = ALERT_DEF_PERIOD_MS;
+	config.paramPeriodMs = PARAM_CHECK_SECS * 1000;
+	config.wdPeriodMs = WD_UPDATE_SECS * 1000;
+	config.histPeriodMs = HIST_DEF_PERIOD_MS;
+	config.histSizes[HIST_RAW] = HIST_DEF_RAW;
+	config.histSizes[HIST_MINUTE] = HIST_DEF_MINUTES;
+	config.histSizes[HIST_HOUR] = HIST_DEF_HOURS;
+	config.pollBudgetPct = POLL_DEF_BUDGET_PCT;
 
 	strncpy(config.logFileName, "/home/pi/mpptChgConfig.txt", MAX_STRING_LEN);
 
 	for (i=0; i<NUM_CMDS; i++) {
 		config.logMask[i] = false;
+		config.logDeadband[i] = 0;
+		config.cacheAge[i] = cmdList[i].cacheAge;
 	}
 	for (i=0; i<NUM_PARAMS; i++) {
 		config.paramArray[i] = 0;
 	}
+
+	for (i=0; i<MAX_CHARGERS; i++) {
+		config.chargers[i].enabled = false;
+		config.chargers[i].chgType = CHG_BACKEND_I2C;
+		config.chargers[i].i2cBus = -1;
+		config.chargers[i].i2cAddr = MPPT_CHG_I2C_ADDR;
+		config.chargers[i].pollMs = POLL_DEF_MS;
+		memset(config.chargers[i].pollMask, 0, sizeof(config.chargers[i].pollMask));
+		config.chargers[i].logFileName[0] = 0;
+	}
 }
 
 
-int FindCmdIndex(char* regS)
+int ParseKeyHandler(void* user, const char* section, const char* name, const char* value);
+
+// Items in a [charger.N] section.  [charger.0] is the primary charger and only takes its
+// I2C_BUS and I2C_ADDR (the same as the global items).  A SIM charger uses the global
+// simulation items.
+int ParseChargerKey(config_t* pconfig, const char* section, const char* name, const char* value)
 {
-	int i = 0;
+	chargerConfig_t* c;
+	int n, t;
 
-	while (i < NUM_CMDS) {
-		if (strcmp(regS, cmdList[i].cName) == 0) {
-			return i;
+	n = isdigit(section[8]) ? atoi(&section[8]) : -1;
+	if ((n < 0) || (n >= MAX_CHARGERS)) {
+		syslog(LOG_ERR, "Config unknown section [%s]", section);
+		return 0;
+	}
+	if (n == 0) {
+		if (MATCH("I2C_BUS") || MATCH("I2C_ADDR")) {
+			return ParseKeyHandler(pconfig, "", name, value);
+		}
+		syslog(LOG_INFO,"Config [charger.0] unknown %s", name);
+		return 0;
+	}
+
+	c = &pconfig->chargers[n];
+	c->enabled = true;
+	if (MATCH("CHARGER")) {
+		if (strcmp(value, "I2C") == 0) {
+			c->chgType = CHG_BACKEND_I2C;
+		} else if (strcmp(value, "SIM") == 0) {
+			c->chgType = CHG_BACKEND_SIM;
+		} else {
+			syslog(LOG_ERR, "Unknown [charger.%d] CHARGER %s", n, value);
+			return 0;
+		}
+		syslog(LOG_INFO,"Config [charger.%d] CHARGER = %s", n, value);
+	} else if (MATCH("I2C_BUS")) {
+		c->i2cBus = atoi(value);
+		syslog(LOG_INFO,"Config [charger.%d] I2C_BUS = %d", n, c->i2cBus);
+	} else if (MATCH("I2C_ADDR")) {
+		c->i2cAddr = (int) strtol(value, NULL, 0);
+		syslog(LOG_INFO,"Config [charger.%d] I2C_ADDR = 0x%02X", n, c->i2cAddr);
+	} else if (MATCH("POLL_MS")) {
+		c->pollMs = atoi(value);
+		if (c->pollMs < SCHED_MIN_PERIOD_MS) {
+			c->pollMs = SCHED_MIN_PERIOD_MS;
 		}
-		i++;
+		syslog(LOG_INFO,"Config [charger.%d] POLL_MS = %d", n, c->pollMs);
+	} else if (MATCH("LOG")) {
+		t = FindCmdIndex((char *) value);
+		if (t != -1) {
+			c->pollMask[t] = true;
+			syslog(LOG_INFO, "Config [charger.%d] LOG=%s", n, (char *) value);
+		} else {
+			syslog(LOG_INFO, "Config [charger.%d] skipping unknown LOG=%s", n, (char *) value);
+		}
+	} else if (MATCH("LOG_FILE")) {
+		strncpy(c->logFileName, value, MAX_STRING_LEN - 1);
+		syslog(LOG_INFO,"Config [charger.%d] LOG_FILE = %s", n, c->logFileName);
+	} else {
+		syslog(LOG_INFO,"Config [charger.%d] unknown %s", n, name);
+		return 0;
 	}
 
-	return -1;
+	return 1;
 }
 
 
 int ParseKeyHandler(void* user, const char* section, const char* name, const char* value)
 {
 	config_t* pconfig = (config_t*) user;
+	struct group* grp;
+	char regS[16];
+	char* cp;
 	int t;
 
+	if (strncmp(section, "charger.", 8) == 0) {
+		return ParseChargerKey(pconfig, section, name, value);
+	}
+
 	if (MATCH("SHUTDOWN")) {
 		pconfig->enAutoShutdown = (atoi(value) != 0);
 		syslog(LOG_INFO,"Config SHUTDOWN = %d", pconfig->enAutoShutdown);
+	} else if (MATCH("SHM")) {
+		pconfig->enShm = (atoi(value) != 0);
+		syslog(LOG_INFO,"Config SHM = %d", pconfig->enShm);
+	} else if (MATCH("CHARGER")) {
+		if (strcmp(value, "I2C") == 0) {
+			pconfig->chgType = CHG_BACKEND_I2C;
+		} else if (strcmp(value, "SIM") == 0) {
+			pconfig->chgType = CHG_BACKEND_SIM;
+		} else if (strcmp(value, "REPLAY") == 0) {
+			pconfig->chgType = CHG_BACKEND_REPLAY;
+		} else {
+			syslog(LOG_ERR, "Unknown CHARGER %s", value);
+			return 0;
+		}
+		syslog(LOG_INFO,"Config CHARGER = %s", value);
+	} else if (MATCH("CHARGER_RECORD")) {
+		// Recording truncates the file so it can't be the one being replayed
+		strncpy(pconfig->chgRecordFile, value, MAX_STRING_LEN-1);
+		if (strcmp(pconfig->chgRecordFile, pconfig->chgReplayFile) == 0) {
+			syslog(LOG_ERR, "CHARGER_RECORD %s is the CHARGER_REPLAY file", value);
+			return 0;
+		}
+		syslog(LOG_INFO,"Config CHARGER_RECORD = %s", pconfig->chgRecordFile);
+	} else if (MATCH("CHARGER_REPLAY")) {
+		strncpy(pconfig->chgReplayFile, value, MAX_STRING_LEN-1);
+		if (strcmp(pconfig->chgReplayFile, pconfig->chgRecordFile) == 0) {
+			syslog(LOG_ERR, "CHARGER_REPLAY %s is the CHARGER_RECORD file", value);
+			return 0;
+		}
+		syslog(LOG_INFO,"Config CHARGER_REPLAY = %s", pconfig->chgReplayFile);
+	} else if (MATCH("SIM_LATENCY_US")) {
+		pconfig->simLatencyUs = atoi(value);
+		if (pconfig->simLatencyUs < 0) {
+			pconfig->simLatencyUs = 0;
+		}
+		syslog(LOG_INFO,"Config SIM_LATENCY_US = %d", pconfig->simLatencyUs);
+	} else if (MATCH("SIM_BUS_KHZ")) {
+		pconfig->simBusKhz = atoi(value);
+		if (pconfig->simBusKhz < 0) {
+			pconfig->simBusKhz = 0;
+		}
+		syslog(LOG_INFO,"Config SIM_BUS_KHZ = %d", pconfig->simBusKhz);
+	} else if (MATCH("SIM_SPEED")) {
+		pconfig->simSpeed = atoi(value);
+		if (pconfig->simSpeed < 1) {
+			pconfig->simSpeed = 1;
+		}
+		syslog(LOG_INFO,"Config SIM_SPEED = %d", pconfig->simSpeed);
+	} else if (MATCH("SIM_FAIL_RATE")) {
+		pconfig->simFailRate = atoi(value);
+		if (pconfig->simFailRate < 0) {
+			pconfig->simFailRate = 0;
+		} else if (pconfig->simFailRate > 1000) {
+			pconfig->simFailRate = 1000;
+		}
+		syslog(LOG_INFO,"Config SIM_FAIL_RATE = %d", pconfig->simFailRate);
+	} else if (MATCH("SIM_OUTAGE")) {
+		if ((sscanf(value, "%d,%d", &pconfig->simOutageStart, &pconfig->simOutageSecs) != 2) ||
+		    (pconfig->simOutageStart < 0) || (pconfig->simOutageSecs < 0)) {
+			syslog(LOG_ERR, "Bad SIM_OUTAGE %s", value);
+			return 0;
+		}
+		syslog(LOG_INFO,"Config SIM_OUTAGE = %d,%d", pconfig->simOutageStart, pconfig->simOutageSecs);
+	} else if (MATCH("SIM_RESET")) {
+		pconfig->simResetSecs = atoi(value);
+		if (pconfig->simResetSecs < 0) {
+			pconfig->simResetSecs = 0;
+		}
+		syslog(LOG_INFO,"Config SIM_RESET = %d", pconfig->simResetSecs);
+	} else if (MATCH("I2C_BUS")) {
+		pconfig->i2cBus = atoi(value);
+		syslog(LOG_INFO,"Config I2C_BUS = %d", pconfig->i2cBus);
+	} else if (MATCH("I2C_ADDR")) {
+		pconfig->i2cAddr = (int) strtol(value, NULL, 0);
+		syslog(LOG_INFO,"Config I2C_ADDR = 0x%02X", pconfig->i2cAddr);
+	} else if (MATCH("I2C_BURST")) {
+		pconfig->burstMode = atoi(value);
+		if ((pconfig->burstMode < BURST_NONE) || (pconfig->burstMode > BURST_ALL)) {
+			pconfig->burstMode = BURST_RO;
+		}
+		syslog(LOG_INFO,"Config I2C_BURST = %d", pconfig->burstMode);
+	} else if (MATCH("I2C_RETRIES")) {
+		pconfig->i2cRetries = atoi(value);
+		if (pconfig->i2cRetries < 0) {
+			pconfig->i2cRetries = 0;
+		} else if (pconfig->i2cRetries > I2C_MAX_RETRIES) {
+			pconfig->i2cRetries = I2C_MAX_RETRIES;
+		}
+		syslog(LOG_INFO,"Config I2C_RETRIES = %d", pconfig->i2cRetries);
+	} else if (MATCH("I2C_FAIL_SECS")) {
+		pconfig->linkFailSecs = atoi(value);
+		if (pconfig->linkFailSecs < 0) {
+			pconfig->linkFailSecs = 0;
+		}
+		syslog(LOG_INFO,"Config I2C_FAIL_SECS = %d", pconfig->linkFailSecs);
+	} else if (MATCH("GPIO_CHIP")) {
+		strncpy(pconfig->gpioChip, value, MAX_STRING_LEN - 1);
+		pconfig->gpioChip[MAX_STRING_LEN - 1] = 0;
+		syslog(LOG_INFO,"Config GPIO_CHIP = %s", pconfig->gpioChip);
+	} else if (MATCH("GPIO_ALERT")) {
+		pconfig->gpioAlert = atoi(value);
+		syslog(LOG_INFO,"Config GPIO_ALERT = %d", pconfig->gpioAlert);
+	} else if (MATCH("GPIO_NIGHT")) {
+		pconfig->gpioNight = atoi(value);
+		syslog(LOG_INFO,"Config GPIO_NIGHT = %d", pconfig->gpioNight);
+	} else if (MATCH("GPIO_DEBOUNCE_US")) {
+		pconfig->gpioDebounceUs = atoi(value);
+		syslog(LOG_INFO,"Config GPIO_DEBOUNCE_US = %d", pconfig->gpioDebounceUs);
 	} else if (MATCH("TCP_PORT")) {
 		pconfig->tcpPort = atoi(value);
 		syslog(LOG_INFO,"Config TCP_PORT = %d", pconfig->tcpPort);
 	} else if (MATCH("TCP_MAX")) {
 		pconfig->tcpMaxConnections = atoi(value);
-		if (pconfig->tcpMaxConnections > (MAX_CONNECTIONS - 1))  {
-			pconfig->tcpMaxConnections = MAX_CONNECTIONS - 1;
-		}
 		syslog(LOG_INFO,"Config TCP_MAX = %d", pconfig->tcpMaxConnections);
+	} else if (MATCH("TCP_IDLE")) {
+		pconfig->tcpIdleSecs = atoi(value);
+		syslog(LOG_INFO,"Config TCP_IDLE = %d", pconfig->tcpIdleSecs);
+	} else if (MATCH("HTTP_PORT")) {
+		pconfig->httpPort = atoi(value);
+		syslog(LOG_INFO,"Config HTTP_PORT = %d", pconfig->httpPort);
+	} else if (MATCH("UNIX_SOCKET")) {
+		strncpy(pconfig->unixPath, value, MAX_STRING_LEN - 1);
+		pconfig->unixPath[MAX_STRING_LEN - 1] = 0;
+		syslog(LOG_INFO,"Config UNIX_SOCKET = %s", pconfig->unixPath);
+	} else if (MATCH("UNIX_MAX")) {
+		pconfig->unixMax = atoi(value);
+		syslog(LOG_INFO,"Config UNIX_MAX = %d", pconfig->unixMax);
+	} else if (MATCH("UNIX_MODE")) {
+		pconfig->unixMode = (int) strtol(value, NULL, 8) & 0777;
+		syslog(LOG_INFO,"Config UNIX_MODE = %03o", pconfig->unixMode);
+	} else if (MATCH("UNIX_WRITE_GROUP")) {
+		// Group name or number
+		if ((grp = getgrnam(value)) != NULL) {
+			pconfig->unixWriteGid = grp->gr_gid;
+		} else if (isdigit(*value)) {
+			pconfig->unixWriteGid = atoi(value);
+		} else {
+			syslog(LOG_INFO, "Config skipping unknown UNIX_WRITE_GROUP=%s", (char *) value);
+			return 1;
+		}
+		syslog(LOG_INFO,"Config UNIX_WRITE_GROUP = %d", pconfig->unixWriteGid);
+	} else if (MATCH("OUTBUF_SIZE")) {
+		pconfig->outBufSize = atoi(value);
+		if (pconfig->outBufSize < OUTBUF_MIN_SIZE) {
+			pconfig->outBufSize = OUTBUF_MIN_SIZE;
+		}
+		syslog(LOG_INFO,"Config OUTBUF_SIZE = %d", pconfig->outBufSize);
+	} else if (MATCH("OUTBUF_POLICY")) {
+		if (strcmp(value, "DROP") == 0) {
+			pconfig->outBufPolicy = OUTBUF_DROP;
+		} else if (strcmp(value, "CLOSE") == 0) {
+			pconfig->outBufPolicy = OUTBUF_CLOSE;
+		} else {
+			syslog(LOG_INFO, "Config skipping unknown OUTBUF_POLICY=%s", (char *) value);
+			return 1;
+		}
+		syslog(LOG_INFO,"Config OUTBUF_POLICY = %s", (char *) value);
 	} else if (MATCH("LOG")) {
 		t = FindCmdIndex((char *) value);
 		if (t != -1) {
@@ -241,9 +1087,115 @@ int ParseKeyHandler(void* user, const char* section, const char* name, const cha
 		} else {
 			syslog(LOG_INFO, "Config skipping unknown LOG=%s", (char *) value);
 		}
+	} else if (MATCH("HISTORY")) {
+		t = FindCmdIndex((char *) value);
+		if (t != -1) {
+			pconfig->histMask[t] = true;
+			pconfig->enHistory = true;
+			syslog(LOG_INFO, "Config HISTORY=%s", (char *) value);
+		} else {
+			syslog(LOG_INFO, "Config skipping unknown HISTORY=%s", (char *) value);
+		}
+	} else if (MATCH("HISTORY_PERIOD_MS")) {
+		pconfig->histPeriodMs = atoi(value);
+		syslog(LOG_INFO,"Config HISTORY_PERIOD_MS = %d", pconfig->histPeriodMs);
+	} else if (MATCH("HISTORY_RAW")) {
+		pconfig->histSizes[HIST_RAW] = atoi(value);
+		syslog(LOG_INFO,"Config HISTORY_RAW = %d", pconfig->histSizes[HIST_RAW]);
+	} else if (MATCH("HISTORY_MINUTES")) {
+		pconfig->histSizes[HIST_MINUTE] = atoi(value);
+		syslog(LOG_INFO,"Config HISTORY_MINUTES = %d", pconfig->histSizes[HIST_MINUTE]);
+	} else if (MATCH("HISTORY_HOURS")) {
+		pconfig->histSizes[HIST_HOUR] = atoi(value);
+		syslog(LOG_INFO,"Config HISTORY_HOURS = %d", pconfig->histSizes[HIST_HOUR]);
+	} else if (MATCH("CACHE_AGE")) {
+		// Form is <REG>:<mSec>
+		strncpy(regS, value, sizeof(regS) - 1);
+		regS[sizeof(regS) - 1] = 0;
+		if ((cp = strchr(regS, ':')) != NULL) {
+			*cp++ = 0;
+		}
+		t = FindCmdIndex(regS);
+		if ((t != -1) && (cp != NULL)) {
+			pconfig->cacheAge[t] = atoi(cp);
+			syslog(LOG_INFO, "Config CACHE_AGE %s = %d", regS, pconfig->cacheAge[t]);
+		} else {
+			syslog(LOG_INFO, "Config skipping bad CACHE_AGE=%s", (char *) value);
+		}
+	} else if (MATCH("LOG_DEADBAND")) {
+		// Form is <REG>:<change>
+		strncpy(regS, value, sizeof(regS) - 1);
+		regS[sizeof(regS) - 1] = 0;
+		if ((cp = strchr(regS, ':')) != NULL) {
+			*cp++ = 0;
+		}
+		t = FindCmdIndex(regS);
+		if ((t != -1) && (cp != NULL) && (atoi(cp) >= 0)) {
+			pconfig->logDeadband[t] = atoi(cp);
+			pconfig->enLogDeadband = true;
+			syslog(LOG_INFO, "Config LOG_DEADBAND %s = %d", regS, pconfig->logDeadband[t]);
+		} else {
+			syslog(LOG_INFO, "Config skipping bad LOG_DEADBAND=%s", (char *) value);
+		}
+	} else if (MATCH("LOG_MAX_INTERVAL")) {
+		pconfig->logMaxInterval = atoi(value);
+		if (pconfig->logMaxInterval < 0) {
+			pconfig->logMaxInterval = 0;
+		}
+		syslog(LOG_INFO,"Config LOG_MAX_INTERVAL = %d", pconfig->logMaxInterval);
 	} else if (MATCH("LOG_DELAY")) {
-		pconfig->logDelay = atoi(value);
-		syslog(LOG_INFO,"Config LOG_DELAY = %d", pconfig->logDelay);
+		pconfig->logDelayMs = atoi(value) * 1000;
+		syslog(LOG_INFO,"Config LOG_DELAY = %d", pconfig->logDelayMs / 1000);
+	} else if (MATCH("LOG_DELAY_MS")) {
+		pconfig->logDelayMs = atoi(value);
+		syslog(LOG_INFO,"Config LOG_DELAY_MS = %d", pconfig->logDelayMs);
+	} else if (MATCH("ALERT_PERIOD_MS")) {
+		pconfig->alertPeriodMs = atoi(value);
+		syslog(LOG_INFO,"Config ALERT_PERIOD_MS = %d", pconfig->alertPeriodMs);
+	} else if (MATCH("PARAM_PERIOD_MS")) {
+		pconfig->paramPeriodMs = atoi(value);
+		syslog(LOG_INFO,"Config PARAM_PERIOD_MS = %d", pconfig->paramPeriodMs);
+	} else if (MATCH("WD_PERIOD_MS")) {
+		pconfig->wdPeriodMs = atoi(value);
+		if (pconfig->wdPeriodMs > WD_MAX_PERIOD_MS) {
+			pconfig->wdPeriodMs = WD_MAX_PERIOD_MS;
+		}
+		syslog(LOG_INFO,"Config WD_PERIOD_MS = %d", pconfig->wdPeriodMs);
+	} else if (MATCH("LOG_FORMAT")) {
+		if (strcmp(value, "BINARY") == 0) {
+			pconfig->logFormat = LOGFMT_BINARY;
+		} else {
+			pconfig->logFormat = LOGFMT_TEXT;
+		}
+		syslog(LOG_INFO,"Config LOG_FORMAT = %s", (pconfig->logFormat == LOGFMT_BINARY) ? "BINARY" : "TEXT");
+	} else if (MATCH("LOG_RECORDS")) {
+		pconfig->logRecords = atoi(value);
+		if (pconfig->logRecords <= 0) {
+			pconfig->logRecords = LOG_DEF_RECORDS;
+		}
+		syslog(LOG_INFO,"Config LOG_RECORDS = %d", pconfig->logRecords);
+	} else if (MATCH("LOG_SYNC")) {
+		pconfig->logSync = atoi(value);
+		syslog(LOG_INFO,"Config LOG_SYNC = %d", pconfig->logSync);
+	} else if (MATCH("LOG_BATCH")) {
+		pconfig->logParams.batchRecs = atoi(value);
+		syslog(LOG_INFO,"Config LOG_BATCH = %d", pconfig->logParams.batchRecs);
+	} else if (MATCH("LOG_FLUSH")) {
+		pconfig->logParams.flushSecs = atoi(value);
+		syslog(LOG_INFO,"Config LOG_FLUSH = %d", pconfig->logParams.flushSecs);
+	} else if (MATCH("LOG_FSYNC")) {
+		pconfig->logParams.fsyncSecs = atoi(value);
+		syslog(LOG_INFO,"Config LOG_FSYNC = %d", pconfig->logParams.fsyncSecs);
+	} else if (MATCH("LOG_MAX_SIZE")) {
+		// Specified in KB
+		pconfig->logParams.maxSize = atol(value) * 1024;
+		syslog(LOG_INFO,"Config LOG_MAX_SIZE = %ld", pconfig->logParams.maxSize);
+	} else if (MATCH("LOG_ROTATE")) {
+		pconfig->logParams.rotateSecs = atoi(value);
+		syslog(LOG_INFO,"Config LOG_ROTATE = %d", pconfig->logParams.rotateSecs);
+	} else if (MATCH("LOG_KEEP")) {
+		pconfig->logParams.keep = atoi(value);
+		syslog(LOG_INFO,"Config LOG_KEEP = %d", pconfig->logParams.keep);
 	} else if (MATCH("LOG_FILE")) {
 		strncpy(pconfig->logFileName, value, MAX_STRING_LEN);
 		syslog(LOG_INFO,"Config LOG_FILE = %s", pconfig->logFileName);
@@ -286,6 +1238,14 @@ int ParseKeyHandler(void* user, const char* section, const char* name, const cha
 	} else if (MATCH("WATCHDOG")) {
 		pconfig->enWatchdog = (atoi(value) != 0);
 		syslog(LOG_INFO,"Config WATCHDOG = %d", pconfig->enWatchdog);
+	} else if (MATCH("POLL_BUDGET_PCT")) {
+		pconfig->pollBudgetPct = atoi(value);
+		if (pconfig->pollBudgetPct < 1) {
+			pconfig->pollBudgetPct = 1;
+		} else if (pconfig->pollBudgetPct > 100) {
+			pconfig->pollBudgetPct = 100;
+		}
+		syslog(LOG_INFO,"Config POLL_BUDGET_PCT = %d", pconfig->pollBudgetPct);
 	} else {
 		syslog(LOG_INFO,"Config unknown %s", name);
 		return 0;
@@ -295,449 +1255,4210 @@ int ParseKeyHandler(void* user, const char* section, const char* name, const cha
 }
 
 
-bool ReadCharger(char* regS, int* val)
+uint64_t GetMsec()
 {
-	int cmdIndex;
-	int retVal;
+	struct timespec ts;
 
-	// Figure out what we're reading
-	if ((cmdIndex = FindCmdIndex(regS)) == -1) {
-		syslog(LOG_ERR, "No I2C device %s for read", regS);
-		return false;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
 
-	// Do the read
-	if (cmdList[cmdIndex].isWord) {
-		retVal = wiringPiI2CReadReg16(i2cFd, cmdList[cmdIndex].regAddr);
-		if (retVal != -1) {
-			// Swap bytes for endian conversion
-			retVal = ((retVal & 0xFF) << 8) | ((retVal >> 8) & 0xFF);
+
+void InitCache()
+{
+	int i, j;
+
+	for (j=0; j<MAX_CHARGERS; j++) {
+		devs[j].id = j;
+		devs[j].enabled = (j == 0);
+		devs[j].backend = NULL;
+		devs[j].linkBackoffMs = LINK_REOPEN_MIN_MS;
+		for (i=0; i<NUM_CMDS; i++) {
+			devs[j].cache[i].valid = false;
+			devs[j].cache[i].expired = false;
 		}
-	} else {
-		retVal = wiringPiI2CReadReg8(i2cFd, cmdList[cmdIndex].regAddr);
 	}
+}
 
-	if (retVal == -1) {
-		syslog(LOG_ERR, "I2C read of %s (%d) failed", regS, cmdList[cmdIndex].regAddr);
-		return false;
-	} else {
-		if (cmdList[cmdIndex].isSigned) {
-			// 2's complement to create negative int
-			if (cmdList[cmdIndex].isWord) {
-				if (retVal & 0x8000) {
-					retVal = -(0x8000 - (retVal & 0x7FFF));
-				}
-			} else {
-				if (retVal & 0x80) {
-					retVal = -(0x80 - (retVal & 0x7F));
-				}
-			}
-		}
-		*val = retVal;
-		return true;
+
+// Returns the charger numbered n or NULL if there isn't one
+chgDev_t* FindCharger(int n)
+{
+	if ((n < 0) || (n >= MAX_CHARGERS) || !devs[n].enabled) {
+		return NULL;
 	}
+	return &devs[n];
 }
 
 
-// Assumes we never write a negative number
-bool WriteCharger(char* regS, int val)
+void CacheUpdate(chgDev_t* dev, int cmdIndex, int val, uint64_t msec)
 {
-	int cmdIndex;
-	int retVal;
+	dev->cache[cmdIndex].valid = true;
+	dev->cache[cmdIndex].expired = false;
+	dev->cache[cmdIndex].val = val;
+	dev->cache[cmdIndex].msec = msec;
+}
 
-	// Figure out what we're writing
-	if ((cmdIndex = FindCmdIndex(regS)) == -1) {
-		syslog(LOG_ERR, "No I2C device %s for write", regS);
-		return false;
-	}
 
-	// Do the write
-	if (cmdList[cmdIndex].isWord) {
-		retVal = wiringPiI2CWriteReg16(i2cFd, cmdList[cmdIndex].regAddr,
-									   ((val >> 8) & 0xFF) | ((val & 0xFF) << 8));
-	} else {
-		retVal = wiringPiI2CWriteReg8(i2cFd, cmdList[cmdIndex].regAddr, val & 0xFF);
-	}
+// Force the next read of a register to go to the charger
+void CacheExpire(chgDev_t* dev, int cmdIndex)
+{
+	dev->cache[cmdIndex].expired = true;
+}
 
-	if (retVal == -1) {
-		syslog(LOG_ERR, "I2C write of %s (%d) failed", regS, cmdList[cmdIndex].regAddr);
+
+bool CacheIsFresh(chgDev_t* dev, int cmdIndex, uint64_t now)
+{
+	cacheEntry_t* c = &dev->cache[cmdIndex];
+
+	if (!c->valid || c->expired) {
 		return false;
-	} else {
+	}
+	if (config.cacheAge[cmdIndex] == CACHE_FOREVER) {
 		return true;
 	}
+	return ((now - c->msec) < (uint64_t) config.cacheAge[cmdIndex]);
 }
 
 
-bool ConnectCharger()
+// One counted and timed transaction
+bool ChargerXfer(bool isWrite, int regAddr, int len, unsigned char* buf)
 {
-	int s;
+	uint64_t t;
+	bool success;
+	int i;
 
-	// Attempt to open the interface
-	i2cFd = wiringPiI2CSetup(MPPT_CHG_I2C_ADDR);
-	if (i2cFd == -1) {
-		syslog(LOG_ERR, "Could not open I2C interface");
-		return false;
+	i = regCmdIndex[regAddr];
+	__atomic_fetch_add(&counters.i2cTransactions, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(isWrite ? &counters.regWrites[i] : &counters.regReads[i], 1, __ATOMIC_RELAXED);
+	t = StatsUsec();
+	success = isWrite ? ChgWrite(i2cDev->backend, regAddr, len, buf) : ChgRead(i2cDev->backend, regAddr, len, buf);
+	StatsHistSince(&counters.i2cTime, t);
+	if (!success) {
+		__atomic_fetch_add(&counters.i2cErrors, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(isWrite ? &counters.regWriteErrors[i] : &counters.regReadErrors[i], 1, __ATOMIC_RELAXED);
 	}
+	return success;
+}
 
-	// Attempt to communicate with the charger by validating the board ID
-	if (ReadCharger("ID", &s)) {
-		if ((s & 0xF000) == 0x1000) {
-			syslog(LOG_NOTICE, "MPPT Solar Charger FW %d.%d",
-				   (s & 0x00F0) >> 4,
-				   (s & 0x000F));
-			return true;
-		} else {
-			syslog(LOG_ERR, "Charger did not identify correctly");
-			return false;
-		}
-	} else {
-		syslog(LOG_ERR, "Could not communicate with charger");
-		return false;
+
+int ClassifyI2cError(int err)
+{
+	switch (err) {
+		case EIO:
+		case EREMOTEIO:
+		case ENXIO:
+		case EAGAIN:
+		case EBUSY:
+		case ETIMEDOUT:
+		case EPROTO:
+		case EINTR:
+			return I2C_ERR_TRANSIENT;
+		case EINVAL:
+		case EOPNOTSUPP:
+		case ENOTTY:
+		case ENODATA:
+			return I2C_ERR_REQUEST;
+		default:
+			// ENODEV, EBADF, ESHUTDOWN and anything unexpected
+			return I2C_ERR_LINK;
 	}
 }
 
 
-bool UpdateParms()
+// The charger identifies itself as 0x1<FW major><FW minor>
+bool ChargerIdValid(int id)
 {
-	bool success = true;
-	int i, n, t;
+	return ((id & 0xF000) == 0x1000);
+}
 
-	// Find the first entry
-	n = FindCmdIndex("BULKV");
 
-	// Scan for any entries that are to be modified and need updating
-	for (i=0; i<NUM_PARAMS; i++) {
-		if (config.paramArray[i] != 0) {
-			if (ReadCharger((char *) cmdList[i+n].cName, &t)) {
-				if (config.paramArray[i] != t) {
-					if (!WriteCharger((char *) cmdList[i+n].cName, config.paramArray[i])) {
-						success = false;
-						break;
-					}
-				}
-			} else {
-				success = false;
-				break;
-			}
-		}
+void ChargerLinkFailed()
+{
+	chgDev_t* dev = i2cDev;
+	int e = errno;
+	uint64_t now;
+
+	now = GetMsec();
+	if (__atomic_load_n(&dev->linkDownMs, __ATOMIC_RELAXED) == 0) {
+		syslog(LOG_ERR, "Charger %d link down: %m", dev->id);
+		__atomic_store_n(&dev->linkDownMs, now, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counters.linkFailures, 1, __ATOMIC_RELAXED);
+		dev->linkBackoffMs = LINK_REOPEN_MIN_MS;
 	}
-
-	return success;
+	dev->linkDown = true;
+	dev->linkRetryMs = now + dev->linkBackoffMs;
+	errno = e;
 }
 
 
-bool EnableWatchdog()
+// Returns true if the link is up.  While it is down reopen the interface (or open it if
+// it couldn't be opened at startup) and check the charger's ID when the next attempt is
+// due.
+bool ChargerLinkReady()
 {
-	if (!WriteCharger("WDEN", WDEN_MAGIC_BYTE)) {
-		return false;
-	}
+	chgDev_t* dev = i2cDev;
+	unsigned char buf[2];
+	bool opened;
+	int id;
 
-	if (!WriteCharger("WDCNT", WD_INIT_SECS)) {
+	if (!dev->linkDown) {
+		return true;
+	}
+	if (GetMsec() < dev->linkRetryMs) {
+		errno = ENOTCONN;
 		return false;
 	}
 
-	if (!WriteCharger("WDPWROFF", WD_PWROFF_SECS)) {
-		return false;
+	if (dev->backend == NULL) {
+		opened = ((dev->backend = ChgBackendOpen(&dev->params)) != NULL);
+	} else {
+		opened = ChgBackendReopen(dev->backend);
+	}
+	if (opened && ChargerXfer(false, cmdList[FindCmdIndex("ID")].regAddr, 2, buf)) {
+		id = (buf[0] << 8) | buf[1];
+		if (ChargerIdValid(id)) {
+			dev->linkDown = false;
+			return true;
+		}
+		syslog(LOG_ERR, "Charger %d did not identify correctly on reopen (0x%04X)", dev->id, id);
+	} else if (debug>0) {
+		syslog(LOG_NOTICE, "Charger %d reopen failed: %m", dev->id);
 	}
 
-	return true;
+	dev->linkBackoffMs = (2 * dev->linkBackoffMs > LINK_REOPEN_MAX_MS) ? LINK_REOPEN_MAX_MS : 2 * dev->linkBackoffMs;
+	dev->linkRetryMs = GetMsec() + dev->linkBackoffMs;
+	errno = ENOTCONN;
+	return false;
 }
 
 
-bool DisableWatchdog()
+// Run a transaction retrying transient errors.  The link goes down if it still fails
+// or the interface has gone away.
+bool ChargerTransfer(bool isWrite, int regAddr, int len, unsigned char* buf)
 {
-	if (!WriteCharger("WDEN", 0)) {
-		return false;
-	}
+	uint64_t down;
+	int attempt, errClass;
 
-	if (!WriteCharger("WDCNT", 0)) {
+	if (!ChargerLinkReady()) {
 		return false;
 	}
 
-	return true;
-}
+	for (attempt=0; ; attempt++) {
+		if (ChargerXfer(isWrite, regAddr, len, buf)) {
+			break;
+		}
+		errClass = ClassifyI2cError(errno);
+		if (errClass == I2C_ERR_REQUEST) {
+			return false;
+		}
+		if ((errClass == I2C_ERR_LINK) || (attempt >= config.i2cRetries)) {
+			ChargerLinkFailed();
+			return false;
+		}
+		__atomic_fetch_add(&counters.i2cRetries, 1, __ATOMIC_RELAXED);
+		usleep((I2C_RETRY_MS << attempt) * 1000);
+	}
+
+	if ((down = __atomic_load_n(&i2cDev->linkDownMs, __ATOMIC_RELAXED)) != 0) {
+		syslog(LOG_NOTICE, "Charger %d link restored after %llu mSec", i2cDev->id,
+		       (unsigned long long) (GetMsec() - down));
+		__atomic_store_n(&i2cDev->linkDownMs, 0, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&i2cDev->recoveries, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&counters.linkRecoveries, 1, __ATOMIC_RELAXED);
+		i2cDev->linkBackoffMs = LINK_REOPEN_MIN_MS;
+	}
+	return true;
+}
 
 
-bool CheckAlertStatus(bool* alert)
+// Read len bytes starting at regAddr in one transaction.  The charger auto-increments
+// its register pointer.
+bool ReadChargerBlock(int regAddr, int len, unsigned char* buf)
 {
-	int s;
+	return ChargerTransfer(false, regAddr, len, buf);
+}
 
-	if (ReadCharger("STATUS", &s)) {
-		*alert = ((s & STATUS_ALERT_MASK) == STATUS_ALERT_MASK);
 
-		// Handle a special case where we have on very infrequent occasion
-		// seen a response of 0xFFFF for the read.  This could cause us to shutdown
-		// the host without the charger cycling power which results in a hung system
-		// (host won't ever reboot).  So we check again just to be sure.
-		if (*alert) {
-			(void) ReadCharger("STATUS", &s);
-			if ((s & STATUS_ALERT_MASK) == 0) {
-				*alert = false;
+bool WriteChargerBlock(int regAddr, int len, unsigned char* buf)
+{
+	return ChargerTransfer(true, regAddr, len, buf);
+}
+
+
+// Convert a raw register value into an int, handling signed registers
+int DecodeCharger(int cmdIndex, int raw)
+{
+	if (cmdList[cmdIndex].isSigned) {
+		// 2's complement to create negative int
+		if (cmdList[cmdIndex].isWord) {
+			if (raw & 0x8000) {
+				raw = -(0x8000 - (raw & 0x7FFF));
 			}
+		} else {
+			if (raw & 0x80) {
+				raw = -(0x80 - (raw & 0x7F));
+			}
+		}
+	}
+
+	return raw;
+}
+
+
+void InitShadows()
+{
+	int i, j;
+
+	for (j=0; j<MAX_CHARGERS; j++) {
+		for (i=0; i<NUM_CMDS; i++) {
+			devs[j].shadow[i].shadowed = cmdList[i].isWritable && (cmdList[i].cacheAge == CACHE_FOREVER);
+			devs[j].shadow[i].known = false;
+			devs[j].shadow[i].reqKnown = false;
+		}
+		devs[j].chargerId = -1;
+		devs[j].wdRunning = false;
+		devs[j].resets = 0;
+	}
+	idIndex = FindCmdIndex("ID");
+	statusIndex = FindCmdIndex("STATUS");
+}
+
+
+// The charger no longer holds what the daemon set
+void ShadowForget(chgDev_t* dev)
+{
+	int i;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		dev->shadow[i].known = false;
+		dev->shadow[i].reqKnown = false;
+	}
+	dev->wdRunning = false;
+	__atomic_fetch_add(&dev->resets, 1, __ATOMIC_RELAXED);
+	if (dev == &devs[0]) {
+		__atomic_fetch_add(&counters.chargerResets, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&chgResetPending, true, __ATOMIC_RELAXED);
+	} else {
+		syslog(LOG_WARNING, "Charger %d reset, values written to it are not reasserted", dev->id);
+	}
+}
+
+
+// Look for signs of a reset in a value read from the current job's charger
+void ShadowCheck(int cmdIndex, int val)
+{
+	chgDev_t* dev = i2cDev;
+	shadow_t* sh = &dev->shadow[cmdIndex];
+
+	if (cmdIndex == idIndex) {
+		if ((dev->chargerId != -1) && (val != dev->chargerId)) {
+			syslog(LOG_WARNING, "Charger %d ID changed from 0x%04X to 0x%04X", dev->id, dev->chargerId, val);
+			ShadowForget(dev);
+		}
+		dev->chargerId = val;
+	} else if (cmdIndex == statusIndex) {
+		if (dev->wdRunning && ((val & STATUS_WD_RUN_MASK) == 0)) {
+			syslog(LOG_WARNING, "Charger %d watchdog stopped (STATUS 0x%04X)", dev->id, val);
+			ShadowForget(dev);
+		}
+	} else if (sh->shadowed) {
+		if (sh->known && (val != sh->val)) {
+			syslog(LOG_WARNING, "Charger %d %s changed from %d to %d", dev->id, cmdList[cmdIndex].cName, sh->val, val);
+			ShadowForget(dev);
+		}
+		sh->known = true;
+		sh->val = val;
+	}
+}
+
+
+bool ReadCharger(char* regS, int* val)
+{
+	unsigned char buf[2];
+	int cmdIndex;
+	int retVal;
+
+	// Figure out what we're reading
+	if ((cmdIndex = FindCmdIndex(regS)) == -1) {
+		syslog(LOG_ERR, "No I2C device %s for read", regS);
+		return false;
+	}
+
+	// Do the read - data is sent high byte first
+	if (ReadChargerBlock(cmdList[cmdIndex].regAddr, cmdList[cmdIndex].isWord ? 2 : 1, buf)) {
+		retVal = (cmdList[cmdIndex].isWord) ? ((buf[0] << 8) | buf[1]) : buf[0];
+	} else {
+		retVal = -1;
+	}
+
+	if (retVal == -1) {
+		if (errno != ENOTCONN) {
+			syslog(LOG_ERR, "I2C read of %s (%d) failed: %m", regS, cmdList[cmdIndex].regAddr);
 		}
+		return false;
+	} else {
+		*val = DecodeCharger(cmdIndex, retVal);
+		ShadowCheck(cmdIndex, *val);
 		return true;
+	}
+}
+
+
+// Read a contiguous range of registers in one transaction and decode every
+// register that falls entirely within it into the snapshot.  Runs on the I2C worker.
+bool ReadChargerBurst(int regAddr, int len, snapshot_t* snap)
+{
+	unsigned char buf[BURST_RO_LEN + BURST_RW_LEN];
+	int i, n, raw;
+
+	if (!ReadChargerBlock(regAddr, len, buf)) {
+		if ((errno == EOPNOTSUPP) || (errno == ENOTTY)) {
+			syslog(LOG_ERR, "I2C adapter of charger %d does not support burst reads, disabling: %m", i2cDev->id);
+			i2cDev->burstMode = BURST_NONE;
+		} else if (errno != ENOTCONN) {
+			syslog(LOG_ERR, "I2C burst read of %d-%d failed: %m", regAddr, regAddr + len - 1);
+		}
+		return false;
+	}
+
+	for (i=0; i<NUM_CMDS; i++) {
+		n = cmdList[i].regAddr - regAddr;
+		if ((n >= 0) && ((n + (cmdList[i].isWord ? 2 : 1)) <= len)) {
+			raw = (cmdList[i].isWord) ? ((buf[n] << 8) | buf[n+1]) : buf[n];
+			snap->val[i] = DecodeCharger(i, raw);
+			snap->valid[i] = true;
+			ShadowCheck(i, snap->val[i]);
+		}
+	}
+
+	return true;
+}
+
+
+// Fill the snapshot with the registers selected by mask.  Uses burst reads when
+// enabled and falls back to individual register reads for anything not covered.
+// Runs on the I2C worker.
+bool ReadChargerSnapshot(bool* mask, snapshot_t* snap)
+{
+	bool needRo = false;
+	bool needRw = false;
+	int i, roStart;
+
+	roStart = BURST_RO_NS_START;
+	for (i=0; i<NUM_CMDS; i++) {
+		snap->valid[i] = false;
+		if (mask[i]) {
+			if (cmdList[i].regAddr < BURST_RO_NS_START) {
+				roStart = BURST_RO_START;
+			}
+			if (cmdList[i].regAddr < BURST_RW_START) {
+				needRo = true;
+			} else {
+				needRw = true;
+			}
+		}
+	}
+
+	gettimeofday(&snap->t, NULL);
+	snap->msec = GetMsec();
+
+	// Registers from a failed burst are retried individually unless the link is down
+	if (needRo && (i2cDev->burstMode >= BURST_RO)) {
+		if (!ReadChargerBurst(roStart, BURST_RO_START + BURST_RO_LEN - roStart, snap) && !i2cDev->linkDown) {
+			__atomic_fetch_add(&counters.i2cRetries, 1, __ATOMIC_RELAXED);
+		}
+	}
+	if (needRw && (i2cDev->burstMode == BURST_ALL)) {
+		if (!ReadChargerBurst(BURST_RW_START, BURST_RW_LEN, snap) && !i2cDev->linkDown) {
+			__atomic_fetch_add(&counters.i2cRetries, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	for (i=0; i<NUM_CMDS; i++) {
+		if (mask[i] && !snap->valid[i]) {
+			if (!ReadCharger((char *) cmdList[i].cName, &snap->val[i])) {
+				return false;
+			}
+			snap->valid[i] = true;
+		}
+	}
+
+	return true;
+}
+
+
+// Return register values from the cache and true if they are all younger than their
+// max-age.  Otherwise set readMask to the registers to read from the charger and return
+// false.  If any requested register is stale all of them are refreshed together so the
+// values are coherent.  When burst reads are enabled the whole burst range is refreshed
+// so reads of other registers in the same window are served from the cache (apart from
+// ID and STATUS which are only read when asked for).  age is set to the age of the
+// oldest value.
+bool CacheLookupSet(chgDev_t* dev, bool* mask, int* vals, int* age, bool* readMask)
+{
+	bool needRo = false;
+	bool needRw = false;
+	bool stale = false;
+	uint64_t now;
+	int i, a;
+
+	now = GetMsec();
+	for (i=0; i<NUM_CMDS; i++) {
+		if (mask[i]) {
+			if (!CacheIsFresh(dev, i, now)) {
+				stale = true;
+			}
+			if (cmdList[i].regAddr < BURST_RW_START) {
+				needRo = true;
+			} else {
+				needRw = true;
+			}
+		}
+	}
+
+	if (stale) {
+		for (i=0; i<NUM_CMDS; i++) {
+			if (cmdList[i].regAddr < BURST_RO_NS_START) {
+				readMask[i] = mask[i];
+			} else if (cmdList[i].regAddr < BURST_RW_START) {
+				readMask[i] = mask[i] || (needRo && (dev->burstModeSeen >= BURST_RO));
+			} else {
+				readMask[i] = mask[i] || (needRw && (dev->burstModeSeen == BURST_ALL));
+			}
+		}
+		counters.cacheMisses++;
+		return false;
+	}
+
+	counters.cacheHits++;
+	if (age != NULL) {
+		*age = 0;
+	}
+	for (i=0; i<NUM_CMDS; i++) {
+		if (mask[i]) {
+			vals[i] = dev->cache[i].val;
+			a = (int) (now - dev->cache[i].msec);
+			if ((age != NULL) && (a > *age)) {
+				*age = a;
+			}
+		}
+	}
+	return true;
+}
+
+
+// Return the cached values of the listed registers regardless of their age and true
+// if every one has been read.  Used to answer from the cache when the charger can't be
+// read.  age is set to the age of the oldest value.
+bool CacheLookupStale(chgDev_t* dev, int* regList, int n, int* vals, int* age)
+{
+	uint64_t now;
+	int i, a;
+
+	now = GetMsec();
+	*age = 0;
+	for (i=0; i<n; i++) {
+		if (!dev->cache[regList[i]].valid) {
+			return false;
+		}
+		vals[regList[i]] = dev->cache[regList[i]].val;
+		a = (int) (now - dev->cache[regList[i]].msec);
+		if (a > *age) {
+			*age = a;
+		}
+	}
+	return true;
+}
+
+
+bool ShmOpen()
+{
+	int fd, i;
+
+	if ((fd = shm_open(MPPT_SHM_NAME, O_CREAT | O_RDWR, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH)) == -1) {
+		syslog(LOG_ERR, "Could not create shared memory %s: %m", MPPT_SHM_NAME);
+		return false;
+	}
+	if (ftruncate(fd, sizeof(mpptShm_t)) == -1) {
+		syslog(LOG_ERR, "Could not size shared memory %s: %m", MPPT_SHM_NAME);
+		close(fd);
+		return false;
+	}
+	shm = (mpptShm_t*) mmap(NULL, sizeof(mpptShm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		syslog(LOG_ERR, "Could not map shared memory %s: %m", MPPT_SHM_NAME);
+		shm = NULL;
+		return false;
+	}
+
+	memset(shm, 0, sizeof(mpptShm_t));
+	shm->version = MPPT_SHM_VERSION;
+	shm->numRegs = NUM_CMDS;
+	shm->pid = getpid();
+	for (i=0; i<NUM_CMDS; i++) {
+		strncpy(shm->names[i], cmdList[i].cName, MPPT_SHM_NAME_LEN - 1);
+	}
+
+	// Readers check the magic number so it is set once the header is complete
+	__atomic_store_n(&shm->magic, MPPT_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+
+void ShmClose()
+{
+	if (shm != NULL) {
+		munmap(shm, sizeof(mpptShm_t));
+		shm_unlink(MPPT_SHM_NAME);
+		shm = NULL;
+	}
+}
+
+
+// Copy the cache into the shared memory segment under the sequence lock
+void ShmPublish()
+{
+	struct timeval tv;
+	statsHist_t h;
+	uint64_t now, t;
+	uint32_t seq;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	t = ((uint64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	now = GetMsec();
+
+	seq = shm->seq;
+	__atomic_store_n(&shm->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	shm->sample.validMask = 0;
+	for (i=0; i<NUM_CMDS; i++) {
+		if (devs[0].cache[i].valid) {
+			shm->sample.validMask |= (1 << i);
+			shm->sample.val[i] = devs[0].cache[i].val;
+			shm->sample.valTimeMs[i] = t - (now - devs[0].cache[i].msec);
+		}
+	}
+	shm->sample.sampleCount++;
+	shm->sample.timeMs = t;
+
+	StatsHistCopy(&h, &counters.loopTime);
+	shm->stats.loopP99Us = StatsHistPercentile(&h, 990);
+	StatsHistCopy(&h, &counters.i2cTime);
+	shm->stats.i2cP99Us = StatsHistPercentile(&h, 990);
+	shm->stats.uptimeSec = tv.tv_sec - startTime;
+	shm->stats.i2cTransactions = __atomic_load_n(&counters.i2cTransactions, __ATOMIC_RELAXED);
+	shm->stats.i2cErrors = __atomic_load_n(&counters.i2cErrors, __ATOMIC_RELAXED);
+	shm->stats.i2cRetries = __atomic_load_n(&counters.i2cRetries, __ATOMIC_RELAXED);
+	shm->stats.cacheHits = counters.cacheHits;
+	shm->stats.cacheMisses = counters.cacheMisses;
+	shm->stats.connections = counters.connections;
+	shm->stats.commands = counters.commands;
+	shm->stats.bytesIn = counters.bytesIn;
+	shm->stats.bytesOut = counters.bytesOut;
+
+	__atomic_store_n(&shm->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+
+// Update a charger's cache with the values read into a snapshot.  The shared memory
+// segment holds the primary charger's values.
+void CacheApplySnapshot(chgDev_t* dev, snapshot_t* snap)
+{
+	int i;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		if (snap->valid[i]) {
+			CacheUpdate(dev, i, snap->val[i], snap->msec);
+		}
+	}
+
+	if (snap->valid[statusIndex] && (snap->val[statusIndex] != STATUS_GLITCH_VAL)) {
+		if (snap->val[statusIndex] & STATUS_SWD_DET_MASK) {
+			dev->swdDetSeen++;
+		}
+		if (snap->val[statusIndex] & STATUS_PWD_TRIG_MASK) {
+			dev->pwdTrigSeen++;
+		}
+	}
+
+	if ((shm != NULL) && (dev == &devs[0])) {
+		ShmPublish();
+	}
+}
+
+
+// Assumes we never write a negative number
+bool WriteCharger(char* regS, int val)
+{
+	unsigned char buf[2];
+	int cmdIndex;
+	int retVal;
+
+	// Figure out what we're writing
+	if ((cmdIndex = FindCmdIndex(regS)) == -1) {
+		syslog(LOG_ERR, "No I2C device %s for write", regS);
+		return false;
+	}
+
+	// Do the write - data is sent high byte first
+	if (cmdList[cmdIndex].isWord) {
+		buf[0] = (val >> 8) & 0xFF;
+		buf[1] = val & 0xFF;
 	} else {
-		*alert = false;
+		buf[0] = val & 0xFF;
+	}
+	retVal = WriteChargerBlock(cmdList[cmdIndex].regAddr, cmdList[cmdIndex].isWord ? 2 : 1, buf) ? 0 : -1;
+
+	// Whatever the result the charger's value isn't known until it is read
+	i2cDev->shadow[cmdIndex].known = false;
+
+	if (retVal == -1) {
+		if (errno != ENOTCONN) {
+			syslog(LOG_ERR, "I2C write of %s (%d) failed: %m", regS, cmdList[cmdIndex].regAddr);
+		}
+		return false;
+	} else {
+		return true;
+	}
+}
+
+
+// Write a register of the current job's charger through its shadow
+bool ShadowWrite(int cmdIndex, int val)
+{
+	shadow_t* sh = &i2cDev->shadow[cmdIndex];
+	int v;
+
+	if (!sh->shadowed) {
+		return WriteCharger((char *) cmdList[cmdIndex].cName, val);
+	}
+
+	if (sh->known && ((sh->val == val) || (sh->reqKnown && (sh->req == val)))) {
+		__atomic_fetch_add(&counters.writesSkipped, 1, __ATOMIC_RELAXED);
+		return true;
+	}
+
+	if (!WriteCharger((char *) cmdList[cmdIndex].cName, val) ||
+	    !ReadCharger((char *) cmdList[cmdIndex].cName, &v)) {
+		sh->reqKnown = false;
 		return false;
 	}
+	sh->reqKnown = true;
+	sh->req = val;
+	if ((v != val) && (debug>0)) {
+		syslog(LOG_NOTICE, "Charger set %s to %d for %d", cmdList[cmdIndex].cName, v, val);
+	}
+	return true;
+}
+
+
+// Open a charger's interface and check its ID.  An additional charger whose interface
+// can't be opened or that is missing or misidentified doesn't stop the daemon - its link
+// starts down so it is retried like a charger that has stopped responding.
+bool ConnectCharger(chgDev_t* dev)
+{
+	chargerConfig_t* c = &config.chargers[dev->id];
+	chgBackendParams_t* p = &dev->params;
+	int s;
+
+	dev->burstMode = config.burstMode;
+	dev->burstModeSeen = config.burstMode;
+
+	// Attempt to open the interface
+	p->type = (dev->id == 0) ? config.chgType : c->chgType;
+	p->i2cBus = (dev->id == 0) ? config.i2cBus : c->i2cBus;
+	p->i2cAddr = (dev->id == 0) ? config.i2cAddr : c->i2cAddr;
+	p->recordFile = ((dev->id == 0) && (config.chgRecordFile[0] != 0)) ? config.chgRecordFile : NULL;
+	p->replayFile = ((dev->id == 0) && (config.chgReplayFile[0] != 0)) ? config.chgReplayFile : NULL;
+	p->latencyUs = config.simLatencyUs;
+	p->busKhz = config.simBusKhz;
+	p->simSpeed = config.simSpeed;
+	p->simFailRate = config.simFailRate;
+	p->simOutageStart = config.simOutageStart;
+	p->simOutageSecs = config.simOutageSecs;
+	p->simResetSecs = config.simResetSecs;
+	if ((dev->backend = ChgBackendOpen(p)) == NULL) {
+		if (p->type == CHG_BACKEND_REPLAY) {
+			syslog(LOG_ERR, "Could not open charger recording %s: %m", config.chgReplayFile);
+		} else {
+			syslog(LOG_ERR, "Could not open I2C interface for charger %d: %m", dev->id);
+		}
+		if (dev->id == 0) {
+			return false;
+		}
+		i2cDev = dev;
+		errno = ENODEV;
+		ChargerLinkFailed();
+		return true;
+	}
+	if (p->type == CHG_BACKEND_SIM) {
+		syslog(LOG_NOTICE, "Using simulated charger %d", dev->id);
+	}
+
+	// Attempt to communicate with the charger by validating the board ID
+	i2cDev = dev;
+	if (ReadCharger("ID", &s)) {
+		if (ChargerIdValid(s)) {
+			syslog(LOG_NOTICE, "MPPT Solar Charger %d (bus %d address 0x%02X) FW %d.%d",
+				   dev->id, p->i2cBus, p->i2cAddr,
+				   (s & 0x00F0) >> 4,
+				   (s & 0x000F));
+			return true;
+		} else {
+			syslog(LOG_ERR, "Charger %d did not identify correctly", dev->id);
+		}
+	} else {
+		syslog(LOG_ERR, "Could not communicate with charger %d", dev->id);
+	}
+
+	if (dev->id == 0) {
+		return false;
+	}
+	errno = ENODEV;
+	ChargerLinkFailed();
+	return true;
+}
+
+
+// Compare the parameters with their shadows in one read, which also notices a charger
+// reset, then write the configured values that the charger doesn't hold.  PWRONV is
+// written before PWROFFV because the charger limits PWROFFV to PWRONV.  The parameter
+// values are left in snap.
+bool UpdateParms(snapshot_t* snap)
+{
+	const int order[NUM_PARAMS] = {PARAM_BULK_I, PARAM_FLOAT_I, PARAM_PWRON_I, PARAM_PWROFF_I};
+	int i, n, p;
+
+	// Find the first entry
+	n = FindCmdIndex("BULKV");
+
+	for (i=0; i<NUM_CMDS; i++) {
+		snap->valid[i] = false;
+	}
+	gettimeofday(&snap->t, NULL);
+	snap->msec = GetMsec();
+	if ((i2cDev->burstMode == BURST_NONE) || !ReadChargerBurst(cmdList[n].regAddr, 2 * NUM_PARAMS, snap)) {
+		for (i=0; i<NUM_PARAMS; i++) {
+			if (!ReadCharger((char *) cmdList[i+n].cName, &snap->val[i+n])) {
+				return false;
+			}
+			snap->valid[i+n] = true;
+		}
+	}
+
+	for (i=0; i<NUM_PARAMS; i++) {
+		p = order[i];
+		if (config.paramArray[p] != 0) {
+			if (!ShadowWrite(p+n, config.paramArray[p])) {
+				return false;
+			}
+			snap->val[p+n] = i2cDev->shadow[p+n].val;
+		}
+	}
+
+	return true;
+}
+
+
+// WDEN and WDPWROFF are written through their shadows so once the watchdog is running
+// this is just the WDCNT keepalive
+bool EnableWatchdog()
+{
+	if (!ShadowWrite(FindCmdIndex("WDEN"), WDEN_MAGIC_BYTE)) {
+		return false;
+	}
+
+	if (!WriteCharger("WDCNT", WD_INIT_SECS)) {
+		return false;
+	}
+
+	if (!ShadowWrite(FindCmdIndex("WDPWROFF"), WD_PWROFF_SECS)) {
+		return false;
+	}
+
+	i2cDev->wdRunning = true;
+	return true;
+}
+
+
+bool DisableWatchdog()
+{
+	i2cDev->wdRunning = false;
+
+	if (!WriteCharger("WDEN", 0)) {
+		return false;
+	}
+
+	if (!WriteCharger("WDCNT", 0)) {
+		return false;
+	}
+
+	return true;
+}
+
+
+bool CheckAlertStatus(bool* alert, int* status)
+{
+	int s;
+
+	if (ReadCharger("STATUS", &s)) {
+		*alert = ((s & STATUS_ALERT_MASK) == STATUS_ALERT_MASK);
+
+		// Handle a special case where we have on very infrequent occasion
+		// seen a response of 0xFFFF for the read.  This could cause us to shutdown
+		// the host without the charger cycling power which results in a hung system
+		// (host won't ever reboot).  So we check again just to be sure.
+		if (*alert) {
+			(void) ReadCharger("STATUS", &s);
+			if ((s & STATUS_ALERT_MASK) == 0) {
+				*alert = false;
+			}
+		}
+
+		*status = s;
+		return true;
+	} else {
+		*alert = false;
+		return false;
+	}
+}
+
+
+// Each text log file starts with a line listing the logged value names
+void LogFormatHeader(bool* mask, char* header)
+{
+	int i, n;
+
+	// Start with a keyword to indicate this is a list of names
+	n = sprintf(header, "LOGGING: ");
+
+	// Enabled value names
+	for (i=0; i<NUM_CMDS; i++) {
+		if (mask[i]) {
+			n += sprintf(&header[n], "%s ", cmdList[i].cName);
+		}
+	}
+	sprintf(&header[n], "\n");
+}
+
+
+// Format the time and enabled values as one text log line.  The time has mSec when the
+// log is written more than once per second.  Returns its length.
+int LogFormatLine(struct timeval* t, bool showMs, bool* mask, snapshot_t* snap, char* logS)
+{
+	int i, n;
+
+	if (showMs) {
+		n = sprintf(logS, "%ld.%03ld: ", (long) t->tv_sec, (long) (t->tv_usec / 1000));
+	} else {
+		n = sprintf(logS, "%ld: ", (long) t->tv_sec);
+	}
+	for (i=0; i<NUM_CMDS; i++) {
+		if (mask[i]) {
+			n += sprintf(&logS[n], "%d ", snap->val[i]);
+		}
+	}
+	logS[n++] = '\n';
+	return n;
+}
+
+
+// Open the text log
+bool LogOpenText()
+{
+	LogFormatHeader(config.logMask, logHeader);
+
+	if (!TextLogOpen(&textLog, config.logFileName, logHeader, &config.logParams)) {
+		syslog(LOG_ERR, "Open of log file %s failed: %m", config.logFileName);
+		return false;
+	}
+	return true;
+}
+
+
+// Open the binary log with a column for each enabled value
+bool LogOpenBinary()
+{
+	const char* names[NUM_CMDS];
+	uint32_t signedMask = 0;
+	int i, n = 0;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		if (config.logMask[i]) {
+			if (cmdList[i].isSigned) {
+				signedMask |= (1 << n);
+			}
+			names[n++] = cmdList[i].cName;
+		}
+	}
+
+	if (!BinLogOpen(&binLog, config.logFileName, n, names, signedMask,
+	                (config.logDelayMs < 1000) ? BINLOG_FLAG_MSEC : 0, config.logRecords, config.logSync)) {
+		syslog(LOG_ERR, "Open of binary log file %s failed: %m", config.logFileName);
+		return false;
+	}
+	return true;
+}
+
+
+// In deadband mode an entry is only logged when a value has moved more than its deadband
+// (registers without one log any change) from the last logged entry or LOG_MAX_INTERVAL
+// seconds have passed.  Each new text log file (rotated or reopened) starts with an entry.
+bool LogChanged(snapshot_t* snap)
+{
+	bool changed;
+	int i;
+
+	if (!config.enLogDeadband) {
+		return true;
+	}
+
+	if ((config.logFormat == LOGFMT_TEXT) && (textLog.files != logLastFiles)) {
+		logHaveLast = false;
+	}
+	changed = !logHaveLast ||
+	          ((config.logMaxInterval > 0) && ((snap->msec - logLastMsec) >= ((uint64_t) config.logMaxInterval * 1000)));
+	for (i=0; i<NUM_CMDS; i++) {
+		if (config.logMask[i] && (abs(snap->val[i] - logLastVals[i]) > config.logDeadband[i])) {
+			changed = true;
+		}
+	}
+
+	if (changed) {
+		logHaveLast = true;
+		logLastFiles = textLog.files;
+		logLastMsec = snap->msec;
+		memcpy(logLastVals, snap->val, sizeof(logLastVals));
+	}
+
+	return changed;
+}
+
+
+void LogWriteValues(struct timeval *t, snapshot_t* snap)
+{
+	int vals[NUM_CMDS];
+	char logS[MAX_STRING_LEN];
+	int i, n;
+
+	if (config.logFormat == LOGFMT_BINARY) {
+		n = 0;
+		for (i=0; i<NUM_CMDS; i++) {
+			if (config.logMask[i]) {
+				vals[n++] = snap->val[i];
+			}
+		}
+		if (!BinLogAppend(&binLog, ((uint64_t) t->tv_sec * 1000) + (t->tv_usec / 1000), vals)) {
+			syslog(LOG_ERR, "Sync of binary log file failed: %m");
+		}
+		return;
+	}
+
+	n = LogFormatLine(t, config.logDelayMs < 1000, config.logMask, snap, logS);
+	if (!TextLogAppend(&textLog, logS, n)) {
+		syslog(LOG_ERR, "Write to log file failed: %m");
+	}
+}
+
+
+// Open an additional charger's text log.  It uses the global LOG_* file parameters.
+bool LogOpenCharger(chgDev_t* dev)
+{
+	chargerConfig_t* c = &config.chargers[dev->id];
+
+	LogFormatHeader(c->pollMask, dev->logHeader);
+	if (!TextLogOpen(&dev->log, c->logFileName, dev->logHeader, &config.logParams)) {
+		syslog(LOG_ERR, "Open of charger %d log file %s failed: %m", dev->id, c->logFileName);
+		return false;
+	}
+	dev->logOpen = true;
+	return true;
+}
+
+
+// Set up an additional charger.  Every register is polled if its section has no LOG
+// items.
+bool OpenCharger(chgDev_t* dev)
+{
+	chargerConfig_t* c = &config.chargers[dev->id];
+	bool any = false;
+	int i;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		any = any || c->pollMask[i];
+	}
+	if (!any) {
+		for (i=0; i<NUM_CMDS; i++) {
+			c->pollMask[i] = true;
+		}
+	}
+
+	if (!ConnectCharger(dev)) {
+		return false;
+	}
+	if ((c->logFileName[0] != 0) && !LogOpenCharger(dev)) {
+		return false;
+	}
+	dev->enabled = true;
+	return true;
+}
+
+
+// Call a text log function for the text log of every charger that has one.  Returns
+// false if any call failed.
+bool LogForEachText(bool (*fn)(textLog_t* log), const char* what)
+{
+	bool success = true;
+	int i;
+
+	if (config.enLogging && (config.logFormat == LOGFMT_TEXT) && !fn(&textLog)) {
+		syslog(LOG_ERR, "%s of log file %s failed: %m", what, config.logFileName);
+		success = false;
+	}
+	for (i=1; i<MAX_CHARGERS; i++) {
+		if (devs[i].logOpen && !fn(&devs[i].log)) {
+			syslog(LOG_ERR, "%s of charger %d log file %s failed: %m", what, i, config.chargers[i].logFileName);
+			success = false;
+		}
+	}
+	return success;
+}
+
+
+bool WatchFd(conn_t* conn);
+
+
+//
+// I2C worker
+//
+
+// Job work functions - these run on the worker thread
+bool I2cReadWork(i2cJob_t* job)
+{
+	return ReadChargerSnapshot(job->mask, &job->snap);
+}
+
+
+bool I2cWriteWork(i2cJob_t* job)
+{
+	return ShadowWrite(job->cmdIndex, job->val);
+}
+
+
+bool I2cAlertWork(i2cJob_t* job)
+{
+	bool alert;
+	int i;
+
+	i = FindCmdIndex("STATUS");
+	job->snap.msec = GetMsec();
+	if (!CheckAlertStatus(&alert, &job->snap.val[i])) {
+		return false;
+	}
+	job->snap.valid[i] = true;
+	job->val = alert;
+	return true;
+}
+
+
+bool I2cParamsWork(i2cJob_t* job)
+{
+	return UpdateParms(&job->snap);
+}
+
+
+// The watchdog running bit in STATUS shows if the charger has reset since the last
+// refresh.  The Alert check reads STATUS frequently so it is only read here when that
+// isn't running (it only runs on edges when the ALERT_N line is monitored).
+bool I2cWatchdogWork(i2cJob_t* job)
+{
+	int i;
+
+	if (!config.enAutoShutdown || (config.gpioAlert >= 0)) {
+		i = FindCmdIndex("STATUS");
+		job->snap.msec = GetMsec();
+		if (!ReadCharger("STATUS", &job->snap.val[i])) {
+			return false;
+		}
+		job->snap.valid[i] = true;
+	}
+	return EnableWatchdog();
+}
+
+
+void* I2cWorker(void* arg)
+{
+	i2cJob_t* job;
+	uint64_t one = 1;
+	uint64_t t;
+	int i;
+
+	pthread_mutex_lock(&i2cLock);
+	while (!i2cQuit) {
+		// Take the oldest job with the highest priority
+		job = NULL;
+		for (i=0; i<I2C_NUM_PRIO; i++) {
+			if ((job = i2cQueue[i]) != NULL) {
+				if ((i2cQueue[i] = job->next) == NULL) {
+					i2cQueueTailP[i] = &i2cQueue[i];
+				}
+				break;
+			}
+		}
+		if (job == NULL) {
+			pthread_cond_wait(&i2cCond, &i2cLock);
+			continue;
+		}
+		pthread_mutex_unlock(&i2cLock);
+
+		t = StatsUsec();
+		i2cDev = job->dev;
+		job->success = job->work(job);
+		job->burstMode = i2cDev->burstMode;
+		StatsHistSince(&counters.i2cJobTime[(job->task == I2C_TASK_NONE) ? I2C_NUM_TASKS : job->task], t);
+		__atomic_fetch_add(&counters.i2cBusyUs, StatsUsec() - t, __ATOMIC_RELAXED);
+
+		// Hand the job back to the event loop
+		pthread_mutex_lock(&i2cLock);
+		job->next = NULL;
+		*i2cDoneTailP = job;
+		i2cDoneTailP = &job->next;
+		if (write(i2cConn.fd, &one, sizeof(one)) != sizeof(one)) {
+			syslog(LOG_ERR, "I2C worker eventfd write failed: %m");
+		}
+	}
+	pthread_mutex_unlock(&i2cLock);
+
+	return NULL;
+}
+
+
+bool StartI2cWorker()
+{
+	int i;
+
+	for (i=0; i<I2C_NUM_PRIO; i++) {
+		i2cQueue[i] = NULL;
+		i2cQueueTailP[i] = &i2cQueue[i];
+	}
+	for (i=0; i<I2C_NUM_TASKS; i++) {
+		i2cTaskBusy[i] = false;
+	}
+
+	i2cConn.type = CONN_I2C;
+	if (((i2cConn.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) || !WatchFd(&i2cConn)) {
+		syslog(LOG_ERR, "Could not create I2C worker eventfd: %m");
+		return false;
+	}
+
+	if ((errno = pthread_create(&i2cThread, NULL, I2cWorker, NULL)) != 0) {
+		syslog(LOG_ERR, "Could not start I2C worker: %m");
+		return false;
+	}
+	i2cRunning = true;
+
+	return true;
+}
+
+
+// Stop the worker once it has finished any job it is running.  Jobs still queued are
+// abandoned.  The bus may be accessed directly after this.
+void StopI2cWorker()
+{
+	if (!i2cRunning) {
+		return;
+	}
+
+	pthread_mutex_lock(&i2cLock);
+	i2cQuit = true;
+	pthread_cond_signal(&i2cCond);
+	pthread_mutex_unlock(&i2cLock);
+	pthread_join(i2cThread, NULL);
+	i2cRunning = false;
+}
+
+
+// Allocate a job for the primary charger.  Returns NULL if the previous job for a
+// periodic task is still outstanding (for example while the bus is hung) so they don't
+// pile up.
+i2cJob_t* NewI2cJob(int prio, int task, bool (*work)(i2cJob_t*), void (*done)(i2cJob_t*))
+{
+	i2cJob_t* job;
+
+	if ((task != I2C_TASK_NONE) && i2cTaskBusy[task]) {
+		if (debug>0) {
+			syslog(LOG_NOTICE, "I2C task %d still outstanding, skipped", task);
+		}
+		return NULL;
+	}
+
+	if ((job = (i2cJob_t*) calloc(1, sizeof(i2cJob_t))) == NULL) {
+		syslog(LOG_ERR, "Could not allocate I2C job");
+		return NULL;
+	}
+	job->dev = &devs[0];
+	job->prio = prio;
+	job->task = task;
+	job->work = work;
+	job->done = done;
+
+	return job;
+}
+
+
+void SubmitI2cJob(i2cJob_t* job)
+{
+	if (job->task != I2C_TASK_NONE) {
+		i2cTaskBusy[job->task] = true;
+	}
+
+	pthread_mutex_lock(&i2cLock);
+	job->next = NULL;
+	*i2cQueueTailP[job->prio] = job;
+	i2cQueueTailP[job->prio] = &job->next;
+	pthread_cond_signal(&i2cCond);
+	pthread_mutex_unlock(&i2cLock);
+}
+
+
+// Submit a job for a periodic task that needs no setup
+void SubmitI2cTask(int prio, int task, bool (*work)(i2cJob_t*), void (*done)(i2cJob_t*))
+{
+	i2cJob_t* job;
+
+	if ((job = NewI2cJob(prio, task, work, done)) != NULL) {
+		SubmitI2cJob(job);
+	}
+}
+
+
+// Run the done function for every job the worker has finished
+void ServiceI2cDone()
+{
+	i2cJob_t* job;
+	i2cJob_t* next;
+
+	pthread_mutex_lock(&i2cLock);
+	job = i2cDone;
+	i2cDone = NULL;
+	i2cDoneTailP = &i2cDone;
+	pthread_mutex_unlock(&i2cLock);
+
+	while (job != NULL) {
+		next = job->next;
+
+		// The worker disables burst reads if the adapter doesn't support them
+		job->dev->burstModeSeen = job->burstMode;
+		if (job->task != I2C_TASK_NONE) {
+			i2cTaskBusy[job->task] = false;
+		}
+		job->done(job);
+		free(job);
+
+		job = next;
+	}
+}
+
+
+void CloseConnection(conn_t* conn);
+void ServiceInput(conn_t* conn);
+
+
+// Update the epoll events for a connection: wait for output space while there is
+// buffered output and stop reading commands while the output buffer is above half full,
+// there are unprocessed commands or a command is waiting on the I2C worker
+void SetConnEvents(conn_t* conn)
+{
+	struct epoll_event ev;
+	uint32_t events = 0;
+
+	if ((conn->outLen < (conn->outSize / 2)) && !conn->pending && !conn->waitI2c) {
+		events |= EPOLLIN;
+	}
+	if (conn->outLen > 0) {
+		events |= EPOLLOUT;
+	}
+
+	if (events != conn->events) {
+		ev.events = events;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev) == -1) {
+			syslog(LOG_ERR, "epoll_ctl mod of fd %d failed: %m", conn->fd);
+		} else {
+			conn->events = events;
+		}
+	}
+}
+
+
+// Copy len bytes starting at offset from the head of a connection's output buffer
+void ConnPeek(conn_t* conn, int offset, void* data, int len)
+{
+	int i, n;
+
+	i = (conn->outHead + offset) % conn->outSize;
+	n = conn->outSize - i;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(data, &conn->outBuf[i], n);
+	memcpy((char*) data + n, &conn->outBuf[0], len - n);
+}
+
+
+// Write as much buffered output as the connection will accept without blocking.  Unix
+// socket output is a sequence of messages, each preceded by its length, and each is
+// sent with one write.
+void FlushConnection(conn_t* conn)
+{
+	struct iovec iov[2];
+	uint32_t msgLen;
+	int iovcnt, n, head, len, skip;
+
+	while (conn->outLen > 0) {
+		head = conn->outHead;
+		len = conn->outLen;
+		skip = 0;
+		if (conn->type == CONN_UNIX) {
+			ConnPeek(conn, 0, &msgLen, sizeof(msgLen));
+			skip = sizeof(msgLen);
+			head = (head + skip) % conn->outSize;
+			len = msgLen;
+		}
+
+		iov[0].iov_base = &conn->outBuf[head];
+		if ((head + len) > conn->outSize) {
+			iov[0].iov_len = conn->outSize - head;
+			iov[1].iov_base = &conn->outBuf[0];
+			iov[1].iov_len = len - iov[0].iov_len;
+			iovcnt = 2;
+		} else {
+			iov[0].iov_len = len;
+			iovcnt = 1;
+		}
+
+		n = writev(conn->fd, iov, iovcnt);
+		if (n == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				if (debug>0) {
+					syslog(LOG_NOTICE, "Write to fd %d failed: %m", conn->fd);
+				}
+				if (conn->type == CONN_PTY) {
+					// Discard - the pty is recreated when the read side sees the close
+					conn->outLen = 0;
+					conn->outHead = 0;
+				} else {
+					CloseConnection(conn);
+					return;
+				}
+			}
+			break;
+		}
+
+		conn->outHead = (conn->outHead + skip + n) % conn->outSize;
+		conn->outLen -= skip + n;
+		conn->bytesOut += n;
+		counters.bytesOut += n;
+	}
+	if (conn->outLen == 0) {
+		conn->outHead = 0;
+		if (conn->closeWhenSent) {
+			CloseConnection(conn);
+			return;
+		}
+	}
+
+	SetConnEvents(conn);
+}
+
+
+// Queue output for a connection.  If it does not fit then the data is dropped or
+// the connection closed depending on OUTBUF_POLICY (the pty is never closed).
+void ConnPush(conn_t* conn, const char* data, int len)
+{
+	uint32_t msgLen = len;
+	int i, n, skip;
+
+	if (conn->fd == -1) {
+		return;
+	}
+
+	skip = (conn->type == CONN_UNIX) ? sizeof(msgLen) : 0;
+	if ((conn->outLen + skip + len) > conn->outSize) {
+		if ((config.outBufPolicy == OUTBUF_CLOSE) && (conn->type != CONN_PTY)) {
+			syslog(LOG_NOTICE, "Closing connection on fd %d, output buffer full", conn->fd);
+			CloseConnection(conn);
+		} else {
+			if (conn->outDropped++ == 0) {
+				syslog(LOG_NOTICE, "Dropping output on fd %d, output buffer full", conn->fd);
+			}
+		}
+		return;
+	}
+
+	if (debug > 2) syslog(LOG_INFO, "fd %d sent %.*s", conn->fd, len, data);
+
+	if (skip != 0) {
+		// Message length
+		i = (conn->outHead + conn->outLen) % conn->outSize;
+		n = conn->outSize - i;
+		if (n > skip) {
+			n = skip;
+		}
+		memcpy(&conn->outBuf[i], &msgLen, n);
+		memcpy(&conn->outBuf[0], (char*) &msgLen + n, skip - n);
+		conn->outLen += skip;
+	}
+
+	i = (conn->outHead + conn->outLen) % conn->outSize;
+	n = conn->outSize - i;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(&conn->outBuf[i], data, n);
+	memcpy(&conn->outBuf[0], data + n, len - n);
+	conn->outLen += len;
+}
+
+
+// Answer a failed request on a Unix socket connection so its client isn't left waiting
+// for a response message.  The pty and TCP interfaces have never answered failed
+// commands.
+void ConnError(conn_t* conn, const char* err)
+{
+	char rspBuf[64];
+
+	if (conn->type == CONN_UNIX) {
+		sprintf(rspBuf, (conn->format == FMT_JSON) ? "{\"ERR\":\"%s\"}\n\r" : "ERR=%s\n\r", err);
+		ConnPush(conn, rspBuf, strlen(rspBuf));
+	}
+}
+
+
+// Parse a comma separated list of register names into cmdList indices (duplicates are
+// ignored).  Returns the number of registers or 0 if any name is unknown.
+int ParseRegList(const char* value, int* regList)
+{
+	char regS[16];
+	bool seen[NUM_CMDS];
+	int i, n, len, cmdIndex;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		seen[i] = false;
+	}
+
+	n = 0;
+	while (*value != 0) {
+		len = 0;
+		while ((*value != 0) && (*value != ',')) {
+			if ((*value != ' ') && (len < (int) sizeof(regS) - 1)) {
+				regS[len++] = *value;
+			}
+			value++;
+		}
+		regS[len] = 0;
+		if (*value == ',') {
+			value++;
+		}
+
+		if ((cmdIndex = FindCmdIndex(regS)) == -1) {
+			return 0;
+		}
+		if (!seen[cmdIndex]) {
+			seen[cmdIndex] = true;
+			regList[n++] = cmdIndex;
+		}
+	}
+
+	return n;
+}
+
+
+// Format a response line containing the listed registers in the connection's format.
+// age is only included if enabled for the connection (or the values are stale) and
+// age >= 0.  Stale values are cached values returned because the charger could not be
+// read.  Subscription samples are prefixed with the subscription id and timestamp
+// (subId > 0).  Values from an additional charger are prefixed with its number.
+void FormatValues(conn_t* conn, int chgId, int* regList, int n, int* vals, int age, bool stale, int subId, uint64_t t, char* buf)
+{
+	int i;
+
+	if (conn->format == FMT_JSON) {
+		buf += sprintf(buf, "{");
+		if (chgId > 0) {
+			buf += sprintf(buf, "\"CHARGER\":%d,", chgId);
+		}
+		if (subId > 0) {
+			buf += sprintf(buf, "\"SUB\":%d,\"T\":%llu,", subId, (unsigned long long) t);
+		}
+		for (i=0; i<n; i++) {
+			buf += sprintf(buf, "%s\"%s\":%d", (i == 0) ? "" : ",", cmdList[regList[i]].cName, vals[regList[i]]);
+		}
+		if ((conn->showAge || stale) && (age >= 0)) {
+			buf += sprintf(buf, ",\"AGE\":%d", age);
+		}
+		if (stale) {
+			buf += sprintf(buf, ",\"STALE\":true");
+		}
+		sprintf(buf, "}\n\r");
+	} else {
+		if (chgId > 0) {
+			buf += sprintf(buf, "CHARGER=%d,", chgId);
+		}
+		if (subId > 0) {
+			buf += sprintf(buf, "SUB=%d,T=%llu,", subId, (unsigned long long) t);
+		}
+		for (i=0; i<n; i++) {
+			buf += sprintf(buf, "%s%s=%d", (i == 0) ? "" : ",", cmdList[regList[i]].cName, vals[regList[i]]);
+		}
+		if ((conn->showAge || stale) && (age >= 0)) {
+			buf += sprintf(buf, " AGE=%d", age);
+		}
+		if (stale) {
+			buf += sprintf(buf, " STALE=1");
+		}
+		sprintf(buf, "\n\r");
+	}
+}
+
+
+// Arm the sampler timer for the earliest due subscription or watch (or disarm it)
+void ScheduleSampler()
+{
+	struct itimerspec ts;
+	uint64_t due = 0;
+	watch_t* watch;
+	sub_t* sub;
+
+	for (sub = subList; sub != NULL; sub = sub->next) {
+		if ((sub->conn->fd != -1) && ((due == 0) || (sub->nextDue < due))) {
+			due = sub->nextDue;
+		}
+	}
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if ((watch->conn->fd != -1) && ((due == 0) || (watch->nextDue < due))) {
+			due = watch->nextDue;
+		}
+	}
+
+	ts.it_interval.tv_sec = 0;
+	ts.it_interval.tv_nsec = 0;
+	ts.it_value.tv_sec = due / 1000;
+	ts.it_value.tv_nsec = (due % 1000) * 1000000;
+	if (timerfd_settime(samplerConn.fd, TFD_TIMER_ABSTIME, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "Could not set sampler timer: %m");
+	}
+}
+
+
+int AddSubscription(conn_t* conn, int* regList, int n, int periodMs)
+{
+	sub_t* sub;
+	int i;
+
+	if ((sub = (sub_t*) malloc(sizeof(sub_t))) == NULL) {
+		syslog(LOG_ERR, "Could not allocate subscription");
+		return 0;
+	}
+	sub->conn = conn;
+	sub->id = nextSubId++;
+	sub->n = n;
+	for (i=0; i<n; i++) {
+		sub->regList[i] = regList[i];
+	}
+	sub->periodMs = (periodMs < SUB_MIN_PERIOD_MS) ? SUB_MIN_PERIOD_MS : periodMs;
+	sub->nextDue = GetMsec();
+	sub->next = subList;
+	subList = sub;
+
+	ScheduleSampler();
+	return sub->id;
+}
+
+
+int CountSubscriptions(conn_t* conn)
+{
+	sub_t* sub;
+	int n = 0;
+
+	for (sub = subList; sub != NULL; sub = sub->next) {
+		if (sub->conn == conn) {
+			n++;
+		}
+	}
+	return n;
+}
+
+
+// Remove a connection's subscription with the given id or all its subscriptions (id = 0).
+// Returns the number removed.
+int RemoveSubscriptions(conn_t* conn, int id)
+{
+	sub_t** subP = &subList;
+	sub_t* sub;
+	int n = 0;
+
+	while ((sub = *subP) != NULL) {
+		if ((sub->conn == conn) && ((id == 0) || (sub->id == id))) {
+			*subP = sub->next;
+			free(sub);
+			n++;
+		} else {
+			subP = &sub->next;
+		}
+	}
+
+	if (n != 0) {
+		ScheduleSampler();
+	}
+	return n;
+}
+
+
+// Parse a watch of the form <REG><op><value>[,<hysteresis>][@<period mSec>] where op
+// is '<' or '>' for a threshold or '&' for a bit mask.  Returns the new watch id or 0.
+int AddWatch(conn_t* conn, const char* value)
+{
+	char regS[16];
+	watch_t* watch;
+	char* cp;
+	int i, cmdIndex, type;
+
+	for (i=0; (value[i] != '<') && (value[i] != '>') && (value[i] != '&'); i++) {
+		if ((value[i] == 0) || (i == (int) sizeof(regS) - 1)) {
+			return 0;
+		}
+		regS[i] = value[i];
+	}
+	regS[i] = 0;
+	if ((cmdIndex = FindCmdIndex(regS)) == -1) {
+		return 0;
+	}
+	type = (value[i] == '<') ? WATCH_BELOW : ((value[i] == '>') ? WATCH_ABOVE : WATCH_BITS);
+
+	if ((watch = (watch_t*) malloc(sizeof(watch_t))) == NULL) {
+		syslog(LOG_ERR, "Could not allocate watch");
+		return 0;
+	}
+	watch->conn = conn;
+	watch->cmdIndex = cmdIndex;
+	watch->type = type;
+	watch->threshold = 0;
+	watch->hysteresis = 0;
+	watch->mask = 0;
+	watch->periodMs = WATCH_DEF_PERIOD_MS;
+	watch->known = false;
+	watch->state = 0;
+
+	i = (int) strtol(&value[i+1], &cp, 0);
+	if (type == WATCH_BITS) {
+		watch->mask = i;
+	} else {
+		watch->threshold = i;
+		if (*cp == ',') {
+			watch->hysteresis = abs((int) strtol(cp + 1, &cp, 0));
+		}
+	}
+	if (*cp == '@') {
+		watch->periodMs = atoi(cp + 1);
+		if (watch->periodMs < SUB_MIN_PERIOD_MS) {
+			watch->periodMs = SUB_MIN_PERIOD_MS;
+		}
+	}
+
+	watch->id = nextSubId++;
+	watch->nextDue = GetMsec();
+	watch->next = watchList;
+	watchList = watch;
+
+	ScheduleSampler();
+	return watch->id;
+}
+
+
+int CountWatches(conn_t* conn)
+{
+	watch_t* watch;
+	int n = 0;
+
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if (watch->conn == conn) {
+			n++;
+		}
+	}
+	return n;
+}
+
+
+// Remove a connection's watch with the given id or all its watches (id = 0).  Returns
+// the number removed.
+int RemoveWatches(conn_t* conn, int id)
+{
+	watch_t** watchP = &watchList;
+	watch_t* watch;
+	int n = 0;
+
+	while ((watch = *watchP) != NULL) {
+		if ((watch->conn == conn) && ((id == 0) || (watch->id == id))) {
+			*watchP = watch->next;
+			free(watch);
+			n++;
+		} else {
+			watchP = &watch->next;
+		}
+	}
+
+	if (n != 0) {
+		ScheduleSampler();
+	}
+	return n;
+}
+
+
+// Evaluate all watches on registers in mask and send an event for each watch whose
+// predicate changed state.  The first evaluation of a watch reports its initial state.
+void EvaluateWatches(bool* mask, int* vals)
+{
+	char rspBuf[MAX_STRING_LEN];
+	struct timeval tv;
+	unsigned long long t;
+	watch_t* watch;
+	int v, newState;
+
+	gettimeofday(&tv, NULL);
+	t = ((unsigned long long) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if ((watch->conn->fd == -1) || !mask[watch->cmdIndex]) {
+			continue;
+		}
+		v = vals[watch->cmdIndex];
+
+		// Ignore the occasional corrupt STATUS read (see CheckAlertStatus)
+		if ((strcmp(cmdList[watch->cmdIndex].cName, "STATUS") == 0) && (v == STATUS_GLITCH_VAL)) {
+			continue;
+		}
+
+		switch (watch->type) {
+		case WATCH_BELOW:
+			if (watch->known && watch->state) {
+				newState = (v < (watch->threshold + watch->hysteresis));
+			} else {
+				newState = (v < watch->threshold);
+			}
+			break;
+		case WATCH_ABOVE:
+			if (watch->known && watch->state) {
+				newState = (v > (watch->threshold - watch->hysteresis));
+			} else {
+				newState = (v > watch->threshold);
+			}
+			break;
+		default:
+			newState = v & watch->mask;
+			break;
+		}
+
+		if (!watch->known || (newState != watch->state)) {
+			watch->known = true;
+			watch->state = newState;
+			if (watch->conn->format == FMT_JSON) {
+				sprintf(rspBuf, "{\"EVENT\":%d,\"T\":%llu,\"%s\":%d,\"STATE\":%d}\n\r",
+						watch->id, t, cmdList[watch->cmdIndex].cName, v, newState);
+			} else {
+				sprintf(rspBuf, "EVENT=%d,T=%llu,%s=%d,STATE=%d\n\r",
+						watch->id, t, cmdList[watch->cmdIndex].cName, v, newState);
+			}
+			ConnPush(watch->conn, rspBuf, strlen(rspBuf));
+			if (watch->conn->fd != -1) {
+				FlushConnection(watch->conn);
+			}
+		}
+	}
+}
+
+
+// Push the sampled values to each due subscriber, evaluate the watches and advance
+// the schedule
+void FinishSample(uint64_t now, bool* mask, int* vals, int age, bool success)
+{
+	char rspBuf[MAX_STRING_LEN];
+	int staleVals[NUM_CMDS];
+	struct timeval tv;
+	uint64_t t;
+	watch_t* watch;
+	sub_t* sub;
+
+	gettimeofday(&tv, NULL);
+	t = ((uint64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	if (success) {
+		for (sub = subList; sub != NULL; sub = sub->next) {
+			if (sub->nextDue <= now) {
+				FormatValues(sub->conn, 0, sub->regList, sub->n, vals, age, false, sub->id, t, rspBuf);
+				ConnPush(sub->conn, rspBuf, strlen(rspBuf));
+			}
+		}
+		EvaluateWatches(mask, vals);
+	} else {
+		if (!devs[0].degraded) {
+			syslog(LOG_ERR, "Subscription sample failed");
+		}
+
+		// Keep subscribers informed with the cached values marked as stale
+		for (sub = subList; sub != NULL; sub = sub->next) {
+			if ((sub->nextDue <= now) && CacheLookupStale(&devs[0], sub->regList, sub->n, staleVals, &age)) {
+				FormatValues(sub->conn, 0, sub->regList, sub->n, staleVals, age, true, sub->id, t, rspBuf);
+				ConnPush(sub->conn, rspBuf, strlen(rspBuf));
+			}
+		}
+	}
+
+	// Keep a fixed schedule unless we have fallen more than a period behind
+	for (sub = subList; sub != NULL; sub = sub->next) {
+		if (sub->nextDue <= now) {
+			sub->nextDue += sub->periodMs;
+			if (sub->nextDue <= now) {
+				sub->nextDue = now + sub->periodMs;
+			}
+			if (sub->conn->fd != -1) {
+				FlushConnection(sub->conn);
+			}
+		}
+	}
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if (watch->nextDue <= now) {
+			watch->nextDue += watch->periodMs;
+			if (watch->nextDue <= now) {
+				watch->nextDue = now + watch->periodMs;
+			}
+		}
+	}
+
+	ScheduleSampler();
+}
+
+
+void SamplerReadDone(i2cJob_t* job)
+{
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+	}
+	FinishSample(job->msec, job->mask, job->snap.val, (int) (GetMsec() - job->snap.msec), job->success);
+}
+
+
+// Sample the registers of all due subscriptions and watches with one coherent read
+// from the cache or the charger
+void ServiceSampler()
+{
+	bool mask[NUM_CMDS];
+	bool readMask[NUM_CMDS];
+	int vals[NUM_CMDS];
+	uint64_t now;
+	bool due = false;
+	i2cJob_t* job;
+	watch_t* watch;
+	sub_t* sub;
+	int i, age;
+
+	if (i2cTaskBusy[I2C_TASK_SAMPLER]) {
+		// Rescheduled when the outstanding sample is done
+		return;
+	}
+
+	now = GetMsec();
+	for (i=0; i<NUM_CMDS; i++) {
+		mask[i] = false;
+	}
+	for (sub = subList; sub != NULL; sub = sub->next) {
+		if ((sub->conn->fd != -1) && (sub->nextDue <= now)) {
+			due = true;
+			for (i=0; i<sub->n; i++) {
+				mask[sub->regList[i]] = true;
+			}
+		}
+	}
+	for (watch = watchList; watch != NULL; watch = watch->next) {
+		if ((watch->conn->fd != -1) && (watch->nextDue <= now)) {
+			due = true;
+			mask[watch->cmdIndex] = true;
+		}
+	}
+
+	if (!due) {
+		ScheduleSampler();
+	} else if (CacheLookupSet(&devs[0], mask, vals, &age, readMask)) {
+		FinishSample(now, mask, vals, age, true);
+	} else if ((job = NewI2cJob(I2C_PRIO_SAMPLER, I2C_TASK_SAMPLER, I2cReadWork, SamplerReadDone)) != NULL) {
+		memcpy(job->mask, readMask, sizeof(readMask));
+		job->msec = now;
+		SubmitI2cJob(job);
+	} else {
+		FinishSample(now, mask, vals, 0, false);
+	}
+}
+
+
+// Add a history sample of the recorded registers
+void HistoryAddValues(struct timeval* t, int* vals)
+{
+	int histVals[HIST_MAX_REGS];
+	int i;
+
+	for (i=0; i<NUM_CMDS; i++) {
+		if (histReg[i] != -1) {
+			histVals[histReg[i]] = vals[i];
+		}
+	}
+	HistoryAdd(&history, ((uint64_t) t->tv_sec * 1000) + (t->tv_usec / 1000), histVals);
+}
+
+
+void HistoryReadDone(i2cJob_t* job)
+{
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+		HistoryAddValues(&job->snap.t, job->snap.val);
+	}
+}
+
+
+// Sample the recorded registers from the cache or the charger
+void HistorySample()
+{
+	bool readMask[NUM_CMDS];
+	int vals[NUM_CMDS];
+	struct timeval t;
+	i2cJob_t* job;
+
+	if (CacheLookupSet(&devs[0], config.histMask, vals, NULL, readMask)) {
+		gettimeofday(&t, NULL);
+		HistoryAddValues(&t, vals);
+	} else if ((job = NewI2cJob(I2C_PRIO_TASK, I2C_TASK_HISTORY, I2cReadWork, HistoryReadDone)) != NULL) {
+		memcpy(job->mask, readMask, sizeof(readMask));
+		SubmitI2cJob(job);
+	}
+}
+
+
+// Respond to a HISTORY=<REG>,<seconds>,<RAW|1M|1H> command with the points from the
+// last <seconds> at the resolution.  Only the newest points that fit in the connection's
+// output buffer are sent.
+bool HistoryQuery(conn_t* conn, const char* value)
+{
+	static const char* resNames[HIST_NUM_RES] = {"RAW", "1M", "1H"};
+	char regS[16];
+	char resS[8];
+	char* buf;
+	char* cp;
+	struct timeval tv;
+	histPoint_t pt;
+	uint64_t now, t;
+	int cmdIndex, secs, res, count, max, i;
+
+	if (sscanf(value, "%15[^,],%d,%7s", regS, &secs, resS) != 3) {
+		return false;
+	}
+	if (((cmdIndex = FindCmdIndex(regS)) == -1) || (histReg[cmdIndex] == -1) || (secs <= 0)) {
+		return false;
+	}
+	for (res=0; res<HIST_NUM_RES; res++) {
+		if (strcmp(resS, resNames[res]) == 0) {
+			break;
+		}
+	}
+	if (res == HIST_NUM_RES) {
+		return false;
+	}
+
+	gettimeofday(&tv, NULL);
+	now = ((uint64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+	count = HistoryCount(&history, res, (now > (uint64_t) secs * 1000) ? now - ((uint64_t) secs * 1000) : 0);
+	max = (conn->outSize - conn->outLen - MAX_STRING_LEN) / ((res == HIST_RAW) ? HIST_RAW_PT_LEN : HIST_ROLLUP_PT_LEN);
+	if (max < 0) {
+		return false;
+	}
+	if (count > max) {
+		count = max;
+	}
+
+	if ((buf = (char*) malloc(MAX_STRING_LEN + (count * HIST_ROLLUP_PT_LEN))) == NULL) {
+		return false;
+	}
+	cp = buf;
+	if (conn->format == FMT_JSON) {
+		cp += sprintf(cp, "{\"HISTORY\":\"%s\",\"RES\":\"%s\",\"POINTS\":[", cmdList[cmdIndex].cName, resNames[res]);
+	} else {
+		cp += sprintf(cp, "HISTORY=%s,%s,%d", cmdList[cmdIndex].cName, resNames[res], count);
+	}
+	for (i=0; i<count; i++) {
+		HistoryGet(&history, res, histReg[cmdIndex], count, i, &t, &pt);
+		if (conn->format == FMT_JSON) {
+			if (res == HIST_RAW) {
+				cp += sprintf(cp, "%s[%llu,%d]", (i == 0) ? "" : ",", (unsigned long long) t, pt.avg);
+			} else {
+				cp += sprintf(cp, "%s[%llu,%d,%d,%d]", (i == 0) ? "" : ",", (unsigned long long) t, pt.min, pt.max, pt.avg);
+			}
+		} else {
+			if (res == HIST_RAW) {
+				cp += sprintf(cp, " %llu:%d", (unsigned long long) t, pt.avg);
+			} else {
+				cp += sprintf(cp, " %llu:%d/%d/%d", (unsigned long long) t, pt.min, pt.max, pt.avg);
+			}
+		}
+	}
+	cp += sprintf(cp, (conn->format == FMT_JSON) ? "]}\n\r" : "\n\r");
+
+	ConnPush(conn, buf, cp - buf);
+	free(buf);
+	return true;
+}
+
+
+// Allocate the history for the recorded registers
+bool HistoryOpen()
+{
+	uint32_t signedMask = 0;
+	int i, n;
+
+	n = 0;
+	for (i=0; i<NUM_CMDS; i++) {
+		if (config.histMask[i]) {
+			if (cmdList[i].isSigned) {
+				signedMask |= (1 << n);
+			}
+			histReg[i] = n++;
+		} else {
+			histReg[i] = -1;
+		}
+	}
+
+	if (!HistoryInit(&history, n, signedMask, config.histSizes)) {
+		syslog(LOG_ERR, "Could not allocate history");
+		return false;
+	}
+
+	return true;
+}
+
+
+//
+// Statistics
+//
+void InitStats()
+{
+	int addr, i;
+
+	memset(&counters, 0, sizeof(counters));
+
+	// Addresses that don't start a register belong to the register below them (the
+	// low byte of a 16-bit register) or, for unused addresses, the one above them
+	for (addr=CHG_NUM_REGS-1; addr>=0; addr--) {
+		regCmdIndex[addr] = (addr < CHG_NUM_REGS-1) ? regCmdIndex[addr+1] : NUM_CMDS-1;
+		for (i=0; i<NUM_CMDS; i++) {
+			if ((cmdList[i].regAddr == addr) ||
+			    (cmdList[i].isWord && ((cmdList[i].regAddr + 1) == addr))) {
+				regCmdIndex[addr] = i;
+			}
+		}
+	}
+}
+
+
+// STATS response or metrics body being formatted.  Once a line doesn't fit the body is
+// marked full and nothing more is added.
+typedef struct {
+	char* buf;
+	int len;
+	int size;
+	bool full;
+} metricsBuf_t;
+
+
+void MetricsPut(metricsBuf_t* mo, const char* fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	if (mo->full) {
+		return;
+	}
+	va_start(ap, fmt);
+	n = vsnprintf(&mo->buf[mo->len], mo->size - mo->len, fmt, ap);
+	va_end(ap);
+	if ((n < 0) || (n >= (mo->size - mo->len))) {
+		mo->buf[mo->len] = 0;
+		mo->full = true;
+	} else {
+		mo->len += n;
+	}
+}
+
+
+// Add the punctuation that opens or closes a STATS section.  It goes in the
+// STATS_TAIL_LEN bytes kept past the end of the body so the response stays well formed
+// when the body is full.
+void StatsPutTail(metricsBuf_t* mo, const char* s)
+{
+	int n = strlen(s);
+
+	memcpy(&mo->buf[mo->len], s, n + 1);
+	mo->len += n;
+}
+
+
+// Add a histogram, preceded by sep in JSON (a text field always starts with a comma)
+void FormatHist(metricsBuf_t* mo, const char* sep, const char* name, statsHist_t* hist, bool json)
+{
+	statsHist_t h;
+
+	StatsHistCopy(&h, hist);
+	if (json) {
+		MetricsPut(mo, "%s\"%s\":{\"N\":%llu,\"P50\":%llu,\"P99\":%llu,\"MAX\":%llu,\"SUM\":%llu}", sep, name,
+		           (unsigned long long) h.count,
+		           (unsigned long long) StatsHistPercentile(&h, 500),
+		           (unsigned long long) StatsHistPercentile(&h, 990),
+		           (unsigned long long) h.maxUs, (unsigned long long) h.sumUs);
+	} else {
+		MetricsPut(mo, ",%s=%llu/%llu/%llu/%llu", name,
+		           (unsigned long long) h.count,
+		           (unsigned long long) StatsHistPercentile(&h, 500),
+		           (unsigned long long) StatsHistPercentile(&h, 990),
+		           (unsigned long long) h.maxUs);
+	}
+}
+
+
+// Client connections in the order listed by STATS: the pty, TCP and then Unix socket
+// connections.  Pass NULL for the first.
+conn_t* NextClientConn(conn_t* c)
+{
+	int type = (c == NULL) ? -1 : c->type;
+
+	if ((type == CONN_TCP) || (type == CONN_UNIX)) {
+		if (c->next != NULL) {
+			return c->next;
+		}
+	}
+	if ((type == -1) && (linkConn != NULL)) {
+		return linkConn;
+	}
+	if (((type == -1) || (type == CONN_PTY)) && (tcpConns.head != NULL)) {
+		return tcpConns.head;
+	}
+	if (type != CONN_UNIX) {
+		return unixConns.head;
+	}
+	return NULL;
+}
+
+
+// Push the daemon statistics.  Latencies are in uSec.  Only the tasks, registers and
+// connections with activity are included.  The response is limited to what fits in the
+// connection's output buffer; once it is full the remaining entries are left out.
+void StatsQuery(conn_t* conn)
+{
+	static char buf[STATS_BUF_LEN + STATS_TAIL_LEN];
+	metricsBuf_t mo = {buf, 0, STATS_BUF_LEN, false};
+	char name[32];
+	char* cp2;
+	bool json = (conn->format == FMT_JSON);
+	bool first;
+	conn_t* c;
+	int i;
+
+	// Unix socket messages are preceded by their length.  The smallest output buffer
+	// (OUTBUF_MIN_SIZE) still holds the counters ahead of the first section.
+	i = conn->outSize - STATS_TAIL_LEN - ((conn->type == CONN_UNIX) ? sizeof(uint32_t) : 0);
+	if (i < mo.size) {
+		mo.size = i;
+	}
+
+	if (json) {
+		MetricsPut(&mo, "{\"STATS\":{\"UPTIME\":%ld,\"I2C\":{\"TX\":%llu,\"ERR\":%llu,\"RETRIES\":%llu},"
+		           "\"LINK\":{\"UP\":%d,\"FAILURES\":%llu,\"RECOVERIES\":%llu},\"RESETS\":%llu,"
+		           "\"CACHE\":{\"HIT\":%llu,\"MISS\":%llu},\"CMDS\":%llu,\"BYTES\":{\"IN\":%llu,\"OUT\":%llu}",
+		           (long) (time(NULL) - startTime),
+		           (unsigned long long) __atomic_load_n(&counters.i2cTransactions, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.i2cErrors, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.i2cRetries, __ATOMIC_RELAXED),
+		           devs[0].degraded ? 0 : 1,
+		           (unsigned long long) __atomic_load_n(&counters.linkFailures, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.linkRecoveries, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.chargerResets, __ATOMIC_RELAXED),
+		           (unsigned long long) counters.cacheHits, (unsigned long long) counters.cacheMisses,
+		           (unsigned long long) counters.commands,
+		           (unsigned long long) counters.bytesIn, (unsigned long long) counters.bytesOut);
+		FormatHist(&mo, ",", "LOOP", &counters.loopTime, true);
+		FormatHist(&mo, ",", "I2C_TIME", &counters.i2cTime, true);
+	} else {
+		MetricsPut(&mo, "STATS=%ld,I2C=%llu/%llu,RETRIES=%llu,LINK=%d/%llu/%llu,RESETS=%llu,CACHE=%llu/%llu,CMDS=%llu,BYTES=%llu/%llu",
+		           (long) (time(NULL) - startTime),
+		           (unsigned long long) __atomic_load_n(&counters.i2cTransactions, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.i2cErrors, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.i2cRetries, __ATOMIC_RELAXED),
+		           devs[0].degraded ? 0 : 1,
+		           (unsigned long long) __atomic_load_n(&counters.linkFailures, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.linkRecoveries, __ATOMIC_RELAXED),
+		           (unsigned long long) __atomic_load_n(&counters.chargerResets, __ATOMIC_RELAXED),
+		           (unsigned long long) counters.cacheHits, (unsigned long long) counters.cacheMisses,
+		           (unsigned long long) counters.commands,
+		           (unsigned long long) counters.bytesIn, (unsigned long long) counters.bytesOut);
+		FormatHist(&mo, "", "LOOP", &counters.loopTime, false);
+		FormatHist(&mo, "", "I2C_TIME", &counters.i2cTime, false);
+	}
+
+	// Time in the periodic tasks on the event loop and their I2C jobs on the worker
+	first = true;
+	StatsPutTail(&mo, json ? ",\"TASKS\":{" : "");
+	for (i=0; i<NUM_TASKS; i++) {
+		if (__atomic_load_n(&counters.taskTime[i].count, __ATOMIC_RELAXED) > 0) {
+			sprintf(name, json ? "%s" : "TASK_%s", taskNames[i]);
+			for (cp2=name; !json && (*cp2 != 0); cp2++) {
+				*cp2 = toupper(*cp2);
+			}
+			FormatHist(&mo, first ? "" : ",", name, &counters.taskTime[i], json);
+			first = false;
+		}
+	}
+	first = true;
+	StatsPutTail(&mo, json ? "},\"JOBS\":{" : "");
+	for (i=0; i<=I2C_NUM_TASKS; i++) {
+		if (__atomic_load_n(&counters.i2cJobTime[i].count, __ATOMIC_RELAXED) > 0) {
+			sprintf(name, json ? "%s" : "JOB_%s", i2cJobNames[i]);
+			for (cp2=name; !json && (*cp2 != 0); cp2++) {
+				*cp2 = toupper(*cp2);
+			}
+			FormatHist(&mo, first ? "" : ",", name, &counters.i2cJobTime[i], json);
+			first = false;
+		}
+	}
+
+	// Per-register reads/read failures/writes/write failures
+	first = true;
+	StatsPutTail(&mo, json ? "},\"REGS\":{" : "");
+	for (i=0; i<NUM_CMDS; i++) {
+		if ((__atomic_load_n(&counters.regReads[i], __ATOMIC_RELAXED) > 0) ||
+		    (__atomic_load_n(&counters.regWrites[i], __ATOMIC_RELAXED) > 0)) {
+			MetricsPut(&mo, json ? "%s\"%s\":[%llu,%llu,%llu,%llu]" : "%sREG_%s=%llu/%llu/%llu/%llu",
+			           json ? (first ? "" : ",") : ",", cmdList[i].cName,
+			           (unsigned long long) __atomic_load_n(&counters.regReads[i], __ATOMIC_RELAXED),
+			           (unsigned long long) __atomic_load_n(&counters.regReadErrors[i], __ATOMIC_RELAXED),
+			           (unsigned long long) __atomic_load_n(&counters.regWrites[i], __ATOMIC_RELAXED),
+			           (unsigned long long) __atomic_load_n(&counters.regWriteErrors[i], __ATOMIC_RELAXED));
+			first = false;
+		}
+	}
+
+	// Per-connection commands/bytes in/bytes out
+	first = true;
+	StatsPutTail(&mo, json ? "},\"CONNS\":[" : "");
+	for (c = NextClientConn(NULL); (c != NULL) && !mo.full; c = NextClientConn(c)) {
+		MetricsPut(&mo, json ? "%s{\"FD\":%d,\"CMDS\":%lu,\"IN\":%llu,\"OUT\":%llu}" : "%sCONN_%d=%lu/%llu/%llu",
+		           json ? (first ? "" : ",") : ",", c->fd, c->commands,
+		           (unsigned long long) c->bytesIn, (unsigned long long) c->bytesOut);
+		first = false;
+	}
+	StatsPutTail(&mo, json ? "]}}\n\r" : "\n\r");
+
+	ConnPush(conn, buf, mo.len);
+}
+
+
+// Stop processing a connection's commands until its I2C job is done
+void WaitI2cJob(conn_t* conn, i2cJob_t* job)
+{
+	job->conn = conn;
+	conn->waitI2c = true;
+	SubmitI2cJob(job);
+}
+
+
+// Continue processing a connection's commands after its I2C job is done
+void ResumeConnection(conn_t* conn)
+{
+	conn->waitI2c = false;
+	if (conn->fd != -1) {
+		ServiceInput(conn);
+	}
+}
+
+
+void ClientReadDone(i2cJob_t* job)
+{
+	char rspBuf[MAX_STRING_LEN];
+	int age;
+
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+		FormatValues(job->conn, job->dev->id, job->regList, job->n, job->snap.val, (int) (GetMsec() - job->snap.msec), false, 0, 0, rspBuf);
+		ConnPush(job->conn, rspBuf, strlen(rspBuf));
+	} else if (CacheLookupStale(job->dev, job->regList, job->n, job->snap.val, &age)) {
+		// Answer from the cache rather than not at all
+		FormatValues(job->conn, job->dev->id, job->regList, job->n, job->snap.val, age, true, 0, 0, rspBuf);
+		ConnPush(job->conn, rspBuf, strlen(rspBuf));
+	} else {
+		ConnError(job->conn, "EIO");
+	}
+	ResumeConnection(job->conn);
+}
+
+
+void ClientWriteDone(i2cJob_t* job)
+{
+	char rspBuf[MAX_STRING_LEN];
+
+	// The charger may clamp the value so force the next read to go to the charger
+	CacheExpire(job->dev, job->cmdIndex);
+
+	if (job->success) {
+		job->snap.val[job->cmdIndex] = job->val;
+		FormatValues(job->conn, job->dev->id, &job->cmdIndex, 1, job->snap.val, -1, false, 0, 0, rspBuf);
+		ConnPush(job->conn, rspBuf, strlen(rspBuf));
+	} else {
+		ConnError(job->conn, "EIO");
+	}
+	ResumeConnection(job->conn);
+}
+
+
+// Strip a leading charger number ("<N>:" or just "<N>") from a command value.  Returns
+// the charger, the primary charger if there is no number or NULL if there is no such
+// charger.
+chgDev_t* ParseChargerPrefix(const char** value)
+{
+	const char* cp = *value;
+	int n;
+
+	n = strspn(cp, "0123456789");
+	if ((n == 0) || ((cp[n] != ':') && (cp[n] != 0))) {
+		return &devs[0];
+	}
+	*value = (cp[n] == ':') ? &cp[n+1] : &cp[n];
+	return FindCharger(atoi(cp));
+}
+
+
+int CmdKeyHandler(void* user, const char* section, const char* name, const char* value)
+{
+	conn_t* cmd = (conn_t*) user;
+	char rspBuf[MAX_STRING_LEN];
+	char regS[16];
+	bool mask[NUM_CMDS];
+	bool readMask[NUM_CMDS];
+	int vals[NUM_CMDS];
+	int regList[NUM_CMDS];
+	int cmdIndex;
+	int success = 0;
+	int i, n, age;
+	chgDev_t* dev;
+	i2cJob_t* job;
+	char* cp;
+
+	if (MATCH("READ") || MATCH("READALL")) {
+		// One or more registers read from a single coherent set of values.  A charger
+		// number selects an additional charger (READ=1:VB or READALL=1).
+		if ((dev = ParseChargerPrefix(&value)) == NULL) {
+			n = 0;
+		} else if (MATCH("READALL")) {
+			for (i=0; i<NUM_CMDS; i++) {
+				regList[i] = i;
+			}
+			n = NUM_CMDS;
+		} else {
+			n = ParseRegList(value, regList);
+		}
+		if (n > 0) {
+			for (i=0; i<NUM_CMDS; i++) {
+				mask[i] = false;
+			}
+			for (i=0; i<n; i++) {
+				mask[regList[i]] = true;
+			}
+			if (CacheLookupSet(dev, mask, vals, &age, readMask)) {
+				FormatValues(cmd, dev->id, regList, n, vals, age, false, 0, 0, rspBuf);
+				success = 1;
+			} else if ((job = NewI2cJob(I2C_PRIO_CLIENT, I2C_TASK_NONE, I2cReadWork, ClientReadDone)) != NULL) {
+				// Response is sent when the read is done
+				job->dev = dev;
+				memcpy(job->mask, readMask, sizeof(readMask));
+				memcpy(job->regList, regList, n * sizeof(int));
+				job->n = n;
+				WaitI2cJob(cmd, job);
+				return 1;
+			}
+		}
+	} else if (MATCH("SUBSCRIBE")) {
+		// Form is <REG>[,<REG>...]@<period mSec>
+		if (CountSubscriptions(cmd) >= SUB_MAX_PER_CONN) {
+			ConnError(cmd, "ENOSPC");
+			return 1;
+		}
+		strncpy(rspBuf, value, MAX_STRING_LEN - 1);
+		rspBuf[MAX_STRING_LEN - 1] = 0;
+		if ((cp = strchr(rspBuf, '@')) != NULL) {
+			*cp++ = 0;
+			if (((n = ParseRegList(rspBuf, regList)) > 0) && ((i = atoi(cp)) > 0)) {
+				if ((i = AddSubscription(cmd, regList, n, i)) != 0) {
+					sprintf(rspBuf, "SUBSCRIBE=%d\n\r", i);
+					success = 1;
+				}
+			}
+		}
+	} else if (MATCH("UNSUBSCRIBE")) {
+		// Remove one subscription by id or all of them
+		i = (*value != 0) ? atoi(value) : 0;
+		n = RemoveSubscriptions(cmd, i);
+		sprintf(rspBuf, "UNSUBSCRIBE=%d\n\r", n);
+		success = 1;
+	} else if (MATCH("WATCH")) {
+		if (CountWatches(cmd) >= WATCH_MAX_PER_CONN) {
+			ConnError(cmd, "ENOSPC");
+			return 1;
+		}
+		if ((i = AddWatch(cmd, value)) != 0) {
+			sprintf(rspBuf, "WATCH=%d\n\r", i);
+			success = 1;
+		}
+	} else if (MATCH("UNWATCH")) {
+		// Remove one watch by id or all of them
+		i = (*value != 0) ? atoi(value) : 0;
+		n = RemoveWatches(cmd, i);
+		sprintf(rspBuf, "UNWATCH=%d\n\r", n);
+		success = 1;
+	} else if (MATCH("HISTORY")) {
+		// Response is pushed directly as it may be larger than rspBuf
+		if (config.enHistory && HistoryQuery(cmd, value)) {
+			return 1;
+		}
+	} else if (MATCH("STATS")) {
+		// Response is pushed directly as it may be larger than rspBuf
+		StatsQuery(cmd);
+		return 1;
+	} else if (MATCH("AGE")) {
+		// Per-connection option to append the value age (mSec) to read responses
+		cmd->showAge = (atoi(value) != 0);
+		sprintf(rspBuf, "AGE=%d\n\r", cmd->showAge ? 1 : 0);
+		success = 1;
+	} else if (MATCH("FORMAT")) {
+		// Per-connection response format
+		if (strcmp(value, "JSON") == 0) {
+			cmd->format = FMT_JSON;
+			success = 1;
+		} else if (strcmp(value, "TEXT") == 0) {
+			cmd->format = FMT_TEXT;
+			success = 1;
+		} else if ((strcmp(value, "BINARY") == 0) && (cmd->type == CONN_TCP)) {
+			// Subscription samples and watch events have no binary form
+			(void) RemoveSubscriptions(cmd, 0);
+			(void) RemoveWatches(cmd, 0);
+			cmd->format = FMT_BINARY;
+			success = 1;
+		}
+		if (success == 1) {
+			sprintf(rspBuf, "FORMAT=%s\n\r", value);
+		}
+	} else {
+		// Validate write.  A charger number selects an additional charger (1:BULKV=14000
+		// arrives as name 1 with value BULKV=14000).
+		dev = &devs[0];
+		if (isdigit(name[0]) && (strspn(name, "0123456789") == strlen(name)) &&
+		    ((cp = strchr(value, '=')) != NULL) && ((cp - value) < (int) sizeof(regS))) {
+			dev = FindCharger(atoi(name));
+			strncpy(regS, value, cp - value);
+			regS[cp - value] = 0;
+			name = regS;
+			value = cp + 1;
+		}
+		if ((dev != NULL) && ((cmdIndex = FindCmdIndex((char *) name)) != -1)) {
+			if (cmdList[cmdIndex].isWritable && (*value != 0)) {
+				if (!cmd->mayWrite) {
+					ConnError(cmd, "EPERM");
+					return 1;
+				}
+				if ((job = NewI2cJob(I2C_PRIO_CLIENT, I2C_TASK_NONE, I2cWriteWork, ClientWriteDone)) != NULL) {
+					// Response is sent when the write is done
+					job->dev = dev;
+					job->cmdIndex = cmdIndex;
+					job->val = atoi(value);
+					WaitI2cJob(cmd, job);
+					return 1;
+				}
+			}
+		}
+	}
+
+	if (success == 1) {
+		// Append response
+		ConnPush(cmd, rspBuf, strlen(rspBuf));
+	}
+
+	return success;
+}
+
+
+//
+// Binary protocol (mpptChgBin.h)
+//
+void BinPush(conn_t* conn, int op, int flags, uint32_t seq, const uint8_t* payload, int len)
+{
+	uint8_t frame[MPPT_BIN_MAX_LEN];
+
+	if (len > 0) {
+		memcpy(&frame[MPPT_BIN_HDR_LEN], payload, len);
+	}
+	ConnPush(conn, (char*) frame, MpptBinPutHdr(frame, len, op, flags, seq));
+}
+
+
+void BinError(conn_t* conn, int op, uint32_t seq, int err)
+{
+	uint8_t payload[2];
+
+	MpptBinPut16(payload, err);
+	BinPush(conn, op, MPPT_BIN_FLAG_ERROR, seq, payload, sizeof(payload));
+}
+
+
+// Push the listed registers (ascending index order) read age mSec ago
+void BinPushValues(conn_t* conn, int op, uint32_t seq, int* regList, int n, int* vals, int age, int flags)
+{
+	uint8_t payload[12 + (2 * NUM_CMDS)];
+	struct timeval tv;
+	uint64_t t;
+	uint32_t mask = 0;
+	int i;
+
+	gettimeofday(&tv, NULL);
+	t = ((uint64_t) tv.tv_sec * 1000) + (tv.tv_usec / 1000) - ((age > 0) ? age : 0);
+
+	for (i=0; i<n; i++) {
+		mask |= 1UL << regList[i];
+		MpptBinPut16(&payload[12 + (2 * i)], (uint16_t) vals[regList[i]]);
+	}
+	MpptBinPut32(&payload[0], mask);
+	MpptBinPut64(&payload[4], t);
+	BinPush(conn, op, flags, seq, payload, 12 + (2 * n));
+}
+
+
+void BinReadDone(i2cJob_t* job)
+{
+	int age;
+
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+		BinPushValues(job->conn, MPPT_BIN_OP_READ, job->seq, job->regList, job->n, job->snap.val,
+		              (int) (GetMsec() - job->snap.msec), 0);
+	} else if (CacheLookupStale(job->dev, job->regList, job->n, job->snap.val, &age)) {
+		BinPushValues(job->conn, MPPT_BIN_OP_READ, job->seq, job->regList, job->n, job->snap.val,
+		              age, MPPT_BIN_FLAG_STALE);
+	} else {
+		BinError(job->conn, MPPT_BIN_OP_READ, job->seq, MPPT_BIN_ERR_IO);
+	}
+	ResumeConnection(job->conn);
+}
+
+
+void BinWriteDone(i2cJob_t* job)
+{
+	// The charger may clamp the value so force the next read to go to the charger
+	CacheExpire(job->dev, job->cmdIndex);
+
+	if (job->success) {
+		job->snap.val[job->cmdIndex] = job->val;
+		BinPushValues(job->conn, MPPT_BIN_OP_WRITE, job->seq, &job->cmdIndex, 1, job->snap.val, 0, 0);
+	} else {
+		BinError(job->conn, MPPT_BIN_OP_WRITE, job->seq, MPPT_BIN_ERR_IO);
+	}
+	ResumeConnection(job->conn);
+}
+
+
+// Handle one request frame (len bytes including the length field).  Reads and writes
+// take the same path as the text READ and register write commands.
+void HandleFrame(conn_t* conn, uint8_t* frame, int len)
+{
+	uint8_t payload[MPPT_BIN_MAX_LEN];
+	bool mask[NUM_CMDS];
+	bool readMask[NUM_CMDS];
+	int vals[NUM_CMDS];
+	int regList[NUM_CMDS];
+	uint32_t seq, bits;
+	int op, i, n, age;
+	i2cJob_t* job;
+	uint8_t* cp;
+
+	op = frame[2];
+	seq = MpptBinGet32(&frame[4]);
+	len -= MPPT_BIN_HDR_LEN;
+	frame += MPPT_BIN_HDR_LEN;
+
+	switch (op) {
+	case MPPT_BIN_OP_READ:
+	case MPPT_BIN_OP_WRITE:
+		bits = (len >= 4) ? MpptBinGet32(frame) : 0;
+		n = 0;
+		for (i=0; i<NUM_CMDS; i++) {
+			mask[i] = (bits & (1UL << i)) != 0;
+			if (mask[i]) {
+				regList[n++] = i;
+			}
+		}
+		if ((n == 0) || ((bits >> NUM_CMDS) != 0) ||
+		    (len != ((op == MPPT_BIN_OP_READ) ? 4 : 6)) ||
+		    ((op == MPPT_BIN_OP_WRITE) && ((n != 1) || !cmdList[regList[0]].isWritable))) {
+			BinError(conn, op, seq, MPPT_BIN_ERR_ARG);
+			return;
+		}
+
+		if (op == MPPT_BIN_OP_READ) {
+			if (CacheLookupSet(&devs[0], mask, vals, &age, readMask)) {
+				BinPushValues(conn, op, seq, regList, n, vals, age, 0);
+				return;
+			}
+			if ((job = NewI2cJob(I2C_PRIO_CLIENT, I2C_TASK_NONE, I2cReadWork, BinReadDone)) != NULL) {
+				memcpy(job->mask, readMask, sizeof(readMask));
+				memcpy(job->regList, regList, n * sizeof(int));
+				job->n = n;
+			}
+		} else {
+			if ((job = NewI2cJob(I2C_PRIO_CLIENT, I2C_TASK_NONE, I2cWriteWork, BinWriteDone)) != NULL) {
+				job->cmdIndex = regList[0];
+				i = MpptBinGet16(&frame[4]);
+				job->val = cmdList[regList[0]].isSigned ? (int16_t) i : i;
+			}
+		}
+		if (job == NULL) {
+			BinError(conn, op, seq, MPPT_BIN_ERR_IO);
+			return;
+		}
+		// Response is sent when the job is done
+		job->seq = seq;
+		WaitI2cJob(conn, job);
+		break;
+
+	case MPPT_BIN_OP_NAMES:
+		bits = 0;
+		cp = &payload[12];
+		for (i=0; i<NUM_CMDS; i++) {
+			if (cmdList[i].isSigned) {
+				bits |= 1UL << i;
+			}
+			cp += sprintf((char*) cp, "%s", cmdList[i].cName) + 1;
+		}
+		MpptBinPut32(&payload[0], NUM_CMDS);
+		MpptBinPut32(&payload[4], bits);
+		bits = 0;
+		for (i=0; i<NUM_CMDS; i++) {
+			if (cmdList[i].isWritable) {
+				bits |= 1UL << i;
+			}
+		}
+		MpptBinPut32(&payload[8], bits);
+		BinPush(conn, op, 0, seq, payload, cp - payload);
+		break;
+
+	case MPPT_BIN_OP_TEXT:
+		BinPush(conn, op, 0, seq, NULL, 0);
+		conn->format = FMT_TEXT;
+		break;
+
+	default:
+		BinError(conn, op, seq, MPPT_BIN_ERR_OP);
+	}
+}
+
+
+void ListAppend(connList_t* list, conn_t* conn)
+{
+	conn->prev = list->tail;
+	conn->next = NULL;
+	if (list->tail != NULL) {
+		list->tail->next = conn;
+	} else {
+		list->head = conn;
+	}
+	list->tail = conn;
+}
+
+
+void ListRemove(connList_t* list, conn_t* conn)
+{
+	if (conn->prev != NULL) {
+		conn->prev->next = conn->next;
+	} else {
+		list->head = conn->next;
+	}
+	if (conn->next != NULL) {
+		conn->next->prev = conn->prev;
+	} else {
+		list->tail = conn->prev;
+	}
+	conn->prev = NULL;
+	conn->next = NULL;
+}
+
+
+bool WatchFd(conn_t* conn)
+{
+	struct epoll_event ev;
+
+	conn->events = EPOLLIN;
+	ev.events = conn->events;
+	ev.data.ptr = conn;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, conn->fd, &ev) == -1) {
+		syslog(LOG_ERR, "epoll_ctl add of fd %d failed: %m", conn->fd);
+		return false;
+	}
+	return true;
+}
+
+
+conn_t* AddConnection(int type, int fd)
+{
+	conn_t* conn;
+
+	if ((conn = (conn_t*) malloc(sizeof(conn_t))) == NULL) {
+		syslog(LOG_ERR, "Could not allocate connection for fd %d", fd);
+		return NULL;
+	}
+	conn->outSize = (type == CONN_HTTP) ? HTTP_OUTBUF_SIZE : config.outBufSize;
+	if ((conn->outBuf = (char*) malloc(conn->outSize)) == NULL) {
+		syslog(LOG_ERR, "Could not allocate output buffer for fd %d", fd);
+		free(conn);
+		return NULL;
+	}
+	conn->type = type;
+	conn->fd = fd;
+	conn->showAge = false;
+	conn->mayWrite = true;
+	conn->format = FMT_TEXT;
+	conn->lastActive = GetMsec();
+	conn->prev = NULL;
+	conn->next = NULL;
+	conn->pending = false;
+	conn->pendNext = NULL;
+	conn->waitI2c = false;
+	conn->closeWhenSent = false;
+	conn->commands = 0;
+	conn->bytesIn = 0;
+	conn->bytesOut = 0;
+	conn->inLen = 0;
+	conn->outHead = 0;
+	conn->outLen = 0;
+	conn->outDropped = 0;
+
+	if (!WatchFd(conn)) {
+		free(conn->outBuf);
+		free(conn);
+		return NULL;
+	}
+
+	if (type == CONN_TCP) {
+		ListAppend(&tcpConns, conn);
+		curSockConnects++;
+		counters.connections++;
+	} else if (type == CONN_HTTP) {
+		ListAppend(&httpConns, conn);
+		curHttpConnects++;
+	} else if (type == CONN_UNIX) {
+		ListAppend(&unixConns, conn);
+		curUnixConnects++;
+	}
+
+	return conn;
+}
+
+
+// Closes the connection.  The connection, its subscriptions and watches are freed at the end of
+// the current event loop iteration since other events already returned by epoll_wait()
+// (or the subscription being serviced) may refer to it.  A connection waiting on the I2C
+// worker is freed after its job is done.
+void CloseConnection(conn_t* conn)
+{
+	if (conn->fd == -1) {
+		return;
+	}
+
+	close(conn->fd);
+	conn->fd = -1;
+	if (conn->type == CONN_TCP) {
+		ListRemove(&tcpConns, conn);
+		curSockConnects--;
+	} else if (conn->type == CONN_HTTP) {
+		ListRemove(&httpConns, conn);
+		curHttpConnects--;
+	} else if (conn->type == CONN_UNIX) {
+		ListRemove(&unixConns, conn);
+		curUnixConnects--;
+	}
+	ListAppend(&deadConns, conn);
+}
+
+
+void FreeDeadConnections()
+{
+	conn_t* conn;
+	conn_t* next;
+
+	for (conn = deadConns.head; conn != NULL; conn = next) {
+		next = conn->next;
+		if (conn->waitI2c) {
+			continue;
+		}
+		ListRemove(&deadConns, conn);
+		(void) RemoveSubscriptions(conn, 0);
+		(void) RemoveWatches(conn, 0);
+		free(conn->outBuf);
+		free(conn);
+	}
+}
+
+
+// Move a TCP connection to the most-recently-active end of the idle list
+void TouchConnection(conn_t* conn)
+{
+	conn->lastActive = GetMsec();
+	if (conn->type == CONN_TCP) {
+		ListRemove(&tcpConns, conn);
+		ListAppend(&tcpConns, conn);
+	} else if (conn->type == CONN_HTTP) {
+		ListRemove(&httpConns, conn);
+		ListAppend(&httpConns, conn);
+	}
+}
+
+
+// The idle list is ordered by activity so only expired connections are visited
+void CheckIdleConnections()
+{
+	uint64_t now;
+	conn_t* conn;
+
+	now = GetMsec();
+	while ((conn = httpConns.head) != NULL) {
+		if ((now - conn->lastActive) < (HTTP_IDLE_SECS * 1000)) {
+			break;
+		}
+		CloseConnection(conn);
+	}
+
+	if (config.tcpIdleSecs <= 0) {
+		return;
+	}
+
+	while ((conn = tcpConns.head) != NULL) {
+		if ((now - conn->lastActive) < ((uint64_t) config.tcpIdleSecs * 1000)) {
+			break;
+		}
+		if (debug>0) {
+			syslog(LOG_NOTICE, "Idle connection closed");
+		}
+		CloseConnection(conn);
+	}
+}
+
+
+// True if the connection's input buffer holds a complete command line or frame
+bool InputReady(conn_t* conn)
+{
+	if (conn->format == FMT_BINARY) {
+		return (conn->inLen >= 2) && (conn->inLen >= (2 + MpptBinGet16(conn->inBuf)));
+	}
+	return (memchr(conn->inBuf, 0x0A, conn->inLen) != NULL) ||
+	       (memchr(conn->inBuf, 0x0D, conn->inLen) != NULL);
+}
+
+
+// Binary frames are handled the same way as command lines (see ProcessInput)
+bool ProcessFrames(conn_t* conn)
+{
+	int start, len, cmds;
+
+	start = 0;
+	cmds = 0;
+	while (((conn->inLen - start) >= 2) && (cmds < CMDS_PER_WAKE) && (conn->fd != -1) &&
+	       !conn->waitI2c && (conn->format == FMT_BINARY)) {
+		len = 2 + MpptBinGet16(&conn->inBuf[start]);
+		if ((len < MPPT_BIN_HDR_LEN) || (len > MPPT_BIN_MAX_LEN)) {
+			syslog(LOG_NOTICE, "Closing connection on fd %d, bad frame length %d", conn->fd, len);
+			CloseConnection(conn);
+			return false;
+		}
+		if ((conn->inLen - start) < len) {
+			break;
+		}
+		HandleFrame(conn, (uint8_t*) &conn->inBuf[start], len);
+		counters.commands++;
+		conn->commands++;
+		cmds++;
+		start += len;
+	}
+
+	if (start > 0) {
+		conn->inLen -= start;
+		memmove(conn->inBuf, &conn->inBuf[start], conn->inLen);
+	}
+
+	return !conn->waitI2c && InputReady(conn);
+}
+
+
+// Process up to CMDS_PER_WAKE complete command lines from the connection's input
+// buffer, stopping early at a command that waits on the I2C worker.  Returns true if
+// complete lines remain to be processed now.
+bool ProcessInput(conn_t* conn)
+{
+	char* name;
+	char* value;
+	char c;
+	int i, start, cmds;
+
+	if (conn->format == FMT_BINARY) {
+		return ProcessFrames(conn);
+	}
+
+	i = 0;
+	start = 0;
+	cmds = 0;
+	while ((i < conn->inLen) && (cmds < CMDS_PER_WAKE) && (conn->fd != -1) && !conn->waitI2c &&
+	       (conn->format != FMT_BINARY)) {
+		c = conn->inBuf[i++];
+
+		// Look for complete packet
+		if ((c == 0x0A) || (c == 0x0D)) {
+			// Process command
+			conn->inBuf[i-1] = 0;
+			if (CmdTokenize(&conn->inBuf[start], &name, &value)) {
+				if (!CmdKeyHandler(conn, NULL, name, value)) {
+					ConnError(conn, "EINVAL");
+				}
+				counters.commands++;
+				conn->commands++;
+				cmds++;
+			}
+			if ((conn->format == FMT_BINARY) && (c == 0x0D) && (i < conn->inLen) && (conn->inBuf[i] == 0x0A)) {
+				// The rest of a CR LF ending FORMAT=BINARY
+				i++;
+			}
+			start = i;
+		}
+	}
+
+	// Keep any unprocessed bytes
+	if (start > 0) {
+		conn->inLen -= start;
+		memmove(conn->inBuf, &conn->inBuf[start], conn->inLen);
+	} else if (conn->inLen == MAX_STRING_LEN) {
+		// Discard an overly long command
+		if (debug>0) {
+			syslog(LOG_NOTICE, "Discarding overly long command on fd %d", conn->fd);
+		}
+		conn->inLen = 0;
+	}
+
+	return !conn->waitI2c && InputReady(conn);
+}
+
+
+// Process commands on a connection, queueing it to continue on the next pass through
+// the event loop if it has more than CMDS_PER_WAKE pipelined commands.  A hang up or
+// error can get here while the connection is already queued.
+void ServiceInput(conn_t* conn)
+{
+	bool wasPending = conn->pending;
+
+	conn->pending = ProcessInput(conn);
+	if (conn->fd == -1) {
+		return;
+	}
+	if (conn->pending && !wasPending) {
+		conn->pendNext = NULL;
+		*pendTailP = conn;
+		pendTailP = &conn->pendNext;
+	}
+	FlushConnection(conn);
+}
+
+
+void ServicePending()
+{
+	conn_t* conn;
+	conn_t* next;
+
+	conn = pendHead;
+	pendHead = NULL;
+	pendTailP = &pendHead;
+	while (conn != NULL) {
+		next = conn->pendNext;
+		conn->pending = false;
+		if (conn->fd != -1) {
+			ServiceInput(conn);
+		}
+		conn = next;
+	}
+}
+
+
+void Cleanup()
+{
+	conn_t* conn;
+	int i;
+
+	StopI2cWorker();
+	if ( sockFd != -1 )
+		close(sockFd);
+	if ( httpFd != -1 )
+		close(httpFd);
+	GpioClose(&gpio);
+	while ((conn = tcpConns.head) != NULL)
+		CloseConnection(conn);
+	while ((conn = httpConns.head) != NULL)
+		CloseConnection(conn);
+	while ((conn = unixConns.head) != NULL)
+		CloseConnection(conn);
+	FreeDeadConnections();
+	if ( unixFd != -1 ) {
+		close(unixFd);
+		unlink(config.unixPath);
+	}
+	if ( linkFd != -1 )
+		close(linkFd);
+	if (linkname)
+		unlink(linkname);
+	if (config.enLogging) {
+		if (config.logFormat == LOGFMT_BINARY)
+			BinLogClose(&binLog);
+		else
+			TextLogClose(&textLog);
+	}
+	for (i=MAX_CHARGERS-1; i>=0; i--) {
+		if (devs[i].logOpen) {
+			TextLogClose(&devs[i].log);
+			devs[i].logOpen = false;
+		}
+		if (devs[i].backend != NULL) {
+			i2cDev = &devs[i];
+			if ((i == 0) && config.enWatchdog)
+				(void) DisableWatchdog();
+			ChgBackendClose(devs[i].backend);
+			devs[i].backend = NULL;
+		}
+	}
+	ShmClose();
+}
+
+
+bool LinkSlave(int fd)
+{
+	char *slavename;
+	int status = grantpt(linkFd);
+	if (status != -1) {
+		status = unlockpt(linkFd);
+	}
+	if (status != -1) {
+		slavename = ptsname(linkFd);
+		if (slavename) {
+			// Safety first
+			unlink(linkname);
+			status = symlink(slavename, linkname);
+			status = chmod(linkname, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
+			if (status == -1) {
+				syslog(LOG_ERR, "Cannot chmod link for pseudo-tty: %m");
+				exit(1);
+			}
+		}
+		else {
+			status = -1;
+		}
+	}
+
+	return (status != -1);
+}
+
+
+bool OpenLink()
+{
+	while (1) {
+		linkFd = open("/dev/ptmx", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+		if ( linkFd != -1 )
+			break;
+		syslog(LOG_ERR, "Open of /dev/ptmx failed: %m");
+		if ( errno != EIO )
+			return false;
+		sleep(1);
+	}
+	if (!LinkSlave(linkFd)) {
+		syslog(LOG_ERR, "Cannot create link for psuedo-tty: %m");
+		return false;
+	}
+	if ((linkConn = AddConnection(CONN_PTY, linkFd)) == NULL) {
+		return false;
+	}
+
+	return true;
+}
+
+
+// Run a shell command with the daemon's blocked signals restored in the child
+void RunCommand(char* cmdS)
+{
+	sigset_t mask;
+	pid_t pid;
+
+	if ((pid = fork()) == 0) {
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		execl("/bin/sh", "sh", "-c", cmdS, (char *) NULL);
+		_exit(127);
+	} else if (pid != -1) {
+		(void) waitpid(pid, NULL, 0);
+	} else {
+		syslog(LOG_ERR, "Could not run %s: %m", cmdS);
+	}
+}
+
+
+void AlertDone(i2cJob_t* job);
+
+// Read STATUS to confirm a GPIO edge.  If the read is already outstanding the edge is
+// confirmed by another read when it is done.
+void GpioConfirm()
+{
+	i2cJob_t* job;
+
+	if ((job = NewI2cJob(I2C_PRIO_SAFETY, I2C_TASK_ALERT, I2cAlertWork, AlertDone)) != NULL) {
+		gpioRecheck = false;
+		SubmitI2cJob(job);
+	}
+}
+
+
+//
+// Periodic task jobs done - a failed job has already been retried and has taken the
+// charger link down if the charger isn't responding (see CheckChargerLink)
+//
+void AlertDone(i2cJob_t* job)
+{
+	if (gpioRecheck) {
+		GpioConfirm();
+	}
+
+	if (!job->success) {
+		return;
+	}
+
+	// Feed any STATUS watches with the checked value
+	CacheApplySnapshot(job->dev, &job->snap);
+	EvaluateWatches(job->snap.valid, job->snap.val);
+
+	if (job->val && config.enAutoShutdown) {
+		syslog(LOG_CRIT, "Low Battery shutdown");
+		RunCommand("sudo shutdown now");
+	}
+}
+
+
+void ParamsDone(i2cJob_t* job)
+{
+	int i, n;
+
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+		return;
+	}
+
+	// A value may have been written so force the next reads to go to the charger
+	n = FindCmdIndex("BULKV");
+	for (i=0; i<NUM_PARAMS; i++) {
+		CacheExpire(&devs[0], i+n);
+	}
+}
+
+
+void LogDone(i2cJob_t* job)
+{
+	if (!job->success) {
+		return;
+	}
+
+	CacheApplySnapshot(job->dev, &job->snap);
+	if (LogChanged(&job->snap)) {
+		LogWriteValues(&job->t, &job->snap);
+	}
+}
+
+
+void WatchdogDone(i2cJob_t* job)
+{
+	// Feed any STATUS watches with a checked value
+	CacheApplySnapshot(job->dev, &job->snap);
+	EvaluateWatches(job->snap.valid, job->snap.val);
+
+	CacheExpire(&devs[0], FindCmdIndex("WDEN"));
+	CacheExpire(&devs[0], FindCmdIndex("WDCNT"));
+	CacheExpire(&devs[0], FindCmdIndex("WDPWROFF"));
+}
+
+
+void CacheRefreshDone(i2cJob_t* job)
+{
+	if (job->success) {
+		CacheApplySnapshot(job->dev, &job->snap);
+	}
+}
+
+
+// Keep the shared memory and metrics values current by reading any registers that have
+// gone stale.  ID and STATUS are left to the clients, watchdog and shutdown checks that
+// ask for them: reading STATUS clears its latched SWD_DET and PWD_TRIG bits before the
+// clients could see them.
+void CacheRefresh()
+{
+	bool mask[NUM_CMDS];
+	bool readMask[NUM_CMDS];
+	int vals[NUM_CMDS];
+	bool stale = false;
+	uint64_t now;
+	i2cJob_t* job;
+	int i;
+
+	now = GetMsec();
+	for (i=0; i<NUM_CMDS; i++) {
+		mask[i] = (i != idIndex) && (i != statusIndex) && !CacheIsFresh(&devs[0], i, now);
+		if (mask[i]) {
+			stale = true;
+		}
+	}
+
+	if (stale && !CacheLookupSet(&devs[0], mask, vals, NULL, readMask)) {
+		if ((job = NewI2cJob(I2C_PRIO_TASK, I2C_TASK_REFRESH, I2cReadWork, CacheRefreshDone)) != NULL) {
+			memcpy(job->mask, readMask, sizeof(readMask));
+			SubmitI2cJob(job);
+		}
+	}
+}
+
+
+void PollDone(i2cJob_t* job)
+{
+	chgDev_t* dev = job->dev;
+	char logS[MAX_STRING_LEN];
+	int n;
+
+	if (!job->success) {
+		return;
+	}
+
+	CacheApplySnapshot(dev, &job->snap);
+	if (dev->logOpen) {
+		n = LogFormatLine(&job->snap.t, config.chargers[dev->id].pollMs < 1000, config.chargers[dev->id].pollMask,
+		                  &job->snap, logS);
+		if (!TextLogAppend(&dev->log, logS, n)) {
+			syslog(LOG_ERR, "Write to charger %d log file failed: %m", dev->id);
+		}
+	}
+}
+
+
+// Poll the most overdue additional charger.  One poll is outstanding at a time so the
+// worker interleaves them with the primary charger's jobs, and a poll is held back
+// while the worker has been busy for more than POLL_BUDGET_PCT of the time since the
+// previous one started (a held back poll is tried again on the next run).
+void ServicePoll()
+{
+	chgDev_t* dev = NULL;
+	chargerConfig_t* c;
+	uint64_t now, busy;
+	i2cJob_t* job;
+	int i;
+
+	if (i2cTaskBusy[I2C_TASK_POLL]) {
+		return;
+	}
+
+	now = GetMsec();
+	busy = __atomic_load_n(&counters.i2cBusyUs, __ATOMIC_RELAXED);
+	if (((busy - pollMarkBusyUs) * 100) > ((uint64_t) config.pollBudgetPct * (now - pollMarkMs) * 1000)) {
+		return;
+	}
+
+	for (i=1; i<MAX_CHARGERS; i++) {
+		if (devs[i].enabled && (devs[i].pollDue <= now) && ((dev == NULL) || (devs[i].pollDue < dev->pollDue))) {
+			dev = &devs[i];
+		}
+	}
+	if (dev == NULL) {
+		return;
+	}
+
+	c = &config.chargers[dev->id];
+	if ((job = NewI2cJob(I2C_PRIO_TASK, I2C_TASK_POLL, I2cReadWork, PollDone)) != NULL) {
+		job->dev = dev;
+		memcpy(job->mask, c->pollMask, sizeof(c->pollMask));
+		SubmitI2cJob(job);
+		pollMarkMs = now;
+		pollMarkBusyUs = busy;
+	}
+
+	// Like a scheduled task the next poll is due a period after this one was
+	dev->pollDue += c->pollMs;
+	if (dev->pollDue <= now) {
+		dev->pollDue = now + c->pollMs;
+	}
+}
+
+
+//
+// Task scheduler
+//
+void EnableTask(int task, int periodMs, uint64_t now)
+{
+	schedTasks[task].enabled = true;
+	schedTasks[task].periodMs = (periodMs < SCHED_MIN_PERIOD_MS) ? SCHED_MIN_PERIOD_MS : periodMs;
+	schedTasks[task].nextDue = now + schedTasks[task].periodMs;
+}
+
+
+// Arm the task timer for the earliest due task
+bool ScheduleTasks()
+{
+	struct itimerspec ts;
+	uint64_t due = 0;
+	int i;
+
+	for (i=0; i<NUM_TASKS; i++) {
+		if (schedTasks[i].enabled && ((due == 0) || (schedTasks[i].nextDue < due))) {
+			due = schedTasks[i].nextDue;
+		}
+	}
+
+	ts.it_interval.tv_sec = 0;
+	ts.it_interval.tv_nsec = 0;
+	ts.it_value.tv_sec = due / 1000;
+	ts.it_value.tv_nsec = (due % 1000) * 1000000;
+	if (timerfd_settime(schedConn.fd, TFD_TIMER_ABSTIME, &ts, NULL) == -1) {
+		syslog(LOG_ERR, "Could not set task timer: %m");
+		return false;
+	}
+
+	return true;
+}
+
+
+void RunTask(int task)
+{
+	i2cJob_t* job;
+
+	switch (task) {
+	case TASK_IDLE:
+		CheckIdleConnections();
+		break;
+
+	case TASK_ALERT:
+		SubmitI2cTask(I2C_PRIO_SAFETY, I2C_TASK_ALERT, I2cAlertWork, AlertDone);
+		break;
+
+	case TASK_PARAMS:
+		SubmitI2cTask(I2C_PRIO_TASK, I2C_TASK_PARAMS, I2cParamsWork, ParamsDone);
+		break;
+
+	case TASK_LOG:
+		if ((job = NewI2cJob(I2C_PRIO_TASK, I2C_TASK_LOG, I2cReadWork, LogDone)) != NULL) {
+			memcpy(job->mask, config.logMask, sizeof(config.logMask));
+			gettimeofday(&job->t, NULL);
+			SubmitI2cJob(job);
+		}
+		break;
+
+	case TASK_LOGFILE:
+		(void) LogForEachText(TextLogTick, "Write");
+		break;
+
+	case TASK_WATCHDOG:
+		SubmitI2cTask(I2C_PRIO_SAFETY, I2C_TASK_WATCHDOG, I2cWatchdogWork, WatchdogDone);
+		break;
+
+	case TASK_REFRESH:
+		CacheRefresh();
+		break;
+
+	case TASK_HISTORY:
+		HistorySample();
+		break;
+
+	case TASK_POLL:
+		ServicePoll();
+		break;
+	}
+}
+
+
+// Run all due tasks.  A task that has fallen more than a period behind (for example
+// while the system was suspended) runs once and restarts its schedule from now.
+bool ServiceTasks()
+{
+	uint64_t now, t;
+	int i;
+
+	now = GetMsec();
+	for (i=0; i<NUM_TASKS; i++) {
+		if (schedTasks[i].enabled && (schedTasks[i].nextDue <= now)) {
+			schedTasks[i].nextDue += schedTasks[i].periodMs;
+			if (schedTasks[i].nextDue <= now) {
+				schedTasks[i].nextDue = now + schedTasks[i].periodMs;
+			}
+			t = StatsUsec();
+			RunTask(i);
+			StatsHistSince(&counters.taskTime[i], t);
+		}
+	}
+
+	return ScheduleTasks();
+}
+
+
+// Follow the charger link state set by the I2C worker.  Cached values are served while
+// it is down.  When the primary charger comes back, or the worker has seen it reset, the
+// parameters and watchdog are reasserted right away.  Returns false once the primary
+// charger's link has been down for the failure budget.  Additional chargers are only
+// reported.
+bool CheckChargerLink()
+{
+	chgDev_t* dev;
+	uint64_t down, now;
+	unsigned long n;
+	bool reassert;
+	int i;
+
+	now = GetMsec();
+	reassert = __atomic_exchange_n(&chgResetPending, false, __ATOMIC_RELAXED);
+	for (i=0; i<MAX_CHARGERS; i++) {
+		dev = &devs[i];
+		if (!dev->enabled) {
+			continue;
+		}
+		down = __atomic_load_n(&dev->linkDownMs, __ATOMIC_RELAXED);
+		if ((down != 0) && !dev->degraded) {
+			syslog(LOG_WARNING, "Charger %d not responding, serving cached values", i);
+			dev->degraded = true;
+		}
+		n = __atomic_load_n(&dev->recoveries, __ATOMIC_RELAXED);
+		if (n != dev->recoveriesSeen) {
+			dev->recoveriesSeen = n;
+			dev->degraded = (down != 0);
+			if (i == 0) {
+				reassert = true;
+			}
+		}
+	}
+
+	if (reassert) {
+		if (schedTasks[TASK_PARAMS].enabled) {
+			schedTasks[TASK_PARAMS].nextDue = now;
+		}
+		if (schedTasks[TASK_WATCHDOG].enabled) {
+			schedTasks[TASK_WATCHDOG].nextDue = now;
+		}
+		if (gpio.fd != -1) {
+			// Edges while the charger was unreachable went unconfirmed
+			GpioConfirm();
+		}
+		if (!ScheduleTasks()) {
+			return false;
+		}
+	}
+
+	down = __atomic_load_n(&devs[0].linkDownMs, __ATOMIC_RELAXED);
+	if ((down != 0) && ((now - down) >= ((uint64_t) config.linkFailSecs * 1000))) {
+		syslog(LOG_CRIT, "Charger not responding for %d seconds", config.linkFailSecs);
+		return false;
+	}
+
+	return true;
+}
+
+
+void AcceptConnection()
+{
+	struct sockaddr_in remoteaddr;
+	socklen_t remoteaddrlen;
+	unsigned long ip;
+	int fd;
+
+	// Accept the remote systems attachment
+	remoteaddrlen = sizeof(struct sockaddr_in);
+	fd = accept4(sockFd,(struct sockaddr*)(&remoteaddr),
+		&remoteaddrlen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+
+	if ( fd == -1 )
+		syslog(LOG_ERR,"accept failed: %m");
+	else if ((config.tcpMaxConnections <= 0) || (curSockConnects < config.tcpMaxConnections)) {
+		if (AddConnection(CONN_TCP, fd) == NULL) {
+			close(fd);
+			return;
+		}
+		ip = ntohl(remoteaddr.sin_addr.s_addr);
+		if (debug>0)
+			syslog(LOG_NOTICE, "Connection from %d.%d.%d.%d",
+				(int)(ip>>24)&0xff,
+				(int)(ip>>16)&0xff,
+				(int)(ip>>8)&0xff,
+				(int)(ip>>0)&0xff);
+	}
+	else {
+		// Too many connections, just close it to reject
+		if (debug>0)
+			syslog(LOG_NOTICE, "Connection rejected, %d connections open", curSockConnects);
+		close(fd);
+	}
+}
+
+
+// Returns false on a fatal error
+bool HandleClientRead(conn_t* conn)
+{
+	int devbytes;
+
+	if (conn->inLen == MAX_STRING_LEN) {
+		// Input buffer full of pending commands.  Reading is paused so only a hang up or
+		// error gets here and, as it stays signalled, it is handled as a close.
+		devbytes = 0;
+	} else {
+		devbytes = read(conn->fd,&conn->inBuf[conn->inLen],MAX_STRING_LEN-conn->inLen);
+		if ((devbytes == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+			return true;
+		}
+	}
+
+	if (conn->type == CONN_PTY) {
+		if (debug>1)
+			syslog(LOG_INFO,"%s: %d bytes", linkname, devbytes);
+		if ( devbytes <= 0 ) {
+			// Client closed the pseudo-tty so recreate it
+			if ( debug>0 ) {
+				syslog(LOG_INFO,"%s closed",linkname);
+			}
+			CloseConnection(conn);
+			linkConn = NULL;
+			if (!OpenLink()) {
+				return false;
+			}
+			if ( debug>0 ) {
+				syslog(LOG_INFO,"/dev/ptmx re-opened");
+			}
+			return true;
+		}
+	} else {
+		if (debug>1)
+			syslog(LOG_INFO,"Remote: %d bytes",devbytes);
+		if ( devbytes <= 0 ) {
+			if (debug>0) {
+				syslog(LOG_NOTICE,"Connection closed");
+			}
+			CloseConnection(conn);
+			return true;
+		}
+	}
+
+	// Process command
+	TouchConnection(conn);
+	if (debug > 2) syslog(LOG_INFO, "%s received %.*s", (conn->type == CONN_PTY) ? linkname : "Remote", devbytes, &conn->inBuf[conn->inLen]);
+	conn->inLen += devbytes;
+	conn->bytesIn += devbytes;
+	counters.bytesIn += devbytes;
+	ServiceInput(conn);
+
+	return true;
+}
+
+
+//
+// HTTP metrics exporter - serves the cached register values and daemon counters in the
+// Prometheus text format.  A scrape never accesses the charger.
+//
+void FormatMetricsHist(metricsBuf_t* mo, const char* name, const char* label, const char* labelVal, statsHist_t* hist)
+{
+	statsHist_t h;
+	char lbl[64];
+	uint64_t n;
+	int i;
+
+	StatsHistCopy(&h, hist);
+	if (label != NULL) {
+		sprintf(lbl, "%s=\"%s\",", label, labelVal);
+	} else {
+		lbl[0] = 0;
+	}
+	n = 0;
+	for (i=0; i<STATS_NUM_BUCKETS-1; i++) {
+		n += h.bucket[i];
+		MetricsPut(mo, "%s_bucket{%sle=\"%g\"} %llu\n", name, lbl, statsBucketUs[i] / 1e6, (unsigned long long) n);
+	}
+	MetricsPut(mo, "%s_bucket{%sle=\"+Inf\"} %llu\n", name, lbl, (unsigned long long) h.count);
+	if (label != NULL) {
+		lbl[strlen(lbl) - 1] = 0;
+		MetricsPut(mo, "%s_sum{%s} %.6f\n%s_count{%s} %llu\n", name, lbl, h.sumUs / 1e6,
+		           name, lbl, (unsigned long long) h.count);
+	} else {
+		MetricsPut(mo, "%s_sum %.6f\n%s_count %llu\n", name, h.sumUs / 1e6, name, (unsigned long long) h.count);
+	}
+}
+
+
+// Prometheus label selecting an additional charger (empty for the primary charger)
+void ChargerLabel(int n, char* label)
+{
+	if (n == 0) {
+		label[0] = 0;
+	} else {
+		sprintf(label, "charger=\"%d\",", n);
+	}
+}
+
+
+// Returns the length of the body or -1 if it doesn't fit in size
+int FormatMetrics(char* buf, int size)
+{
+	metricsBuf_t mo = {buf, 0, size, false};
+	char label[32];
+	uint64_t now;
+	int i, j, s, status;
+
+	// Values of additional chargers are labeled with the charger number
+	now = GetMsec();
+	MetricsPut(&mo, "# HELP mpptchg_register Charger register value (mV, mA, C*10 or raw)\n");
+	MetricsPut(&mo, "# TYPE mpptchg_register gauge\n");
+	for (j=0; j<MAX_CHARGERS; j++) {
+		ChargerLabel(j, label);
+		for (i=0; i<NUM_CMDS; i++) {
+			if (devs[j].enabled && devs[j].cache[i].valid) {
+				MetricsPut(&mo, "mpptchg_register{%sreg=\"%s\"} %d\n", label, cmdList[i].cName,
+				           devs[j].cache[i].val);
+			}
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchg_register_age_seconds Age of the register value\n");
+	MetricsPut(&mo, "# TYPE mpptchg_register_age_seconds gauge\n");
+	for (j=0; j<MAX_CHARGERS; j++) {
+		ChargerLabel(j, label);
+		for (i=0; i<NUM_CMDS; i++) {
+			if (devs[j].enabled && devs[j].cache[i].valid) {
+				MetricsPut(&mo, "mpptchg_register_age_seconds{%sreg=\"%s\"} %.3f\n", label, cmdList[i].cName,
+				           (double) (now - devs[j].cache[i].msec) / 1000.0);
+			}
+		}
+	}
+
+	s = FindCmdIndex("STATUS");
+	MetricsPut(&mo, "# HELP mpptchg_status_flag Charger STATUS register flag\n");
+	MetricsPut(&mo, "# TYPE mpptchg_status_flag gauge\n");
+	for (j=0; j<MAX_CHARGERS; j++) {
+		if (devs[j].enabled && devs[j].cache[s].valid) {
+			ChargerLabel(j, label);
+			status = devs[j].cache[s].val;
+			for (i=0; i<(int) NUM_STATUS_FLAGS; i++) {
+				MetricsPut(&mo, "mpptchg_status_flag{%sflag=\"%s\"} %d\n", label, statusFlags[i].name,
+				           (status & statusFlags[i].mask) ? 1 : 0);
+			}
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchg_status_latched_total STATUS reads that found a latched watchdog flag set\n");
+	MetricsPut(&mo, "# TYPE mpptchg_status_latched_total counter\n");
+	for (j=0; j<MAX_CHARGERS; j++) {
+		if (devs[j].enabled) {
+			ChargerLabel(j, label);
+			MetricsPut(&mo, "mpptchg_status_latched_total{%sflag=\"hw_wd\"} %lu\n", label, devs[j].swdDetSeen);
+			MetricsPut(&mo, "mpptchg_status_latched_total{%sflag=\"sw_wd\"} %lu\n", label, devs[j].pwdTrigSeen);
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchg_charge_state Charger charge state (1 for the current state)\n");
+	MetricsPut(&mo, "# TYPE mpptchg_charge_state gauge\n");
+	for (j=0; j<MAX_CHARGERS; j++) {
+		if (devs[j].enabled && devs[j].cache[s].valid) {
+			ChargerLabel(j, label);
+			status = devs[j].cache[s].val;
+			for (i=0; i<(int) NUM_CHARGE_STATES; i++) {
+				MetricsPut(&mo, "mpptchg_charge_state{%sstate=\"%s\"} %d\n", label, chargeStates[i],
+				           ((status & STATUS_CHG_ST_MASK) == i) ? 1 : 0);
+			}
+		}
+	}
+
+	MetricsPut(&mo, "# HELP mpptchgd_start_time_seconds Daemon start time\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_start_time_seconds gauge\n");
+	MetricsPut(&mo, "mpptchgd_start_time_seconds %ld\n", (long) startTime);
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_transactions_total I2C transactions with the charger\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_transactions_total counter\n");
+	MetricsPut(&mo, "mpptchgd_i2c_transactions_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.i2cTransactions, __ATOMIC_RELAXED));
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_errors_total Failed I2C transactions\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_errors_total counter\n");
+	MetricsPut(&mo, "mpptchgd_i2c_errors_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.i2cErrors, __ATOMIC_RELAXED));
+	MetricsPut(&mo, "# HELP mpptchgd_connections Open TCP connections\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_connections gauge\n");
+	MetricsPut(&mo, "mpptchgd_connections %d\n", curSockConnects);
+	MetricsPut(&mo, "# HELP mpptchgd_connections_total Accepted TCP connections\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_connections_total counter\n");
+	MetricsPut(&mo, "mpptchgd_connections_total %llu\n", (unsigned long long) counters.connections);
+	MetricsPut(&mo, "# HELP mpptchgd_commands_total Commands processed from clients\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_commands_total counter\n");
+	MetricsPut(&mo, "mpptchgd_commands_total %llu\n", (unsigned long long) counters.commands);
+	MetricsPut(&mo, "# HELP mpptchgd_http_requests_total HTTP requests\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_http_requests_total counter\n");
+	MetricsPut(&mo, "mpptchgd_http_requests_total %llu\n", (unsigned long long) counters.httpRequests);
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_retries_total I2C transactions retried after an error or a failed burst read\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_retries_total counter\n");
+	MetricsPut(&mo, "mpptchgd_i2c_retries_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.i2cRetries, __ATOMIC_RELAXED));
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_busy_seconds_total Time the I2C worker spent running jobs\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_busy_seconds_total counter\n");
+	MetricsPut(&mo, "mpptchgd_i2c_busy_seconds_total %.6f\n",
+	           (double) __atomic_load_n(&counters.i2cBusyUs, __ATOMIC_RELAXED) / 1e6);
+	MetricsPut(&mo, "# HELP mpptchgd_charger_link_up 1 if the charger is responding, 0 while cached values are served\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_charger_link_up gauge\n");
+	MetricsPut(&mo, "mpptchgd_charger_link_up %d\n", devs[0].degraded ? 0 : 1);
+	for (j=1; j<MAX_CHARGERS; j++) {
+		if (devs[j].enabled) {
+			MetricsPut(&mo, "mpptchgd_charger_link_up{charger=\"%d\"} %d\n", j, devs[j].degraded ? 0 : 1);
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_charger_link_failures_total Times the charger stopped responding\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_charger_link_failures_total counter\n");
+	MetricsPut(&mo, "mpptchgd_charger_link_failures_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.linkFailures, __ATOMIC_RELAXED));
+	MetricsPut(&mo, "# HELP mpptchgd_charger_link_recoveries_total Times the charger link was restored\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_charger_link_recoveries_total counter\n");
+	MetricsPut(&mo, "mpptchgd_charger_link_recoveries_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.linkRecoveries, __ATOMIC_RELAXED));
+	MetricsPut(&mo, "# HELP mpptchgd_charger_resets_total Charger resets detected (reasserted for the primary charger)\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_charger_resets_total counter\n");
+	MetricsPut(&mo, "mpptchgd_charger_resets_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.chargerResets, __ATOMIC_RELAXED));
+	for (j=1; j<MAX_CHARGERS; j++) {
+		if (devs[j].enabled) {
+			MetricsPut(&mo, "mpptchgd_charger_resets_total{charger=\"%d\"} %lu\n", j,
+			           __atomic_load_n(&devs[j].resets, __ATOMIC_RELAXED));
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_writes_skipped_total Register writes skipped because the charger already held the value\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_writes_skipped_total counter\n");
+	MetricsPut(&mo, "mpptchgd_writes_skipped_total %llu\n",
+	           (unsigned long long) __atomic_load_n(&counters.writesSkipped, __ATOMIC_RELAXED));
+	if (gpio.fd != -1) {
+		MetricsPut(&mo, "# HELP mpptchgd_gpio_events_total Charger output edges\n");
+		MetricsPut(&mo, "# TYPE mpptchgd_gpio_events_total counter\n");
+		for (i=0; i<gpio.n; i++) {
+			MetricsPut(&mo, "mpptchgd_gpio_events_total{line=\"%s\"} %llu\n", gpioLineNames[i],
+			           (unsigned long long) counters.gpioEvents[i]);
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_register_transactions_total I2C transactions by first register\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_register_transactions_total counter\n");
+	for (i=0; i<NUM_CMDS; i++) {
+		MetricsPut(&mo, "mpptchgd_i2c_register_transactions_total{reg=\"%s\",op=\"read\"} %llu\n", cmdList[i].cName,
+		           (unsigned long long) __atomic_load_n(&counters.regReads[i], __ATOMIC_RELAXED));
+		if (cmdList[i].isWritable) {
+			MetricsPut(&mo, "mpptchgd_i2c_register_transactions_total{reg=\"%s\",op=\"write\"} %llu\n", cmdList[i].cName,
+			           (unsigned long long) __atomic_load_n(&counters.regWrites[i], __ATOMIC_RELAXED));
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_register_errors_total Failed I2C transactions by first register\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_register_errors_total counter\n");
+	for (i=0; i<NUM_CMDS; i++) {
+		MetricsPut(&mo, "mpptchgd_i2c_register_errors_total{reg=\"%s\",op=\"read\"} %llu\n", cmdList[i].cName,
+		           (unsigned long long) __atomic_load_n(&counters.regReadErrors[i], __ATOMIC_RELAXED));
+		if (cmdList[i].isWritable) {
+			MetricsPut(&mo, "mpptchgd_i2c_register_errors_total{reg=\"%s\",op=\"write\"} %llu\n", cmdList[i].cName,
+			           (unsigned long long) __atomic_load_n(&counters.regWriteErrors[i], __ATOMIC_RELAXED));
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_cache_lookups_total Register cache lookups\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_cache_lookups_total counter\n");
+	MetricsPut(&mo, "mpptchgd_cache_lookups_total{result=\"hit\"} %llu\n", (unsigned long long) counters.cacheHits);
+	MetricsPut(&mo, "mpptchgd_cache_lookups_total{result=\"miss\"} %llu\n", (unsigned long long) counters.cacheMisses);
+	MetricsPut(&mo, "# HELP mpptchgd_client_bytes_total Bytes received from and sent to clients\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_client_bytes_total counter\n");
+	MetricsPut(&mo, "mpptchgd_client_bytes_total{dir=\"in\"} %llu\n", (unsigned long long) counters.bytesIn);
+	MetricsPut(&mo, "mpptchgd_client_bytes_total{dir=\"out\"} %llu\n", (unsigned long long) counters.bytesOut);
+
+	MetricsPut(&mo, "# HELP mpptchgd_loop_seconds Event loop iteration time\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_loop_seconds histogram\n");
+	FormatMetricsHist(&mo, "mpptchgd_loop_seconds", NULL, NULL, &counters.loopTime);
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_transaction_seconds I2C transaction time\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_transaction_seconds histogram\n");
+	FormatMetricsHist(&mo, "mpptchgd_i2c_transaction_seconds", NULL, NULL, &counters.i2cTime);
+	MetricsPut(&mo, "# HELP mpptchgd_task_seconds Time in periodic tasks on the event loop\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_task_seconds histogram\n");
+	for (i=0; i<NUM_TASKS; i++) {
+		if (schedTasks[i].enabled) {
+			FormatMetricsHist(&mo, "mpptchgd_task_seconds", "task", taskNames[i], &counters.taskTime[i]);
+		}
+	}
+	MetricsPut(&mo, "# HELP mpptchgd_i2c_job_seconds Time the I2C worker spends on each kind of job\n");
+	MetricsPut(&mo, "# TYPE mpptchgd_i2c_job_seconds histogram\n");
+	for (i=0; i<=I2C_NUM_TASKS; i++) {
+		if (__atomic_load_n(&counters.i2cJobTime[i].count, __ATOMIC_RELAXED) > 0) {
+			FormatMetricsHist(&mo, "mpptchgd_i2c_job_seconds", "job", i2cJobNames[i], &counters.i2cJobTime[i]);
+		}
+	}
+
+	return mo.full ? -1 : mo.len;
+}
+
+
+// Answer the request in the connection's input buffer and close the connection once
+// the response is sent
+void HttpRespond(conn_t* conn)
+{
+	char method[8] = "";
+	char path[64];
+	char hdr[MAX_STRING_LEN];
+	char* body;
+	int n, len;
+
+	counters.httpRequests++;
+	conn->inBuf[conn->inLen] = 0;
+	conn->inLen = 0;
+	conn->closeWhenSent = true;
+
+	if ((body = (char*) malloc(HTTP_OUTBUF_SIZE)) == NULL) {
+		CloseConnection(conn);
+		return;
+	}
+
+	n = sscanf(conn->inBuf, "%7s %63s", method, path);
+	if ((n != 2) || ((strcmp(method, "GET") != 0) && (strcmp(method, "HEAD") != 0))) {
+		len = sprintf(body, "Method not allowed\n");
+		n = sprintf(hdr, "HTTP/1.1 405 Method Not Allowed\r\nAllow: GET, HEAD\r\n");
+	} else if ((strncmp(path, "/metrics", 8) != 0) || ((path[8] != 0) && (path[8] != '?'))) {
+		len = sprintf(body, "Not found\n");
+		n = sprintf(hdr, "HTTP/1.1 404 Not Found\r\n");
+	} else if ((len = FormatMetrics(body, HTTP_OUTBUF_SIZE)) < 0) {
+		syslog(LOG_ERR, "Metrics do not fit in %d bytes", HTTP_OUTBUF_SIZE);
+		len = sprintf(body, "Metrics too large\n");
+		n = sprintf(hdr, "HTTP/1.1 500 Internal Server Error\r\n");
+	} else {
+		n = sprintf(hdr, "HTTP/1.1 200 OK\r\n");
+	}
+	n += sprintf(&hdr[n], "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+	                      "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+
+	ConnPush(conn, hdr, n);
+	if (strcmp(method, "HEAD") != 0) {
+		ConnPush(conn, body, len);
+	}
+	free(body);
+	FlushConnection(conn);
 }
 
 
-void LogValueNames()
+void HandleHttpRead(conn_t* conn)
 {
-	int i;
-	char logS[16];
+	char* cp;
+	int n;
 
-	// Print a keyword to indicate this is a list of names
-	sprintf(logS, "LOGGING: ");
-	write(logFd, logS, strlen(logS));
-
-	// Print enabled value names
-	for (i=0; i<NUM_CMDS; i++) {
-		if (config.logMask[i]) {
-			sprintf(logS, "%s ", cmdList[i].cName);
-			write(logFd, logS, strlen(logS));
+	n = read(conn->fd, &conn->inBuf[conn->inLen], MAX_STRING_LEN - 1 - conn->inLen);
+	if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+		return;
+	}
+	if (n <= 0) {
+		CloseConnection(conn);
+		return;
+	}
+	conn->bytesIn += n;
+	counters.bytesIn += n;
+	if (conn->closeWhenSent) {
+		// Anything after the request is ignored
+		return;
+	}
+	TouchConnection(conn);
+	conn->inLen += n;
+	conn->inBuf[conn->inLen] = 0;
+
+	// Respond at the end of the headers.  Only the request line is used so the headers
+	// are dropped if they fill the input buffer.
+	if ((strstr(conn->inBuf, "\r\n\r\n") != NULL) || (strstr(conn->inBuf, "\n\n") != NULL)) {
+		HttpRespond(conn);
+	} else if (conn->inLen == (MAX_STRING_LEN - 1)) {
+		if (((cp = strchr(conn->inBuf, '\n')) == NULL) || ((cp - conn->inBuf) > (MAX_STRING_LEN - 8))) {
+			CloseConnection(conn);
+			return;
 		}
+		n = cp - conn->inBuf + 1;
+		memmove(&conn->inBuf[n], &conn->inBuf[conn->inLen - 3], 3);
+		conn->inLen = n + 3;
 	}
-	write(logFd, "\n", 1);
 }
 
 
-bool LogValues(struct timeval *t)
+void AcceptHttpConnection()
 {
-	bool success = true;
-	char logS[16];
-	int i, n;
-
-	// Print time
-	sprintf(logS, "%d: ", t->tv_sec);
-	write(logFd, logS, strlen(logS));
+	int fd;
 
-	// Print enabled values
-	for (i=0; i<NUM_CMDS; i++) {
-		if (config.logMask[i]) {
-			if (ReadCharger((char *) cmdList[i].cName, &n)) {
-				sprintf(logS, "%d ", n);
-				write(logFd, logS, strlen(logS));
-			} else {
-				success = false;
-				break;
-			}
+	if ((fd = accept4(httpFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1) {
+		syslog(LOG_ERR, "HTTP accept failed: %m");
+	} else if (curHttpConnects >= HTTP_MAX_CONNS) {
+		if (debug>0) {
+			syslog(LOG_NOTICE, "HTTP connection rejected, %d connections open", curHttpConnects);
 		}
+		close(fd);
+	} else if (AddConnection(CONN_HTTP, fd) == NULL) {
+		close(fd);
 	}
-	write(logFd, "\n", 1);
-
-	return success;
 }
 
 
-bool SecTick(struct timeval *prevT)
+bool OpenHttpPort()
 {
-	struct timeval curT;
-	long dT;
+	struct sockaddr_in addr;
+	int on = 1;
 
-	gettimeofday(&curT, NULL);
-	dT = (curT.tv_sec * 1000000 + curT.tv_usec) - (prevT->tv_sec * 1000000 + prevT->tv_usec);
-	if (dT >= 1000000) {
-		prevT->tv_sec = curT.tv_sec;
-		prevT->tv_usec = curT.tv_usec;
-		return(true);
-	} else {
-		return(false);
+	if ((httpFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 6)) == -1) {
+		syslog(LOG_ERR, "Can't open HTTP socket: %m");
+		return false;
+	}
+	(void) setsockopt(httpFd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = 0;
+	addr.sin_port = htons(config.httpPort);
+	if (bind(httpFd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		syslog(LOG_ERR, "Couldn't bind HTTP port %d: %m", config.httpPort);
+		return false;
 	}
+	if (listen(httpFd, 16) == -1) {
+		syslog(LOG_ERR, "HTTP socket listen failed: %m");
+		return false;
+	}
+
+	return true;
 }
 
 
-int CmdKeyHandler(void* user, const char* section, const char* name, const char* value)
+//
+// Unix domain socket - a SOCK_SEQPACKET socket so the kernel keeps message boundaries.
+// Each message from a client is a request holding one or more commands (the end of the
+// message ends the last command) and each response line is sent as its own message.
+//
+
+// Register writes are allowed from root, the daemon's user and members of the
+// UNIX_WRITE_GROUP group.  The peer's credentials only hold its primary group so its
+// supplementary groups are looked up in the group database when it connects.
+bool UnixPeerMayWrite(struct ucred* cred)
 {
-	char rspBuf[64];
-	int cmdIndex;
-	int success = 0;
-	int t;
+	struct passwd* pw;
+	gid_t* groups;
+	bool member = false;
+	int i, n;
 
-	if (MATCH("READ")) {
-		if ((cmdIndex = FindCmdIndex((char *) value)) != -1) {
-			if (ReadCharger((char *) cmdList[cmdIndex].cName, &t)) {
-				sprintf(rspBuf, "%s=%d\n\r", cmdList[cmdIndex].cName, t);
-				success = 1;
-			}
-		}
-	} else {
-		// Validate write
-		if ((cmdIndex = FindCmdIndex((char *) name)) != -1) {
-			if (cmdList[cmdIndex].isWritable) {
-				t = atoi(value);
-				if (WriteCharger((char *) cmdList[cmdIndex].cName, t)) {
-					sprintf(rspBuf, "%s=%d\n\r", cmdList[cmdIndex].cName, t);
-					success = 1;
-				}
-			}
-		}
+	if ((cred->uid == 0) || (cred->uid == geteuid())) {
+		return true;
+	}
+	if (config.unixWriteGid < 0) {
+		return false;
+	}
+	if (cred->gid == (gid_t) config.unixWriteGid) {
+		return true;
 	}
 
-	if (success == 1) {
-		// Append response
-		t = 0;
-		while (rspBuf[t] != 0) {
-			rspFifo[rspFifoPushI++] = rspBuf[t++];
-			if (rspFifoPushI >= MAX_FIFO_LEN) rspFifoPushI = 0;
+	if ((pw = getpwuid(cred->uid)) == NULL) {
+		return false;
+	}
+	n = 0;
+	(void) getgrouplist(pw->pw_name, cred->gid, NULL, &n);
+	if ((n <= 0) || ((groups = (gid_t*) malloc(n * sizeof(gid_t))) == NULL)) {
+		return false;
+	}
+	if (getgrouplist(pw->pw_name, cred->gid, groups, &n) != -1) {
+		for (i=0; i<n; i++) {
+			member = member || (groups[i] == (gid_t) config.unixWriteGid);
 		}
 	}
-
-	return success;
+	free(groups);
+	return member;
 }
 
 
-void InitCmdBuf()
+void AcceptUnixConnection()
 {
-	int i;
+	struct ucred cred;
+	socklen_t credLen;
+	conn_t* conn;
+	int fd;
 
-	for (i=0; i<MAX_CONNECTIONS; i++) {
-		cmdBufs[i].valid = false;
-		cmdBufs[i].fd = 0;
-		cmdBufs[i].cmdFifoPushI = 0;
-		cmdBufs[i].cmdFifoPopI = 0;
-		cmdBufs[i].cmdBufI = 0;
+	fd = accept4(unixFd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd == -1) {
+		syslog(LOG_ERR, "Unix socket accept failed: %m");
+		return;
 	}
-}
-
 
-bool AddCmdBuf(int fd)
-{
-	int i;
+	if ((config.unixMax > 0) && (curUnixConnects >= config.unixMax)) {
+		if (debug>0)
+			syslog(LOG_NOTICE, "Unix connection rejected, %d connections open", curUnixConnects);
+		close(fd);
+		return;
+	}
 
-	for (i=0; i<MAX_CONNECTIONS; i++) {
-		if (cmdBufs[i].valid == false) {
-			// Use this entry
-			cmdBufs[i].valid = true;
-			cmdBufs[i].fd = fd;
-			cmdBufs[i].cmdFifoPushI = 0;
-			cmdBufs[i].cmdFifoPopI = 0;
-			cmdBufs[i].cmdBufI = 0;
-			return true;
-		}
+	credLen = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1) {
+		syslog(LOG_ERR, "Can't get Unix socket peer credentials: %m");
+		close(fd);
+		return;
 	}
 
-	return false;
+	if ((conn = AddConnection(CONN_UNIX, fd)) == NULL) {
+		close(fd);
+		return;
+	}
+	conn->mayWrite = UnixPeerMayWrite(&cred);
+	if (debug>0)
+		syslog(LOG_NOTICE, "Unix connection from pid %d uid %d gid %d%s", (int) cred.pid,
+			(int) cred.uid, (int) cred.gid, conn->mayWrite ? "" : " (read only)");
 }
 
 
-bool DeleteCmdBuf(int fd)
+// Read one request message.  Reading is paused while earlier commands are being processed
+// so the input buffer is empty here and a request has to fit in it.
+void HandleUnixRead(conn_t* conn)
 {
-	int i;
-
-	for (i=0; i<MAX_CONNECTIONS; i++) {
-		if ((cmdBufs[i].valid == true) && (cmdBufs[i].fd == fd)) {
-			cmdBufs[i].valid = false;
-			return true;
+	struct msghdr msg;
+	struct iovec iov;
+	int n;
+
+	iov.iov_base = &conn->inBuf[conn->inLen];
+	iov.iov_len = MAX_STRING_LEN - conn->inLen - 1;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	n = recvmsg(conn->fd, &msg, 0);
+	if ((n == -1) && ((errno == EAGAIN) || (errno == EINTR))) {
+		return;
+	}
+	if (n <= 0) {
+		if (debug>0) {
+			syslog(LOG_NOTICE,"Unix connection closed");
 		}
+		CloseConnection(conn);
+		return;
 	}
 
-	return false;
-}
-
-
-cmdBuf_t* GetCmdBufPtr(int fd)
-{
-	int i;
-
-	for (i=0; i<MAX_CONNECTIONS; i++) {
-		if ((cmdBufs[i].valid == true) && (cmdBufs[i].fd == fd)) {
-			return &cmdBufs[i];
-		}
+	TouchConnection(conn);
+	conn->bytesIn += n;
+	counters.bytesIn += n;
+	if (msg.msg_flags & MSG_TRUNC) {
+		ConnError(conn, "EMSGSIZE");
+		FlushConnection(conn);
+		return;
 	}
 
-	return NULL;
-}  
+	if (debug > 2) syslog(LOG_INFO, "Unix received %.*s", n, &conn->inBuf[conn->inLen]);
+	conn->inLen += n;
+	if ((conn->inBuf[conn->inLen - 1] != 0x0A) && (conn->inBuf[conn->inLen - 1] != 0x0D)) {
+		conn->inBuf[conn->inLen++] = 0x0A;
+	}
+	ServiceInput(conn);
+}
 
 
-bool ProcessCmdBytes(char* buf, int numBytes, cmdBuf_t* cmd)
+bool OpenUnixSocket()
 {
-	bool success = false;
-	char c;
-	int i;
+	struct sockaddr_un addr;
 
-	// Initialize response fifo in case we will process commands
-	memset(rspFifo, '\0', sizeof(rspFifo));
-	rspFifoPushI = 0;
-
-	// Push bytes into command fifo
-	for (i=0; i<numBytes; i++) {
-		// Push received data
-		c = *(buf + i);
-		cmd->cmdFifo[cmd->cmdFifoPushI++] = c;
-		if (cmd->cmdFifoPushI >= MAX_FIFO_LEN) cmd->cmdFifoPushI = 0;
+	if (strlen(config.unixPath) >= sizeof(addr.sun_path)) {
+		syslog(LOG_ERR, "Unix socket path %s too long", config.unixPath);
+		return false;
+	}
+	if ((unixFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) == -1) {
+		syslog(LOG_ERR, "Can't open Unix socket: %m");
+		return false;
 	}
 
-	// Pop bytes from command fifo looking for termination character to process command
-	while (cmd->cmdFifoPopI != cmd->cmdFifoPushI) {
-		// Pop into our local command buffer
-		c = cmd->cmdFifo[cmd->cmdFifoPopI++];
-		if (cmd->cmdFifoPopI >= MAX_FIFO_LEN) cmd->cmdFifoPopI = 0;
-
-		// Look for complete packet
-		if ((c == 0x0A) || (c == 0x0D)) {
-			// Process command
-			cmd->cmdBuf[cmd->cmdBufI] = 0;
-			cmd->cmdBufI = 0;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, config.unixPath);
 
-			success |= (ini_parse_string(cmd->cmdBuf, CmdKeyHandler, &config) == 0);
-		} else {
-			// Continue building command
-			cmd->cmdBuf[cmd->cmdBufI++] = c;
-		}
+	// Remove the socket left by an earlier run
+	unlink(config.unixPath);
+	if (bind(unixFd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+		syslog(LOG_ERR, "Couldn't bind Unix socket %s: %m", config.unixPath);
+		close(unixFd);
+		unixFd = -1;
+		return false;
+	}
+	if (chmod(config.unixPath, config.unixMode) == -1) {
+		syslog(LOG_ERR, "Couldn't set mode of Unix socket %s: %m", config.unixPath);
+		return false;
+	}
+	if (listen(unixFd, 16) == -1) {
+		syslog(LOG_ERR, "Unix socket listen failed: %m");
+		return false;
 	}
 
-	return success;
+	return true;
 }
 
 
-void SigHandler(int sig)
+// Request the configured charger output lines.  ALERT_N is active low and NIGHT is
+// active high.
+bool OpenGpio()
 {
-	int i;
+	int offsets[GPIO_MAX_LINES];
+	bool activeLow[GPIO_MAX_LINES];
+	int n = 0;
+
+	if (config.gpioAlert >= 0) {
+		gpioLineNames[n] = "alert";
+		offsets[n] = config.gpioAlert;
+		activeLow[n++] = true;
+	}
+	if (config.gpioNight >= 0) {
+		gpioLineNames[n] = "night";
+		offsets[n] = config.gpioNight;
+		activeLow[n++] = false;
+	}
 
-	if ( sockFd != -1 )
-		close(sockFd);
-	for (i=0 ; i<curSockConnects ; i++)
-		close(remotefd[i]);
-	if ( linkFd != -1 )
-		close(linkFd);
-	if (linkname)
-		unlink(linkname);
-	if (config.enLogging) 
-		close(logFd);
-	if (config.enWatchdog) 
-		(void) DisableWatchdog();
-	syslog(LOG_NOTICE, "Terminating on signal %d",sig);
-	exit(0);
+	if (!GpioOpen(&gpio, config.gpioChip, "mpptChgD", n, offsets, activeLow, config.gpioDebounceUs)) {
+		syslog(LOG_ERR, "Can't request GPIO lines on %s: %m", config.gpioChip);
+		return false;
+	}
+
+	gpioConn.type = CONN_GPIO;
+	gpioConn.fd = gpio.fd;
+	return WatchFd(&gpioConn);
 }
 
 
-bool LinkSlave(int fd)
+// Each edge is confirmed by reading STATUS - the charger sets ALERT_N and NIGHT from
+// the same state as the STATUS bits so the read also updates the cache and watches
+void HandleGpioEvents()
 {
-	char *slavename;
-	int status = grantpt(linkFd);
-	if (status != -1) {
-		status = unlockpt(linkFd);
-	}
-	if (status != -1) {
-		slavename = ptsname(linkFd);
-		if (slavename) {
-			// Safety first
-			unlink(linkname);
-			status = symlink(slavename, linkname);
-			status = chmod(linkname, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP|S_IROTH|S_IWOTH);
-			if (status == -1) {
-				syslog(LOG_ERR, "Cannot chmod link for pseudo-tty: %m");
-				exit(1);
-			}
-		}
-		else {
-			status = -1;
+	uint64_t tNs;
+	bool active;
+	int line;
+
+	while (GpioReadEvent(&gpio, &line, &active, &tNs)) {
+		counters.gpioEvents[line]++;
+		if (debug) {
+			syslog(LOG_INFO, "GPIO %s %s", gpioLineNames[line], active ? "active" : "inactive");
 		}
+		gpioRecheck = true;
 	}
 
-	return (status != -1);
+	if (gpioRecheck) {
+		GpioConfirm();
+	}
 }
 
 
@@ -758,22 +5479,23 @@ int main(int argc, char *argv[])
 	extern int optind;
 	bool isdaemon = false;
 	bool hasConfig = false;
-	int maxfd = -1;
-	int debug=0;
 	char devbuf[MAX_STRING_LEN];
-	int devbytes;
-	struct sockaddr_in addr,remoteaddr;
-	int remoteaddrlen;
-	fd_set fdsread,fdsreaduse;
-	int c, i;
-	struct timeval select_timeout, prev_time;
-	int paramTimeout, logTimeout, watchdogTimeout;
-	bool alertDetected;
-	cmdBuf_t* curCmdBufP;
+	struct sockaddr_in addr;
+	struct epoll_event events[MAX_EVENTS];
+	struct signalfd_siginfo sigInfo;
+	sigset_t sigMask;
+	uint64_t expirations;
+	conn_t listenConn, httpListenConn, unixListenConn, signalConn;
+	conn_t* connP;
+	snapshot_t snap;
+	uint64_t now, loopStart;
+	int c, i, n;
 
 	// Setup default values
-	FD_ZERO(&fdsread);
-	InitCmdBuf();
+	startTime = time(NULL);
+	InitCache();
+	InitStats();
+	InitShadows();
 	SetupDefaultConfigValues();
 
 	// Parse command line options
@@ -801,12 +5523,12 @@ int main(int argc, char *argv[])
 	// ID ourselves
 	syslog(LOG_NOTICE, "MPPT Solar Charger daemon V%d.%d", VERSION_MAJOR, VERSION_MINOR);
 
-	// Try to connect to the charger
-	if (!ConnectCharger()) {
+	if (!CmdHashCheck()) {
+		syslog(LOG_ERR, "Internal error, command hash table does not match command list");
 		exit(1);
 	}
 
-	// Parse the config file if specified
+	// Parse the config file if specified (before connecting since it may select the I2C bus)
 	if (hasConfig) {
 		if (ini_parse(devbuf, ParseKeyHandler, &config) != 0) {
 			syslog(LOG_ERR, "Can't process config file %s", devbuf);
@@ -814,61 +5536,136 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	// Try to connect to the charger and any additional chargers
+	if (!ConnectCharger(&devs[0])) {
+		exit(1);
+	}
+	for (i=1; i<MAX_CHARGERS; i++) {
+		if (config.chargers[i].enabled && !OpenCharger(&devs[i])) {
+			exit(1);
+		}
+	}
+	i2cDev = &devs[0];
+
 	// Open data logging file if necessary
 	if (config.enLogging) {
-		if ((logFd = open(config.logFileName, O_CREAT | O_APPEND | O_WRONLY, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH)) == -1) {
-			syslog(LOG_ERR, "Open of log file %s failed: %m", config.logFileName);
+		if (config.logFormat == LOGFMT_BINARY) {
+			if (!LogOpenBinary()) {
+				exit(1);
+			}
+		} else if (!LogOpenText()) {
 			exit(1);
 		}
 	}
 
-	// Array for remote TCP hosts
-	remotefd = (int *) malloc (config.tcpMaxConnections * sizeof(int));
+	// Create the shared memory segment if necessary
+	if (config.enShm) {
+		if (!ShmOpen()) {
+			exit(1);
+		}
+	}
 
-	// Setup device file link
-	if ((linkFd = open("/dev/ptmx", O_RDWR)) == -1) {
-		syslog(LOG_ERR, "Open of /dev/ptmx failed: %m");
+	// Allocate the register history if necessary
+	if (config.enHistory) {
+		if (!HistoryOpen()) {
+			exit(1);
+		}
+	}
+
+	// Terminating signals are handled synchronously by the event loop
+	sigemptyset(&sigMask);
+	sigaddset(&sigMask, SIGINT);
+	sigaddset(&sigMask, SIGHUP);
+	sigaddset(&sigMask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigMask, NULL);
+
+	// Write errors to disconnected clients are handled where they occur
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "epoll_create failed: %m");
 		exit(1);
 	}
-	if (!LinkSlave(linkFd)) {
-		syslog(LOG_ERR, "Cannot create link for psuedo-tty: %m");
+
+	signalConn.type = CONN_SIGNAL;
+	if ((signalConn.fd = signalfd(-1, &sigMask, SFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "signalfd failed: %m");
+		exit(1);
+	}
+	if (!WatchFd(&signalConn)) {
 		exit(1);
 	}
-	(void) AddCmdBuf(linkFd);
 
-	signal(SIGINT,SigHandler);
-	signal(SIGHUP,SigHandler);
-	signal(SIGTERM,SigHandler);
+	// Setup device file link
+	if (!OpenLink()) {
+		exit(1);
+	}
 
 	if (config.tcpPort != 0) {
 		/* Open the socket for communications */
-		sockFd = socket(AF_INET, SOCK_STREAM, 6);
+		sockFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 6);
 		if ( sockFd == -1 ) {
 			syslog(LOG_ERR, "Can't open socket: %m");
+			Cleanup();
 			exit(1);
 		}
 
 		addr.sin_family = AF_INET;
 		addr.sin_addr.s_addr = 0;
 		addr.sin_port = htons(config.tcpPort);
-	 
+
 		/* Set up to listen on the given port */
 		if( bind( sockFd, (struct sockaddr*)(&addr),
 			sizeof(struct sockaddr_in)) < 0 ) {
 			syslog(LOG_ERR, "Couldn't bind port %d, aborting: %m", config.tcpPort );
+			Cleanup();
 			exit(1);
 		}
 		if ( debug>1 )
 			syslog(LOG_NOTICE,"Bound port");
 
 		/* Tell the system we want to listen on this socket */
-		if ( listen(sockFd, 4) == -1 ) {
+		if ( listen(sockFd, 16) == -1 ) {
 			syslog(LOG_ERR, "Socket listen failed: %m");
+			Cleanup();
 			exit(1);
 		}
 
 		if ( debug>1 )
 			syslog(LOG_NOTICE,"Done listen");
+
+		listenConn.type = CONN_LISTEN;
+		listenConn.fd = sockFd;
+		if (!WatchFd(&listenConn)) {
+			Cleanup();
+			exit(1);
+		}
+	}
+
+	if (config.httpPort != 0) {
+		if (!OpenHttpPort()) {
+			Cleanup();
+			exit(1);
+		}
+		httpListenConn.type = CONN_HTTP_LISTEN;
+		httpListenConn.fd = httpFd;
+		if (!WatchFd(&httpListenConn)) {
+			Cleanup();
+			exit(1);
+		}
+	}
+
+	if (config.unixPath[0] != 0) {
+		if (!OpenUnixSocket()) {
+			Cleanup();
+			exit(1);
+		}
+		unixListenConn.type = CONN_UNIX_LISTEN;
+		unixListenConn.fd = unixFd;
+		if (!WatchFd(&unixListenConn)) {
+			Cleanup();
+			exit(1);
+		}
 	}
 
 	if ( isdaemon ) {
@@ -878,233 +5675,209 @@ int main(int argc, char *argv[])
 		close(2);
 	}
 
-	// Set up the files/sockets for the select() call 
-	FD_SET(linkFd,&fdsread);
-	if ( linkFd >= maxfd ) {
-		maxfd = linkFd + 1;
-	}
-
-	if ( sockFd != -1 ) {
-		FD_SET(sockFd,&fdsread);
-		if ( sockFd >= maxfd ) {
-			maxfd = sockFd + 1;
-		}
-	}
-
 	// Handle any requested charger configuration
 	if (config.enParamOverride) {
-		if (!UpdateParms()) {
+		if (!UpdateParms(&snap)) {
 			syslog(LOG_ERR, "Parameter update failed");
+			Cleanup();
 			exit(1);
 		}
-		paramTimeout = PARAM_CHECK_SECS;
+		CacheApplySnapshot(&devs[0], &snap);
 	}
 
 	if (config.enWatchdog) {
 		if (!EnableWatchdog()) {
-			// Make sure watchdog is completely disabled before we bail
-			(void) DisableWatchdog();
+			// Make sure watchdog is completely disabled before we bail (done in Cleanup)
 			syslog(LOG_ERR, "Watchdog enabled failed");
+			Cleanup();
 			exit(1);
 		}
-		watchdogTimeout = WD_UPDATE_SECS;
 	}
 
+	// Scheduled tasks
+	now = GetMsec();
+	if ((config.tcpIdleSecs > 0) || (config.httpPort != 0)) {
+		EnableTask(TASK_IDLE, 1000, now);
+	}
+	if (config.enAutoShutdown && (config.gpioAlert < 0)) {
+		EnableTask(TASK_ALERT, config.alertPeriodMs, now);
+	}
+	if (config.enParamOverride) {
+		EnableTask(TASK_PARAMS, config.paramPeriodMs, now);
+	}
 	if (config.enLogging) {
-		logTimeout = config.logDelay;
-		LogValueNames();
+		EnableTask(TASK_LOG, config.logDelayMs, now);
+	}
+	n = 0;
+	for (i=1; i<MAX_CHARGERS; i++) {
+		if (devs[i].enabled) {
+			// Spread the first polls so chargers with the same period aren't due together
+			devs[i].pollDue = now + (n++ * SCHED_MIN_PERIOD_MS);
+		}
+	}
+	if (n > 0) {
+		EnableTask(TASK_POLL, SCHED_MIN_PERIOD_MS, now);
+	}
+	if ((config.enLogging && (config.logFormat == LOGFMT_TEXT)) || (n > 0)) {
+		EnableTask(TASK_LOGFILE, 1000, now);
+	}
+	if (config.enWatchdog) {
+		EnableTask(TASK_WATCHDOG, config.wdPeriodMs, now);
+	}
+	if ((shm != NULL) || (config.httpPort != 0)) {
+		EnableTask(TASK_REFRESH, 1000, now);
+	}
+	if (config.enHistory) {
+		EnableTask(TASK_HISTORY, config.histPeriodMs, now);
+	}
+	schedConn.type = CONN_TIMER;
+	if ((schedConn.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "timerfd_create failed: %m");
+		goto err_exit;
+	}
+	if (!ScheduleTasks() || !WatchFd(&schedConn)) {
+		goto err_exit;
 	}
 
+	// Subscription sampler timer (armed when there are subscriptions)
+	samplerConn.type = CONN_SAMPLER;
+	if (((samplerConn.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) == -1) || !WatchFd(&samplerConn)) {
+		syslog(LOG_ERR, "Could not create sampler timer: %m");
+		goto err_exit;
+	}
+
+	// From here on all charger access is through the I2C worker
+	if (!StartI2cWorker()) {
+		goto err_exit;
+	}
 
-	// Initial timestamp for timed activities
-	gettimeofday(&prev_time, NULL);
+	// Charger outputs replace the alert polling.  The lines are read once at start in
+	// case an edge came before they were requested.
+	if ((config.gpioAlert >= 0) || (config.gpioNight >= 0)) {
+		if (!OpenGpio()) {
+			goto err_exit;
+		}
+		GpioConfirm();
+	}
 
 	// Main loop
 	while (1) {
 
-		// Wait for data from the listening socket, the linked,
-		// device, or the remote connection or evaluate any 
-		// activities on 1 second intervals 
-		fdsreaduse = fdsread;
-		select_timeout.tv_sec = 1;
-		select_timeout.tv_usec = 0;
-		if ( (c = select(maxfd,&fdsreaduse,NULL,NULL,&select_timeout)) == -1 ) {
+		// Wait for data from the listening socket, the linked device,
+		// the remote connections, a signal, the I2C worker or the timers
+		if ( (n = epoll_wait(epollFd, events, MAX_EVENTS, (pendHead != NULL) ? 0 : -1)) == -1 ) {
+			if (errno == EINTR) {
+				continue;
+			}
+			syslog(LOG_ERR, "epoll_wait failed: %m");
 			break;
 		}
+		loopStart = StatsUsec();
+
+		for (i=0; i<n; i++) {
+			connP = (conn_t*) events[i].data.ptr;
+			if (connP->fd == -1) {
+				// Closed while handling an earlier event
+				continue;
+			}
 
-		// Activity on the socket 
-		if ( config.tcpPort && FD_ISSET(sockFd,&fdsreaduse) ) {
-			int fd;
+			switch (connP->type) {
+			case CONN_LISTEN:
+				AcceptConnection();
+				break;
 
-			// Accept the remote systems attachment 
-			remoteaddrlen = sizeof(struct sockaddr_in);
-			fd = accept(sockFd,(struct sockaddr*)(&remoteaddr),
-				&remoteaddrlen);
+			case CONN_HTTP_LISTEN:
+				AcceptHttpConnection();
+				break;
 
-			if ( fd == -1 )
-				syslog(LOG_ERR,"accept failed: %m");
-			else if (curSockConnects < config.tcpMaxConnections) {
-				unsigned long ip;
+			case CONN_UNIX_LISTEN:
+				AcceptUnixConnection();
+				break;
 
-				remotefd[curSockConnects++] = fd;
-				if (!AddCmdBuf(fd)) {
-					syslog(LOG_ERR, "Internal error, did not have cmdBuf for socket");
-					goto err_exit;
+			case CONN_UNIX:
+				if (events[i].events & EPOLLOUT) {
+					FlushConnection(connP);
 				}
-				// Tell select to watch this new socket 
-				FD_SET(fd,&fdsread);
-				if ( fd >= maxfd )
-					maxfd = fd + 1;
-				ip = ntohl(remoteaddr.sin_addr.s_addr);
-				if (debug>0)
-					syslog(LOG_NOTICE, "Connection from %d.%d.%d.%d",
-						(int)(ip>>24)&0xff,
-						(int)(ip>>16)&0xff,
-						(int)(ip>>8)&0xff,
-						(int)(ip>>0)&0xff);
-			}
-			else {
-				// Too many connections, just close it to reject
-				close(fd);
-			}
-		}
-
-		// Data to read from the linked device file 
-		if ( FD_ISSET(linkFd,&fdsreaduse) ) {
-			devbytes = read(linkFd,devbuf,MAX_STRING_LEN);
-			if (debug>1)
-				syslog(LOG_INFO,"%s: %d bytes", linkname, devbytes);
-			if ( devbytes <= 0 ) {
-				if ( debug>0 ) {
-					syslog(LOG_INFO,"%s closed",linkname);
+				if ((connP->fd != -1) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+					HandleUnixRead(connP);
 				}
-				close(linkFd);
-				(void) DeleteCmdBuf(linkFd);
-				FD_CLR(linkFd,&fdsread);
-				while (1) {
-					linkFd = open("/dev/ptmx", O_RDWR);
-					if ( linkFd != -1 )
-						break;
-					syslog(LOG_ERR, "Open of /dev/ptmx failed: %m");
-					if ( errno != EIO )
-						goto err_exit;
-					sleep(1);
-				}
-				if ( debug>0 ) {
-					syslog(LOG_INFO,"/dev/ptmx re-opened");
+				break;
+
+			case CONN_HTTP:
+				if (events[i].events & EPOLLOUT) {
+					FlushConnection(connP);
 				}
-				if (!LinkSlave(linkFd)) {
-					syslog(LOG_ERR, "Cannot recreate link for psuedo-tty: %m");
-					goto err_exit;
+				if ((connP->fd != -1) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+					HandleHttpRead(connP);
 				}
-				(void) AddCmdBuf(linkFd);
-				FD_SET(linkFd,&fdsread);
-				if ( linkFd >= maxfd )
-					maxfd = linkFd + 1;
-			}
-			else {
-				// Process command
-				devbuf[devbytes] = 0;
-				if (debug > 2) syslog(LOG_INFO, "%s received %s", linkname, devbuf);
-				if ((curCmdBufP = GetCmdBufPtr(linkFd)) == NULL) {
-					syslog(LOG_ERR, "Internal error, could not find cmdBuf for linkFd");
-					goto err_exit;
+				break;
+
+			case CONN_SIGNAL:
+				if (read(signalConn.fd, &sigInfo, sizeof(sigInfo)) != sizeof(sigInfo)) {
+					break;
 				}
-				if (ProcessCmdBytes(devbuf, devbytes, curCmdBufP)) {
-					if (debug > 2) syslog(LOG_INFO, "%s sent %s", linkname, rspFifo);
-					write(linkFd, rspFifo, strlen(rspFifo));
+				if (sigInfo.ssi_signo == SIGHUP) {
+					// Reopen the log files (for example after logrotate has moved them)
+					(void) LogForEachText(TextLogReopen, "Reopen");
+				} else {
+					Cleanup();
+					syslog(LOG_NOTICE, "Terminating on signal %d", sigInfo.ssi_signo);
+					exit(0);
 				}
-			}
-		}
-
-		// Data to read from the remote system 
-		for (i=0 ; i<curSockConnects ; i++) {
-			if (FD_ISSET(remotefd[i],&fdsreaduse) ) {
-
-				devbytes = read(remotefd[i],devbuf,MAX_STRING_LEN);
-
-				if (debug>1)
-					syslog(LOG_INFO,"Remote: %d bytes",devbytes);
-
-				if ( devbytes == 0 ) {
-					register int j;
+				break;
 
-					if (debug>0) {
-						syslog(LOG_NOTICE,"Connection closed");
-					}
-					(void) DeleteCmdBuf(remotefd[i]);
-					close(remotefd[i]);
-					FD_CLR(remotefd[i],&fdsread);
-					curSockConnects--;
-					for (j=i ; j<curSockConnects ; j++) {
-						remotefd[j] = remotefd[j+1];
-					}
+			case CONN_PTY:
+			case CONN_TCP:
+				if (events[i].events & EPOLLOUT) {
+					FlushConnection(connP);
 				}
-				else {
-					// Process command
-					devbuf[devbytes] = 0;
-					if (debug > 2) syslog(LOG_INFO, "Remote received %s", devbuf);
-					if ((curCmdBufP = GetCmdBufPtr(remotefd[i])) == NULL) {
-						syslog(LOG_ERR, "Internal error, could not find cmdBuf for socket fd %d", remotefd[i]);
+				if ((connP->fd != -1) && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+					if (!HandleClientRead(connP)) {
 						goto err_exit;
 					}
-					if (ProcessCmdBytes(devbuf, devbytes, curCmdBufP)) {
-						if (debug > 2) syslog(LOG_INFO, "Remote sent %s", rspFifo);
-						write(remotefd[i], rspFifo, strlen(rspFifo));
-					}
 				}
-			}
-		}
+				break;
 
-		// Check for activities to do on second boundaries
-		//   prev_time 
-		if (SecTick(&prev_time)) {
-			if (config.enAutoShutdown) {
-				if (!CheckAlertStatus(&alertDetected)) {
-					goto err_exit;
+			case CONN_SAMPLER:
+				if (read(samplerConn.fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					ServiceSampler();
 				}
-				if (alertDetected) {
-					syslog(LOG_CRIT, "Low Battery shutdown");
-					system("sudo shutdown now");
-				}
-			}
-			if (config.enParamOverride) {
-				if (--paramTimeout == 0) {
-					paramTimeout = PARAM_CHECK_SECS;
-					if (!UpdateParms()) {
-						goto err_exit;
-					}
+				break;
+
+			case CONN_GPIO:
+				HandleGpioEvents();
+				break;
+
+			case CONN_I2C:
+				if (read(i2cConn.fd, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+					ServiceI2cDone();
 				}
-			}
-			if (config.enLogging) {
-				if (--logTimeout == 0) {
-					logTimeout = config.logDelay;
-					if (!LogValues(&prev_time)) {
-						goto err_exit;
-					}
+				break;
+
+			case CONN_TIMER:
+				if (read(schedConn.fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+					break;
 				}
-			}
-			if (config.enWatchdog) {
-				if (--watchdogTimeout == 0) {
-					watchdogTimeout = WD_UPDATE_SECS;
-					if (!EnableWatchdog()) {
-						goto err_exit;
-					}
+				if (!ServiceTasks()) {
+					goto err_exit;
 				}
+				break;
 			}
 		}
+
+		// Continue any pipelined commands and then free closed connections
+		ServicePending();
+		FreeDeadConnections();
+		StatsHistSince(&counters.loopTime, loopStart);
+
+		if (!CheckChargerLink()) {
+			break;
+		}
 	}
 
 err_exit:
-	// We normally only exit from a signal (via the signal handler) so this
-	// is used for an  error exit
-	close(sockFd);
-	for (i=0 ; i<curSockConnects ; i++)
-		close(remotefd[i]);
-	close(linkFd);
-	if (config.enLogging) 
-		close(logFd);
-	if (config.enWatchdog) 
-		(void) DisableWatchdog();
+	// We normally only exit from a signal (via the event loop) so this
+	// is used for an error exit
+	Cleanup();
 	exit(1);
 }
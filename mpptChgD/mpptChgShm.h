@@ -0,0 +1,211 @@
+/*
+ * mpptChgShm.h - mpptChgD shared memory telemetry segment
+ *
+ * When enabled (SHM=1) the daemon publishes the latest value of every charger
+ * register in a POSIX shared memory segment.  Local programs can read the current
+ * state without a system call or any I2C traffic using the inline reader functions
+ * below (link with -lrt on older systems for shm_open).
+ *
+ *   mpptShm_t* shm = MpptShmOpen(MPPT_SHM_NAME);
+ *   mpptShmSample_t s;
+ *   int vb = MpptShmFindReg(shm, "VB");
+ *
+ *   if (MpptShmRead(shm, &s) && (s.validMask & (1 << vb))) {
+ *       printf("VB = %d mV\n", s.val[vb]);
+ *   }
+ *   MpptShmClose(shm);
+ *
+ * The values are protected by a sequence lock: the daemon makes the sequence count
+ * odd while it updates the values and even again when it is done.  A reader copies
+ * the values and tries again if the count was odd or changed during the copy.
+ * The daemon's counters are published with the values and read the same way with
+ * MpptShmReadStats().
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __MPPTCHGSHM_H__
+#define __MPPTCHGSHM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+//
+// Constants
+//
+#define MPPT_SHM_NAME       "/mpptChgD"
+#define MPPT_SHM_MAGIC      0x4D505054
+#define MPPT_SHM_VERSION    2
+
+#define MPPT_SHM_MAX_REGS   32
+#define MPPT_SHM_NAME_LEN   12
+
+// Number of times a reader retries while the daemon is updating the values
+#define MPPT_SHM_READ_TRIES 100
+
+
+//
+// Segment layout.  The header fields are written once when the daemon creates the
+// segment.  Everything after seq is only valid when read under the sequence lock.
+//
+typedef struct {
+	uint32_t validMask;                     // Bit n set if val[n] holds a value
+	uint32_t reserved;
+	uint64_t sampleCount;                   // Incremented for every update
+	uint64_t timeMs;                        // Unix time (mSec) of the update
+	int32_t val[MPPT_SHM_MAX_REGS];
+	uint64_t valTimeMs[MPPT_SHM_MAX_REGS];  // Unix time (mSec) each value was read
+} mpptShmSample_t;
+
+typedef struct {
+	uint64_t uptimeSec;
+	uint64_t i2cTransactions;
+	uint64_t i2cErrors;
+	uint64_t i2cRetries;
+	uint64_t cacheHits;
+	uint64_t cacheMisses;
+	uint64_t connections;                   // TCP connections accepted
+	uint64_t commands;                      // Client commands processed
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t loopP99Us;                     // Event loop iteration time (99th percentile)
+	uint64_t i2cP99Us;                      // I2C transaction time (99th percentile)
+} mpptShmStats_t;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t numRegs;
+	uint32_t pid;                           // Daemon process id
+	char names[MPPT_SHM_MAX_REGS][MPPT_SHM_NAME_LEN];
+	uint32_t seq;
+	uint32_t reserved;
+	mpptShmSample_t sample;
+	mpptShmStats_t stats;
+} mpptShm_t;
+
+
+//
+// Reader API
+//
+
+// Map the segment read-only.  Returns NULL if it doesn't exist or isn't compatible.
+static inline mpptShm_t* MpptShmOpen(const char* name)
+{
+	struct stat st;
+	mpptShm_t* shm;
+	int fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1) {
+		return NULL;
+	}
+	if ((fstat(fd, &st) == -1) || (st.st_size < (off_t) sizeof(mpptShm_t))) {
+		close(fd);
+		return NULL;
+	}
+	shm = (mpptShm_t*) mmap(NULL, sizeof(mpptShm_t), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		return NULL;
+	}
+
+	if ((shm->magic != MPPT_SHM_MAGIC) || (shm->version != MPPT_SHM_VERSION)) {
+		munmap(shm, sizeof(mpptShm_t));
+		return NULL;
+	}
+
+	return shm;
+}
+
+
+static inline void MpptShmClose(mpptShm_t* shm)
+{
+	munmap(shm, sizeof(mpptShm_t));
+}
+
+
+// Returns the value index for a register name or -1 if it isn't found
+static inline int MpptShmFindReg(const mpptShm_t* shm, const char* regS)
+{
+	int i;
+
+	for (i=0; i<(int) shm->numRegs; i++) {
+		if (strncmp(shm->names[i], regS, MPPT_SHM_NAME_LEN) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+
+// Copy a consistent sample.  Returns false if the daemon was updating the values
+// for every try.
+static inline bool MpptShmRead(const mpptShm_t* shm, mpptShmSample_t* sample)
+{
+	uint32_t seq;
+	int i;
+
+	for (i=0; i<MPPT_SHM_READ_TRIES; i++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) == 0) {
+			memcpy(sample, (const void*) &shm->sample, sizeof(mpptShmSample_t));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+// Copy a consistent set of daemon counters.  Returns false if the daemon was updating
+// them for every try.
+static inline bool MpptShmReadStats(const mpptShm_t* shm, mpptShmStats_t* stats)
+{
+	uint32_t seq;
+	int i;
+
+	for (i=0; i<MPPT_SHM_READ_TRIES; i++) {
+		seq = __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) == 0) {
+			memcpy(stats, (const void*) &shm->stats, sizeof(mpptShmStats_t));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&shm->seq, __ATOMIC_RELAXED) == seq) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+
+// Returns the sequence count which changes with every update so a reader can cheaply
+// check for a new sample without copying the values
+static inline uint32_t MpptShmSeq(const mpptShm_t* shm)
+{
+	return __atomic_load_n(&shm->seq, __ATOMIC_ACQUIRE);
+}
+
+#endif /* __MPPTCHGSHM_H__ */
@@ -0,0 +1,85 @@
+/*
+ * mpptLogConv - convert a mpptChgD binary log to the text log format
+ *
+ * Writes the records held in a binary log (LOG_FORMAT=BINARY), oldest first, in the
+ * same format as the daemon's text log so existing tools can read it.
+ *
+ * Usage: mpptLogConv <binary log file> [text file]
+ *
+ * The text is written to stdout if no text file is given.  The log may be converted
+ * while the daemon is running.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "binLog.h"
+
+
+int main(int argc, char *argv[])
+{
+	binLog_t log;
+	FILE* fp = stdout;
+	int vals[BINLOG_MAX_REGS];
+	uint64_t t;
+	uint32_t i, n;
+	int j;
+
+	if ((argc < 2) || (argc > 3)) {
+		printf("Usage: mpptLogConv <binary log file> [text file]\n");
+		return 1;
+	}
+
+	if (!BinLogOpenRead(&log, argv[1])) {
+		fprintf(stderr, "Could not open binary log %s: %s\n", argv[1], strerror(errno));
+		return 1;
+	}
+
+	if ((argc == 3) && ((fp = fopen(argv[2], "w")) == NULL)) {
+		fprintf(stderr, "Could not create %s: %s\n", argv[2], strerror(errno));
+		BinLogClose(&log);
+		return 1;
+	}
+
+	fprintf(fp, "LOGGING: ");
+	for (j=0; j<(int) log.hdr->numRegs; j++) {
+		fprintf(fp, "%.*s ", BINLOG_NAME_LEN, log.hdr->names[j]);
+	}
+	fprintf(fp, "\n");
+
+	n = BinLogCount(&log);
+	for (i=0; i<n; i++) {
+		BinLogGet(&log, i, &t, vals);
+		if (log.hdr->flags & BINLOG_FLAG_MSEC) {
+			fprintf(fp, "%ld.%03d: ", (long) (t / 1000), (int) (t % 1000));
+		} else {
+			fprintf(fp, "%ld: ", (long) (t / 1000));
+		}
+		for (j=0; j<(int) log.hdr->numRegs; j++) {
+			fprintf(fp, "%d ", vals[j]);
+		}
+		fprintf(fp, "\n");
+	}
+
+	if (fp != stdout) {
+		fclose(fp);
+	}
+	BinLogClose(&log);
+
+	return 0;
+}
@@ -0,0 +1,97 @@
+/*
+ * stats.c - mpptChgD fixed-bucket latency histograms
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdbool.h>
+#include <time.h>
+#include "stats.h"
+
+
+const uint32_t statsBucketUs[STATS_NUM_BUCKETS - 1] = {
+	10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000, 20000, 50000, 100000, 200000, 500000
+};
+
+
+uint64_t StatsUsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
+
+
+void StatsHistAdd(statsHist_t* h, uint64_t us)
+{
+	uint64_t max;
+	int i;
+
+	for (i=0; i<STATS_NUM_BUCKETS-1; i++) {
+		if (us <= statsBucketUs[i]) {
+			break;
+		}
+	}
+	__atomic_fetch_add(&h->bucket[i], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->sumUs, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&h->maxUs, __ATOMIC_RELAXED);
+	while ((us > max) &&
+	       !__atomic_compare_exchange_n(&h->maxUs, &max, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+}
+
+
+void StatsHistSince(statsHist_t* h, uint64_t startUs)
+{
+	StatsHistAdd(h, StatsUsec() - startUs);
+}
+
+
+void StatsHistCopy(statsHist_t* dst, const statsHist_t* src)
+{
+	int i;
+
+	// The count is the sum of the buckets so it is consistent with them
+	dst->count = 0;
+	for (i=0; i<STATS_NUM_BUCKETS; i++) {
+		dst->bucket[i] = __atomic_load_n(&src->bucket[i], __ATOMIC_RELAXED);
+		dst->count += dst->bucket[i];
+	}
+	dst->sumUs = __atomic_load_n(&src->sumUs, __ATOMIC_RELAXED);
+	dst->maxUs = __atomic_load_n(&src->maxUs, __ATOMIC_RELAXED);
+}
+
+
+uint64_t StatsHistPercentile(const statsHist_t* h, int perMille)
+{
+	uint64_t n, target;
+	int i;
+
+	if (h->count == 0) {
+		return 0;
+	}
+
+	target = ((h->count * perMille) + 999) / 1000;
+	n = 0;
+	for (i=0; i<STATS_NUM_BUCKETS-1; i++) {
+		n += h->bucket[i];
+		if (n >= target) {
+			return (statsBucketUs[i] < h->maxUs) ? statsBucketUs[i] : h->maxUs;
+		}
+	}
+	return h->maxUs;
+}
@@ -0,0 +1,68 @@
+/*
+ * stats.h - mpptChgD fixed-bucket latency histograms
+ *
+ * Histograms have a fixed set of buckets so recording a value is a short bucket search
+ * and a few atomic adds with no allocation.  Values may be recorded from any thread.
+ * Percentiles are estimated as the upper bound of the bucket they fall in (or the
+ * maximum recorded value for the last bucket).
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdint.h>
+
+
+//
+// Constants
+//
+
+// Buckets hold values up to 10, 20, 50, ... 500000 uSec and the last holds the rest
+#define STATS_NUM_BUCKETS   16
+
+
+typedef struct {
+	uint64_t count;
+	uint64_t sumUs;
+	uint64_t maxUs;
+	uint64_t bucket[STATS_NUM_BUCKETS];
+} statsHist_t;
+
+// Upper bound of each bucket but the last (uSec)
+extern const uint32_t statsBucketUs[STATS_NUM_BUCKETS - 1];
+
+
+//
+// API
+//
+
+// Monotonic time in uSec
+uint64_t StatsUsec();
+
+// Record a value
+void StatsHistAdd(statsHist_t* h, uint64_t us);
+
+// Record the time since start
+void StatsHistSince(statsHist_t* h, uint64_t startUs);
+
+// Take a copy for reporting
+void StatsHistCopy(statsHist_t* dst, const statsHist_t* src);
+
+// Estimate the value below which perMille/1000 of the values in a copy fall
+uint64_t StatsHistPercentile(const statsHist_t* h, int perMille);
+
+#endif /* __STATS_H__ */
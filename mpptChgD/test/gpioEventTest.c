@@ -0,0 +1,134 @@
+/*
+ * gpioEventTest - checks of GpioReadEvent with edge events written to a pipe
+ *
+ * Writes the gpio_v2_line_event records the kernel would queue for a line request to
+ * a pipe and checks that GpioReadEvent maps each one to its line and direction, skips
+ * events for lines that weren't requested and reports an empty queue.  No gpiochip is
+ * needed.  Exits with 0 if every check passed.
+ *
+ * Usage: gpioEventTest
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/gpio.h>
+#include "gpioEvent.h"
+
+
+// Line offsets on the (imaginary) chip for the two requested lines and one that wasn't
+#define TEST_OFFSET_0       3
+#define TEST_OFFSET_1       5
+#define TEST_OFFSET_OTHER   9
+
+int failures = 0;
+
+
+// Queue an edge event as the kernel would
+bool WriteEvent(int fd, int offset, bool rising, uint64_t tNs)
+{
+	struct gpio_v2_line_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.offset = offset;
+	ev.id = rising ? GPIO_V2_LINE_EVENT_RISING_EDGE : GPIO_V2_LINE_EVENT_FALLING_EDGE;
+	ev.timestamp_ns = tNs;
+	return write(fd, &ev, sizeof(ev)) == sizeof(ev);
+}
+
+
+// Read the next event and check it is for line with the expected direction and time
+bool CheckEvent(const char* name, gpioLines_t* g, int line, bool active, uint64_t tNs)
+{
+	uint64_t t;
+	bool a;
+	int l;
+
+	if (!GpioReadEvent(g, &l, &a, &t)) {
+		printf("FAIL %s: no event (%s)\n", name, strerror(errno));
+		return false;
+	}
+	if ((l != line) || (a != active) || (t != tNs)) {
+		printf("FAIL %s: line %d active %d t %llu\n", name, l, a, (unsigned long long) t);
+		return false;
+	}
+	printf("PASS %s\n", name);
+	return true;
+}
+
+
+// Check the queue is empty
+bool CheckEmpty(const char* name, gpioLines_t* g)
+{
+	uint64_t t;
+	bool a;
+	int l;
+
+	if (GpioReadEvent(g, &l, &a, &t)) {
+		printf("FAIL %s: unexpected event for line %d\n", name, l);
+		return false;
+	}
+	if (errno != EAGAIN) {
+		printf("FAIL %s: %s\n", name, strerror(errno));
+		return false;
+	}
+	printf("PASS %s\n", name);
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	gpioLines_t g;
+	int p[2];
+
+	if (pipe2(p, O_NONBLOCK) == -1) {
+		printf("FAIL could not create pipe\n");
+		return 1;
+	}
+	g.fd = p[0];
+	g.n = 2;
+	g.offsets[0] = TEST_OFFSET_0;
+	g.offsets[1] = TEST_OFFSET_1;
+
+	if (!WriteEvent(p[1], TEST_OFFSET_0, true, 100) ||
+	    !WriteEvent(p[1], TEST_OFFSET_OTHER, true, 200) ||
+	    !WriteEvent(p[1], TEST_OFFSET_1, false, 300)) {
+		printf("FAIL could not queue events\n");
+		return 1;
+	}
+
+	if (!CheckEvent("rising edge on line 0", &g, 0, true, 100)) {
+		failures++;
+	}
+	if (!CheckEvent("falling edge on line 1 after an unrequested line", &g, 1, false, 300)) {
+		failures++;
+	}
+	if (!CheckEmpty("empty queue", &g)) {
+		failures++;
+	}
+
+	close(p[1]);
+	GpioClose(&g);
+
+	return (failures == 0) ? 0 : 1;
+}
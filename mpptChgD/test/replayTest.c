@@ -0,0 +1,124 @@
+/*
+ * replayTest - checks of the charger replay backend with short recordings
+ *
+ * Replays recordings that wrap after a few mSec or less (one entry, or a few entries
+ * with the same time) and checks that reads return the recorded values and don't
+ * hang while the replay keeps wrapping.  Exits with 0 if every check passed.
+ *
+ * Usage: replayTest
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include "chgBackend.h"
+
+
+// A check that hangs is a failure
+#define TEST_TIMEOUT_SECS   5
+
+// Reads made by each check and the time between them (uSec).  Together they span many
+// passes through the recordings.
+#define TEST_READS          50
+#define TEST_READ_GAP_US    2000
+
+const char* testName = "";
+int failures = 0;
+
+
+void Timeout(int sig)
+{
+	printf("FAIL %s: read did not return\n", testName);
+	_exit(1);
+}
+
+
+// Replay the recording and check every read of regAddr returns one of the values
+bool RunReplay(const char* name, const char* recording, int regAddr, const int* vals, int numVals)
+{
+	chgBackendParams_t p;
+	chgBackend_t* b;
+	char fileName[] = "/tmp/replayTestXXXXXX";
+	unsigned char buf[2];
+	FILE* fp;
+	int fd, i, j, v;
+
+	testName = name;
+	if (((fd = mkstemp(fileName)) == -1) || ((fp = fdopen(fd, "w")) == NULL)) {
+		printf("FAIL %s: could not create recording\n", name);
+		return false;
+	}
+	fputs(recording, fp);
+	fclose(fp);
+
+	memset(&p, 0, sizeof(p));
+	p.type = CHG_BACKEND_REPLAY;
+	p.replayFile = fileName;
+	b = ChgBackendOpen(&p);
+	unlink(fileName);
+	if (b == NULL) {
+		printf("FAIL %s: could not open recording\n", name);
+		return false;
+	}
+
+	alarm(TEST_TIMEOUT_SECS);
+	for (i=0; i<TEST_READS; i++) {
+		if (!ChgRead(b, regAddr, 2, buf)) {
+			printf("FAIL %s: read %d failed\n", name, i);
+			ChgBackendClose(b);
+			return false;
+		}
+		v = (buf[0] << 8) | buf[1];
+		for (j=0; (j<numVals) && (vals[j] != v); j++) {}
+		if (j == numVals) {
+			printf("FAIL %s: read %d returned 0x%04X\n", name, i, v);
+			ChgBackendClose(b);
+			return false;
+		}
+		usleep(TEST_READ_GAP_US);
+	}
+	alarm(0);
+
+	ChgBackendClose(b);
+	printf("PASS %s\n", name);
+	return true;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const int single[] = {0x1020};
+	const int sameTime[] = {0x1020, 0x1021};
+	const int twoMs[] = {0x1020, 0x1021, 0x1022};
+
+	signal(SIGALRM, Timeout);
+
+	if (!RunReplay("single entry", "0 R 0 1020\n", 0, single, 1)) {
+		failures++;
+	}
+	if (!RunReplay("entries at the same time", "0 R 0 1020\n0 R 0 1021\n", 0, sameTime, 2)) {
+		failures++;
+	}
+	if (!RunReplay("2 mSec recording", "0 R 0 1020\n1 R 0 1021\n2 R 0 1022\n", 0, twoMs, 3)) {
+		failures++;
+	}
+
+	return (failures == 0) ? 0 : 1;
+}
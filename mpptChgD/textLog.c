@@ -0,0 +1,235 @@
+/*
+ * textLog.c - mpptChgD buffered text log file
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "textLog.h"
+
+
+static uint64_t TextLogMsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t) ts.tv_sec * 1000) + (ts.tv_nsec / 1000000);
+}
+
+
+static bool TextLogWrite(textLog_t* log, const char* data, int len)
+{
+	int n;
+
+	while (len > 0) {
+		if ((n = write(log->fd, data, len)) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		len -= n;
+		log->fileSize += n;
+		log->unsynced = true;
+	}
+
+	return true;
+}
+
+
+static bool TextLogOpenFile(textLog_t* log)
+{
+	struct stat st;
+
+	if ((log->fd = open(log->fileName, O_CREAT | O_APPEND | O_WRONLY | O_CLOEXEC, S_IWUSR | S_IRUSR | S_IRGRP | S_IROTH)) == -1) {
+		return false;
+	}
+	log->fileSize = (fstat(log->fd, &st) == 0) ? st.st_size : 0;
+	log->files++;
+	log->openMsec = TextLogMsec();
+	log->syncMsec = log->openMsec;
+	log->unsynced = false;
+
+	return TextLogWrite(log, log->header, strlen(log->header));
+}
+
+
+static bool TextLogRotate(textLog_t* log)
+{
+	bool success;
+	char* from;
+	char* to;
+	int i, len;
+
+	success = TextLogFlush(log);
+	if (log->p.fsyncSecs > 0) {
+		(void) fdatasync(log->fd);
+	}
+	close(log->fd);
+	log->fd = -1;
+
+	// Shift <file>.1 ... <file>.<keep-1> up one, dropping the oldest
+	len = strlen(log->fileName) + 4;
+	from = (char*) malloc(len);
+	to = (char*) malloc(len);
+	if ((from == NULL) || (to == NULL)) {
+		free(from);
+		free(to);
+		(void) TextLogOpenFile(log);
+		return false;
+	}
+	if (log->p.keep > 0) {
+		for (i=log->p.keep-1; i>=1; i--) {
+			sprintf(from, "%s.%d", log->fileName, i);
+			sprintf(to, "%s.%d", log->fileName, i+1);
+			(void) rename(from, to);
+		}
+		sprintf(to, "%s.1", log->fileName);
+		if (rename(log->fileName, to) == -1) {
+			success = false;
+		}
+	} else if (unlink(log->fileName) == -1) {
+		success = false;
+	}
+	free(from);
+	free(to);
+
+	return TextLogOpenFile(log) && success;
+}
+
+
+bool TextLogOpen(textLog_t* log, const char* fileName, const char* header, textLogParams_t* params)
+{
+	log->p = *params;
+	if (log->p.batchRecs < 1) {
+		log->p.batchRecs = 1;
+	}
+	if (log->p.keep < 0) {
+		log->p.keep = 0;
+	} else if (log->p.keep > TEXTLOG_MAX_KEEP) {
+		log->p.keep = TEXTLOG_MAX_KEEP;
+	}
+	log->fileName = fileName;
+	log->header = header;
+	log->bufLen = 0;
+	log->bufRecs = 0;
+	log->files = 0;
+
+	return TextLogOpenFile(log);
+}
+
+
+bool TextLogAppend(textLog_t* log, const char* line, int len)
+{
+	bool success = true;
+
+	if ((log->bufLen + len) > TEXTLOG_BUF_SIZE) {
+		success = TextLogFlush(log);
+	}
+
+	if (len > TEXTLOG_BUF_SIZE) {
+		success = TextLogWrite(log, line, len) && success;
+	} else {
+		if (log->bufRecs == 0) {
+			log->bufMsec = TextLogMsec();
+		}
+		memcpy(&log->buf[log->bufLen], line, len);
+		log->bufLen += len;
+		if (++log->bufRecs >= log->p.batchRecs) {
+			success = TextLogFlush(log) && success;
+		}
+	}
+
+	if ((log->p.maxSize > 0) && (log->fileSize >= log->p.maxSize)) {
+		success = TextLogRotate(log) && success;
+	}
+
+	return success;
+}
+
+
+bool TextLogTick(textLog_t* log)
+{
+	bool success = true;
+	uint64_t now;
+
+	now = TextLogMsec();
+	if ((log->bufRecs > 0) && ((now - log->bufMsec) >= ((uint64_t) log->p.flushSecs * 1000))) {
+		success = TextLogFlush(log);
+	}
+
+	if (log->unsynced && (log->p.fsyncSecs > 0) &&
+	    ((now - log->syncMsec) >= ((uint64_t) log->p.fsyncSecs * 1000))) {
+		if (fdatasync(log->fd) == -1) {
+			success = false;
+		}
+		log->unsynced = false;
+		log->syncMsec = now;
+	}
+
+	if (((log->p.rotateSecs > 0) && ((now - log->openMsec) >= ((uint64_t) log->p.rotateSecs * 1000))) ||
+	    ((log->p.maxSize > 0) && (log->fileSize >= log->p.maxSize))) {
+		success = TextLogRotate(log) && success;
+	}
+
+	return success;
+}
+
+
+bool TextLogFlush(textLog_t* log)
+{
+	bool success;
+
+	if (log->bufLen == 0) {
+		return true;
+	}
+
+	// Lines that could not be written are dropped so the buffer can't back up
+	success = TextLogWrite(log, log->buf, log->bufLen);
+	log->bufLen = 0;
+	log->bufRecs = 0;
+
+	return success;
+}
+
+
+bool TextLogReopen(textLog_t* log)
+{
+	bool success;
+
+	success = TextLogFlush(log);
+	close(log->fd);
+
+	return TextLogOpenFile(log) && success;
+}
+
+
+void TextLogClose(textLog_t* log)
+{
+	(void) TextLogFlush(log);
+	if (log->p.fsyncSecs > 0) {
+		(void) fdatasync(log->fd);
+	}
+	close(log->fd);
+	log->fd = -1;
+}
@@ -0,0 +1,88 @@
+/*
+ * textLog.h - mpptChgD buffered text log file
+ *
+ * Log lines are collected in a buffer and written to the file in batches.  The file
+ * may be periodically synced to the disk and is rotated by size and/or age with up
+ * to a configured number of old files kept (<file>.1 is the newest).  Each new file
+ * starts with the header line.
+ *
+ * Copyright (c) 2018-2019 Dan Julio (dan@danjuliodesigns.com)
+ *
+ * mpptChgD is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * mpptChg is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * See <http://www.gnu.org/licenses/>.
+ *
+ */
+#ifndef __TEXTLOG_H__
+#define __TEXTLOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+//
+// Constants
+//
+#define TEXTLOG_BUF_SIZE   4096
+#define TEXTLOG_MAX_KEEP   99
+
+
+typedef struct {
+	int batchRecs;          // Lines collected per write
+	int flushSecs;          // Maximum seconds a line is held before it is written
+	int fsyncSecs;          // Seconds between syncs of written lines to disk (0 = never)
+	long maxSize;           // Rotate when the file reaches this many bytes (0 = never)
+	int rotateSecs;         // Rotate after the file has been open this long (0 = never)
+	int keep;               // Number of rotated files kept
+} textLogParams_t;
+
+typedef struct {
+	textLogParams_t p;
+	const char* fileName;
+	const char* header;
+	int fd;
+	char buf[TEXTLOG_BUF_SIZE];
+	int bufLen;
+	int bufRecs;
+	uint64_t bufMsec;       // When the oldest buffered line was added
+	uint64_t openMsec;      // When the file was opened
+	uint64_t syncMsec;      // When the file was last synced
+	bool unsynced;
+	off_t fileSize;
+	unsigned long files;    // Files started by the open, rotations and reopens
+} textLog_t;
+
+
+//
+// API - functions return false with errno set on failure
+//
+
+// Open (appending to) the log file and write the header line
+bool TextLogOpen(textLog_t* log, const char* fileName, const char* header, textLogParams_t* params);
+
+// Add a line to the log
+bool TextLogAppend(textLog_t* log, const char* line, int len);
+
+// Write buffered lines held too long, sync and rotate the file as necessary.  Call
+// periodically.
+bool TextLogTick(textLog_t* log);
+
+// Write buffered lines
+bool TextLogFlush(textLog_t* log);
+
+// Write buffered lines and reopen the file (for example after it has been moved
+// by an external log rotation program)
+bool TextLogReopen(textLog_t* log);
+
+void TextLogClose(textLog_t* log);
+
+#endif /* __TEXTLOG_H__ */